@@ -26,6 +26,7 @@
 #include <sys/socket.h>
 #include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <time.h>
 #include "qemu/compiler.h"
 
 #if defined(__linux__)
@@ -41,6 +42,7 @@
 #endif
 
 #include "qemu/atomic.h"
+#include "qemu/processor.h"
 
 #include "libvhost-user.h"
 
@@ -55,6 +57,12 @@
 
 #define VHOST_USER_HDR_SIZE offsetof(VhostUserMsg, payload.u64)
 
+/* Poll window a busy-polling queue starts from when it grows from 0 */
+#define VU_POLL_START_NS 4000
+
+/* How often a busy-polling queue checks whether the device has other work */
+#define VU_POLL_CHECK_NS 2000
+
 /* The version of the protocol we support */
 #define VHOST_USER_VERSION 1
 #define LIBVHOST_USER_DEBUG 0
@@ -409,6 +417,121 @@ vu_log_write(VuDev *dev, uint64_t address, uint64_t length)
     vu_log_kick(dev);
 }
 
+static uint64_t
+vu_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Adapt the poll window to @idle_ns, the time the queue has just been
+ * idle for: grow it if polling a little longer would have caught the
+ * buffers, shrink it if even the longest window would not have.
+ */
+static void
+vu_queue_poll_adjust(VuVirtq *vq, uint64_t idle_ns)
+{
+    VuPollStats *stats = &vq->poll_stats;
+
+    if (idle_ns <= stats->poll_ns) {
+        return;
+    }
+
+    if (idle_ns > vq->poll_max_ns) {
+        stats->poll_ns /= 2;
+        if (stats->poll_ns < VU_POLL_START_NS) {
+            stats->poll_ns = 0;
+        }
+    } else if (stats->poll_ns < vq->poll_max_ns) {
+        stats->poll_ns = stats->poll_ns ? stats->poll_ns * 2
+                                        : VU_POLL_START_NS;
+        stats->poll_ns = MIN(stats->poll_ns, vq->poll_max_ns);
+    }
+}
+
+/*
+ * Whether a vhost-user message or a kick on another queue is waiting.
+ */
+static bool
+vu_dev_fds_ready(VuDev *dev, int index)
+{
+    struct pollfd fds[VHOST_MAX_NR_VIRTQUEUE + 1];
+    int i, n = 0;
+
+    fds[n].fd = dev->sock;
+    fds[n++].events = POLLIN;
+    for (i = 0; i < VHOST_MAX_NR_VIRTQUEUE; i++) {
+        if (i != index && dev->vq[i].handler && dev->vq[i].kick_fd != -1) {
+            fds[n].fd = dev->vq[i].kick_fd;
+            fds[n++].events = POLLIN;
+        }
+    }
+
+    return poll(fds, n, 0) > 0;
+}
+
+/*
+ * Called after the handler has processed a kick: spin on the avail
+ * index with guest notifications disabled, for at most one poll window
+ * and only while nothing else is waiting to be served.
+ *
+ * If new buffers show up, they are not handled here: the queue kicks
+ * itself and keeps guest notifications disabled, so the handler runs
+ * again from the main loop once the other ready fds have been served.
+ * Otherwise guest notifications are enabled again.
+ */
+static void
+vu_queue_busy_poll(VuDev *dev, int index)
+{
+    VuVirtq *vq = &dev->vq[index];
+    uint64_t now, deadline, check;
+
+    if (unlikely(dev->broken) || unlikely(!vq->vring.avail)) {
+        return;
+    }
+
+    now = vu_now_ns();
+    vq->poll_idle_start = now;
+    deadline = now + vq->poll_stats.poll_ns;
+    check = now + VU_POLL_CHECK_NS;
+
+    vu_queue_set_notification(dev, vq, 0);
+    while (vu_queue_empty(dev, vq)) {
+        now = vu_now_ns();
+        if (now >= deadline) {
+            break;
+        }
+        if (now >= check) {
+            if (vu_dev_fds_ready(dev, index)) {
+                break;
+            }
+            check = now + VU_POLL_CHECK_NS;
+        }
+        cpu_relax();
+    }
+
+    if (vu_queue_empty(dev, vq)) {
+        vq->poll_stats.poll_misses++;
+        vu_queue_set_notification(dev, vq, 1);
+        /* Buffers added before the guest saw the flag cause no kick */
+        if (vu_queue_empty(dev, vq)) {
+            return;
+        }
+    } else {
+        vq->poll_stats.poll_hits++;
+    }
+
+    vq->poll_rearmed = true;
+    if (eventfd_write(vq->kick_fd, 1) < 0) {
+        vq->poll_rearmed = false;
+        vu_queue_set_notification(dev, vq, 1);
+        vq->handler(dev, index);
+    }
+}
+
 static void
 vu_kick_cb(VuDev *dev, int condition, void *data)
 {
@@ -425,9 +548,21 @@ vu_kick_cb(VuDev *dev, int condition, void *data)
     } else {
         DPRINT("Got kick_data: %016"PRIx64" handler:%p idx:%d\n",
                kick_data, vq->handler, index);
+        if (vq->poll_rearmed) {
+            /* kicked by vu_queue_busy_poll, not by the guest */
+            vq->poll_rearmed = false;
+        } else {
+            vq->poll_stats.kicks++;
+            if (vq->poll_max_ns && vq->poll_idle_start) {
+                vu_queue_poll_adjust(vq, vu_now_ns() - vq->poll_idle_start);
+            }
+        }
         if (vq->handler) {
             vq->handler(dev, index);
         }
+        if (vq->handler && vq->poll_max_ns) {
+            vu_queue_busy_poll(dev, index);
+        }
     }
 }
 
@@ -944,6 +1079,19 @@ void vu_set_queue_handler(VuDev *dev, VuVirtq *vq,
     }
 }
 
+void vu_queue_set_busy_poll(VuDev *dev, VuVirtq *vq, uint64_t max_ns)
+{
+    vq->poll_max_ns = max_ns;
+    vq->poll_idle_start = 0;
+    vq->poll_rearmed = false;
+    vq->poll_stats.poll_ns = MIN(vq->poll_stats.poll_ns, max_ns);
+}
+
+void vu_queue_get_poll_stats(VuDev *dev, VuVirtq *vq, VuPollStats *stats)
+{
+    *stats = vq->poll_stats;
+}
+
 bool vu_set_queue_host_notifier(VuDev *dev, VuVirtq *vq, int fd,
                                 int size, int offset)
 {
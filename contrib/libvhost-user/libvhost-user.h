@@ -225,6 +225,17 @@ typedef struct VuDevIface {
 
 typedef void (*vu_queue_handler_cb) (VuDev *dev, int qidx);
 
+typedef struct VuPollStats {
+    /* kicks received on the kick eventfd */
+    uint64_t kicks;
+    /* handler runs triggered by polling rather than by a kick */
+    uint64_t poll_hits;
+    /* poll windows that expired without new buffers */
+    uint64_t poll_misses;
+    /* current length of the poll window, in nanoseconds */
+    uint64_t poll_ns;
+} VuPollStats;
+
 typedef struct VuRing {
     unsigned int num;
     struct vring_desc *desc;
@@ -263,6 +274,12 @@ typedef struct VuVirtq {
     int err_fd;
     unsigned int enable;
     bool started;
+
+    /* Busy polling, see vu_queue_set_busy_poll() */
+    uint64_t poll_max_ns;
+    uint64_t poll_idle_start;
+    bool poll_rearmed;
+    VuPollStats poll_stats;
 } VuVirtq;
 
 enum VuWatchCondtion {
@@ -411,6 +428,30 @@ bool vu_set_queue_host_notifier(VuDev *dev, VuVirtq *vq, int fd,
  */
 void vu_queue_set_notification(VuDev *dev, VuVirtq *vq, int enable);
 
+/**
+ * vu_queue_set_busy_poll:
+ * @dev: a VuDev context
+ * @vq: a VuVirtq queue
+ * @max_ns: longest poll window in nanoseconds, 0 disables polling
+ *
+ * After the queue handler has run because of a kick, keep spinning on
+ * the avail index for up to a poll window, unless other vhost-user fds
+ * of the device become ready.  When new buffers show up, the queue's
+ * kick fd is signalled so that the handler runs again from the main
+ * loop; guest kicks stay suppressed until polling misses.  The window
+ * adapts between 0 and @max_ns to how long the queue usually stays
+ * idle.  The handler must drain the queue.
+ */
+void vu_queue_set_busy_poll(VuDev *dev, VuVirtq *vq, uint64_t max_ns);
+
+/**
+ * vu_queue_get_poll_stats:
+ * @dev: a VuDev context
+ * @vq: a VuVirtq queue
+ * @stats: filled with the queue's notification and polling counters
+ */
+void vu_queue_get_poll_stats(VuDev *dev, VuVirtq *vq, VuPollStats *stats);
+
 /**
  * vu_queue_enabled:
  * @dev: a VuDev context
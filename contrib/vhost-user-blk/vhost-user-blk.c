@@ -16,11 +16,26 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/queue.h"
 #include "standard-headers/linux/virtio_blk.h"
 #include "contrib/libvhost-user/libvhost-user-glib.h"
 #include "contrib/libvhost-user/libvhost-user.h"
 
 #include <glib.h>
+#include <glib-unix.h>
+
+#ifdef CONFIG_LINUX_AIO
+#include <libaio.h>
+#include <sys/eventfd.h>
+
+/* Requests handed to io_submit() or reaped by io_getevents() at once */
+#define VUB_AIO_BATCH 64
+
+/* How long a stopping queue waits for its requests in flight */
+#define VUB_AIO_DRAIN_TIMEOUT_S 30
+#endif
+
+typedef struct VubReq VubReq;
 
 struct virtio_blk_inhdr {
     unsigned char status;
@@ -34,9 +49,29 @@ typedef struct VubDev {
     bool enable_ro;
     char *blk_name;
     GMainLoop *loop;
+    uint16_t num_queues;
+    uint64_t poll_max_ns;
+    bool notify[VHOST_MAX_NR_VIRTQUEUE];
+#ifdef CONFIG_LINUX_AIO
+    /*
+     * Reads and writes are submitted here and complete through aio_efd,
+     * so a slow request does not hold up the other requests or queues.
+     * aio_ctx is 0 when io_setup() failed, and requests are then served
+     * synchronously.
+     */
+    io_context_t aio_ctx;
+    int aio_efd;
+    guint aio_watch;
+    struct iocb *aio_batch[VUB_AIO_BATCH];
+    int aio_batch_len;
+    /* requests submitted to aio_ctx, by queue */
+    QLIST_HEAD(, VubReq) aio_reqs[VHOST_MAX_NR_VIRTQUEUE];
+    /* requests detached from their stopped queue, still in flight */
+    QLIST_HEAD(, VubReq) aio_orphans;
+#endif
 } VubDev;
 
-typedef struct VubReq {
+struct VubReq {
     VuVirtqElement *elem;
     int64_t sector_num;
     size_t size;
@@ -44,7 +79,11 @@ typedef struct VubReq {
     struct virtio_blk_outhdr *out;
     VubDev *vdev_blk;
     struct VuVirtq *vq;
-} VubReq;
+#ifdef CONFIG_LINUX_AIO
+    struct iocb iocb;
+    QLIST_ENTRY(VubReq) next;
+#endif
+};
 
 /* refer util/iov.c */
 static size_t vub_iov_size(const struct iovec *iov,
@@ -76,15 +115,23 @@ static void vub_panic_cb(VuDev *vu_dev, const char *buf)
     g_main_loop_quit(vdev_blk->loop);
 }
 
+/* The guest is notified later, once for all requests of a queue */
 static void vub_req_complete(VubReq *req)
 {
     VugDev *gdev = &req->vdev_blk->parent;
     VuDev *vu_dev = &gdev->parent;
 
+    if (!req->vq) {
+        /* abandoned when its queue was stopped, the ring is gone */
+        free(req->elem);
+        g_free(req);
+        return;
+    }
+
     /* IO size with 1 extra status byte */
     vu_queue_push(vu_dev, req->vq, req->elem,
                   req->size + 1);
-    vu_queue_notify(vu_dev, req->vq);
+    req->vdev_blk->notify[req->vq - vu_dev->vq] = true;
 
     if (req->elem) {
         free(req->elem);
@@ -93,6 +140,280 @@ static void vub_req_complete(VubReq *req)
     g_free(req);
 }
 
+static void vub_notify_queues(VubDev *vdev_blk)
+{
+    VuDev *vu_dev = &vdev_blk->parent.parent;
+    int i;
+
+    for (i = 0; i < VHOST_MAX_NR_VIRTQUEUE; i++) {
+        if (vdev_blk->notify[i]) {
+            vdev_blk->notify[i] = false;
+            vu_queue_notify(vu_dev, vu_get_queue(vu_dev, i));
+        }
+    }
+}
+
+#ifdef CONFIG_LINUX_AIO
+static void vub_aio_submit(VubDev *vdev_blk)
+{
+    int i, ret;
+
+    if (!vdev_blk->aio_batch_len) {
+        return;
+    }
+
+    ret = io_submit(vdev_blk->aio_ctx, vdev_blk->aio_batch_len,
+                    vdev_blk->aio_batch);
+    if (ret < 0) {
+        fprintf(stderr, "%s, io_submit failed with %s\n",
+                vdev_blk->blk_name, strerror(-ret));
+        ret = 0;
+    }
+
+    for (i = 0; i < ret; i++) {
+        VubReq *req = container_of(vdev_blk->aio_batch[i], VubReq, iocb);
+        VuDev *vu_dev = &vdev_blk->parent.parent;
+
+        QLIST_INSERT_HEAD(&vdev_blk->aio_reqs[req->vq - vu_dev->vq], req,
+                          next);
+    }
+
+    /* Whatever the kernel did not take fails right away */
+    for (i = ret; i < vdev_blk->aio_batch_len; i++) {
+        VubReq *req = container_of(vdev_blk->aio_batch[i], VubReq, iocb);
+
+        req->in->status = VIRTIO_BLK_S_IOERR;
+        vub_req_complete(req);
+    }
+    vdev_blk->aio_batch_len = 0;
+}
+
+static void vub_aio_queue(VubReq *req, struct iovec *iov, uint32_t iovcnt,
+                          bool is_write)
+{
+    VubDev *vdev_blk = req->vdev_blk;
+
+    if (is_write) {
+        io_prep_pwritev(&req->iocb, vdev_blk->blk_fd, iov, iovcnt,
+                        req->sector_num * 512);
+    } else {
+        io_prep_preadv(&req->iocb, vdev_blk->blk_fd, iov, iovcnt,
+                       req->sector_num * 512);
+    }
+    io_set_eventfd(&req->iocb, vdev_blk->aio_efd);
+
+    vdev_blk->aio_batch[vdev_blk->aio_batch_len++] = &req->iocb;
+    if (vdev_blk->aio_batch_len == VUB_AIO_BATCH) {
+        vub_aio_submit(vdev_blk);
+    }
+}
+
+static void vub_aio_process_events(VubDev *vdev_blk,
+                                   struct io_event *events, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        VubReq *req = container_of(events[i].obj, VubReq, iocb);
+        long res = events[i].res;
+
+        QLIST_REMOVE(req, next);
+        if (!req->vq) {
+            vub_req_complete(req);
+            continue;
+        }
+        if (res >= 0 && res == req->size) {
+            req->in->status = VIRTIO_BLK_S_OK;
+        } else {
+            fprintf(stderr, "%s, Sector %"PRIu64", Size %lu failed "
+                    "with %s\n", vdev_blk->blk_name, req->sector_num,
+                    req->size, res < 0 ? strerror(-res) : "short I/O");
+            req->in->status = VIRTIO_BLK_S_IOERR;
+        }
+        vub_req_complete(req);
+    }
+}
+
+static gboolean vub_aio_complete(gint fd, GIOCondition condition,
+                                 gpointer data)
+{
+    VubDev *vdev_blk = data;
+    struct io_event events[VUB_AIO_BATCH];
+    struct timespec ts = { 0 };
+    uint64_t count;
+    int n;
+
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        fprintf(stderr, "Failed to read AIO eventfd: %s\n", strerror(errno));
+    }
+
+    do {
+        n = io_getevents(vdev_blk->aio_ctx, 0, VUB_AIO_BATCH, events, &ts);
+        vub_aio_process_events(vdev_blk, events, MAX(n, 0));
+    } while (n == VUB_AIO_BATCH);
+
+    vub_notify_queues(vdev_blk);
+    return G_SOURCE_CONTINUE;
+}
+
+static bool vub_aio_busy(VubDev *vdev_blk, int idx)
+{
+    int i;
+
+    if (idx >= 0) {
+        return !QLIST_EMPTY(&vdev_blk->aio_reqs[idx]);
+    }
+    for (i = 0; i < VHOST_MAX_NR_VIRTQUEUE; i++) {
+        if (!QLIST_EMPTY(&vdev_blk->aio_reqs[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void vub_aio_orphan(VubDev *vdev_blk, int idx)
+{
+    VubReq *req;
+
+    while ((req = QLIST_FIRST(&vdev_blk->aio_reqs[idx]))) {
+        fprintf(stderr, "%s, Sector %"PRIu64" still in flight on queue %d, "
+                "dropping it\n", vdev_blk->blk_name, req->sector_num, idx);
+        req->vq = NULL;
+        QLIST_REMOVE(req, next);
+        QLIST_INSERT_HEAD(&vdev_blk->aio_orphans, req, next);
+    }
+}
+
+/*
+ * Reap the requests in flight on queue @idx, or on every queue if @idx is
+ * negative, before the ring is stopped.  Requests that do not complete in
+ * time are detached from their queue and moved to aio_orphans; they are
+ * freed, without touching the ring, when they eventually complete.
+ */
+static void vub_aio_drain(VubDev *vdev_blk, int idx)
+{
+    struct io_event events[VUB_AIO_BATCH];
+    int64_t deadline;
+    int i, n;
+
+    if (!vdev_blk->aio_ctx) {
+        return;
+    }
+
+    vub_aio_submit(vdev_blk);
+
+    deadline = g_get_monotonic_time() +
+               VUB_AIO_DRAIN_TIMEOUT_S * G_USEC_PER_SEC;
+    while (vub_aio_busy(vdev_blk, idx)) {
+        int64_t left = deadline - g_get_monotonic_time();
+        struct timespec ts;
+
+        if (left <= 0) {
+            break;
+        }
+        ts.tv_sec = left / G_USEC_PER_SEC;
+        ts.tv_nsec = (left % G_USEC_PER_SEC) * 1000;
+
+        n = io_getevents(vdev_blk->aio_ctx, 1, VUB_AIO_BATCH, events, &ts);
+        if (n < 0 && n != -EINTR) {
+            fprintf(stderr, "%s, io_getevents failed with %s\n",
+                    vdev_blk->blk_name, strerror(-n));
+            break;
+        }
+        vub_aio_process_events(vdev_blk, events, MAX(n, 0));
+    }
+
+    if (idx >= 0) {
+        vub_aio_orphan(vdev_blk, idx);
+    } else {
+        for (i = 0; i < VHOST_MAX_NR_VIRTQUEUE; i++) {
+            vub_aio_orphan(vdev_blk, i);
+        }
+    }
+
+    vub_notify_queues(vdev_blk);
+}
+
+/*
+ * Make sure that no request can touch guest memory or blk_fd any more:
+ * drain every queue, then cancel or wait for the orphaned requests for
+ * as long as it takes.
+ */
+static void vub_aio_quiesce(VubDev *vdev_blk)
+{
+    struct io_event events[VUB_AIO_BATCH];
+    VubReq *req, *next_req;
+    int n;
+
+    if (!vdev_blk->aio_ctx) {
+        return;
+    }
+
+    vub_aio_drain(vdev_blk, -1);
+
+    QLIST_FOREACH_SAFE(req, &vdev_blk->aio_orphans, next, next_req) {
+        if (io_cancel(vdev_blk->aio_ctx, &req->iocb, &events[0]) == 0) {
+            vub_aio_process_events(vdev_blk, events, 1);
+        }
+    }
+
+    if (!QLIST_EMPTY(&vdev_blk->aio_orphans)) {
+        fprintf(stderr, "%s, waiting for requests that could not be "
+                "cancelled\n", vdev_blk->blk_name);
+    }
+    while (!QLIST_EMPTY(&vdev_blk->aio_orphans)) {
+        n = io_getevents(vdev_blk->aio_ctx, 1, VUB_AIO_BATCH, events, NULL);
+        if (n < 0 && n != -EINTR) {
+            fprintf(stderr, "%s, io_getevents failed with %s\n",
+                    vdev_blk->blk_name, strerror(-n));
+            break;
+        }
+        vub_aio_process_events(vdev_blk, events, MAX(n, 0));
+    }
+
+    vub_notify_queues(vdev_blk);
+}
+
+static void vub_aio_init(VubDev *vdev_blk)
+{
+    int ret;
+
+    vdev_blk->aio_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (vdev_blk->aio_efd < 0) {
+        fprintf(stderr, "Cannot create AIO eventfd, using synchronous I/O\n");
+        return;
+    }
+
+    /* Every descriptor of every queue may carry a request in flight */
+    ret = io_setup(vdev_blk->num_queues * VIRTQUEUE_MAX_SIZE,
+                   &vdev_blk->aio_ctx);
+    if (ret < 0) {
+        fprintf(stderr, "Cannot set up Linux AIO (%s), using synchronous "
+                "I/O\n", strerror(-ret));
+        close(vdev_blk->aio_efd);
+        vdev_blk->aio_efd = -1;
+        vdev_blk->aio_ctx = 0;
+        return;
+    }
+
+    vdev_blk->aio_watch = g_unix_fd_add(vdev_blk->aio_efd, G_IO_IN,
+                                        vub_aio_complete, vdev_blk);
+}
+
+static void vub_aio_cleanup(VubDev *vdev_blk)
+{
+    if (vdev_blk->aio_watch) {
+        g_source_remove(vdev_blk->aio_watch);
+    }
+    if (vdev_blk->aio_ctx) {
+        io_destroy(vdev_blk->aio_ctx);
+    }
+    if (vdev_blk->aio_efd >= 0) {
+        close(vdev_blk->aio_efd);
+    }
+}
+#endif
+
 static int vub_open(const char *file_name, bool wce)
 {
     int fd;
@@ -218,6 +539,19 @@ static int vub_virtio_process_req(VubDev *vdev_blk,
             ssize_t ret = 0;
             bool is_write = type & VIRTIO_BLK_T_OUT;
             req->sector_num = le64toh(req->out->sector);
+#ifdef CONFIG_LINUX_AIO
+            if (vdev_blk->aio_ctx) {
+                struct iovec *iov = is_write ? &elem->out_sg[1]
+                                             : &elem->in_sg[0];
+                unsigned iovcnt = is_write ? out_num : in_num;
+
+                if (iovcnt) {
+                    req->size = vub_iov_size(iov, iovcnt);
+                    vub_aio_queue(req, iov, iovcnt, is_write);
+                    break;
+                }
+            }
+#endif
             if (is_write) {
                 ret  = vub_writev(req, &elem->out_sg[1], out_num);
             } else {
@@ -287,16 +621,62 @@ static void vub_process_vq(VuDev *vu_dev, int idx)
             break;
         }
     }
+
+#ifdef CONFIG_LINUX_AIO
+    vub_aio_submit(vdev_blk);
+#endif
+    vub_notify_queues(vdev_blk);
 }
 
 static void vub_queue_set_started(VuDev *vu_dev, int idx, bool started)
 {
+    VugDev *gdev;
+    VubDev *vdev_blk;
     VuVirtq *vq;
 
     assert(vu_dev);
 
+    gdev = container_of(vu_dev, VugDev, parent);
+    vdev_blk = container_of(gdev, VubDev, parent);
+
     vq = vu_get_queue(vu_dev, idx);
+    if (!started && vdev_blk->poll_max_ns) {
+        VuPollStats stats;
+
+        vu_queue_get_poll_stats(vu_dev, vq, &stats);
+        fprintf(stdout, "Queue %d stopped: %"PRIu64" kicks, %"PRIu64
+                " poll hits, %"PRIu64" poll misses, poll window %"PRIu64
+                " ns\n", idx, stats.kicks, stats.poll_hits,
+                stats.poll_misses, stats.poll_ns);
+    }
     vu_set_queue_handler(vu_dev, vq, started ? vub_process_vq : NULL);
+    vu_queue_set_busy_poll(vu_dev, vq, started ? vdev_blk->poll_max_ns : 0);
+#ifdef CONFIG_LINUX_AIO
+    if (!started) {
+        vub_aio_drain(vdev_blk, idx);
+    }
+#endif
+}
+
+static int vub_process_msg(VuDev *vu_dev, VhostUserMsg *vmsg, int *do_reply)
+{
+#ifdef CONFIG_LINUX_AIO
+    VugDev *gdev = container_of(vu_dev, VugDev, parent);
+    VubDev *vdev_blk = container_of(gdev, VubDev, parent);
+
+    /* requests in flight point into the old memory table */
+    switch (vmsg->request) {
+    case VHOST_USER_SET_MEM_TABLE:
+    case VHOST_USER_RESET_OWNER:
+        vub_aio_quiesce(vdev_blk);
+        break;
+    default:
+        break;
+    }
+#endif
+
+    /* let libvhost-user handle the message */
+    return 0;
 }
 
 static uint64_t
@@ -322,6 +702,10 @@ vub_get_features(VuDev *dev)
         features |= 1ull << VIRTIO_BLK_F_RO;
     }
 
+    if (vdev_blk->num_queues > 1) {
+        features |= 1ull << VIRTIO_BLK_F_MQ;
+    }
+
     return features;
 }
 
@@ -374,6 +758,10 @@ vub_set_config(VuDev *vu_dev, const uint8_t *data,
 
     vdev_blk->blkcfg.wce = wce;
     fprintf(stdout, "Write Cache Policy Changed\n");
+#ifdef CONFIG_LINUX_AIO
+    /* requests in flight still refer to the old file descriptor */
+    vub_aio_quiesce(vdev_blk);
+#endif
     if (vdev_blk->blk_fd >= 0) {
         close(vdev_blk->blk_fd);
         vdev_blk->blk_fd = -1;
@@ -393,6 +781,7 @@ vub_set_config(VuDev *vu_dev, const uint8_t *data,
 static const VuDevIface vub_iface = {
     .get_features = vub_get_features,
     .queue_set_started = vub_queue_set_started,
+    .process_msg = vub_process_msg,
     .get_protocol_features = vub_get_protocol_features,
     .get_config = vub_get_config,
     .set_config = vub_set_config,
@@ -441,6 +830,9 @@ static void vub_free(struct VubDev *vdev_blk)
         return;
     }
 
+#ifdef CONFIG_LINUX_AIO
+    vub_aio_cleanup(vdev_blk);
+#endif
     g_main_loop_unref(vdev_blk->loop);
     if (vdev_blk->blk_fd >= 0) {
         close(vdev_blk->blk_fd);
@@ -463,7 +855,8 @@ vub_get_blocksize(int fd)
 }
 
 static void
-vub_initialize_config(int fd, struct virtio_blk_config *config)
+vub_initialize_config(int fd, struct virtio_blk_config *config,
+                      uint16_t num_queues)
 {
     off64_t capacity;
 
@@ -474,16 +867,21 @@ vub_initialize_config(int fd, struct virtio_blk_config *config)
     config->seg_max = 128 - 2;
     config->min_io_size = 1;
     config->opt_io_size = 1;
-    config->num_queues = 1;
+    config->num_queues = num_queues;
 }
 
 static VubDev *
-vub_new(char *blk_file)
+vub_new(char *blk_file, uint16_t num_queues, uint64_t poll_max_ns)
 {
     VubDev *vdev_blk;
 
     vdev_blk = g_new0(VubDev, 1);
     vdev_blk->loop = g_main_loop_new(NULL, FALSE);
+    vdev_blk->num_queues = num_queues;
+    vdev_blk->poll_max_ns = poll_max_ns;
+#ifdef CONFIG_LINUX_AIO
+    vdev_blk->aio_efd = -1;
+#endif
     vdev_blk->blk_fd = vub_open(blk_file, 0);
     if (vdev_blk->blk_fd  < 0) {
         fprintf(stderr, "Error to open block device %s\n", blk_file);
@@ -495,7 +893,11 @@ vub_new(char *blk_file)
     vdev_blk->blk_name = blk_file;
 
     /* fill virtio_blk_config with block parameters */
-    vub_initialize_config(vdev_blk->blk_fd, &vdev_blk->blkcfg);
+    vub_initialize_config(vdev_blk->blk_fd, &vdev_blk->blkcfg, num_queues);
+
+#ifdef CONFIG_LINUX_AIO
+    vub_aio_init(vdev_blk);
+#endif
 
     return vdev_blk;
 }
@@ -507,9 +909,11 @@ int main(int argc, char **argv)
     char *blk_file = NULL;
     bool enable_ro = false;
     int lsock = -1, csock = -1;
+    int num_queues = 1;
+    uint64_t poll_max_ns = 0;
     VubDev *vdev_blk = NULL;
 
-    while ((opt = getopt(argc, argv, "b:rs:h")) != -1) {
+    while ((opt = getopt(argc, argv, "b:rs:n:p:h")) != -1) {
         switch (opt) {
         case 'b':
             blk_file = g_strdup(optarg);
@@ -520,17 +924,32 @@ int main(int argc, char **argv)
         case 'r':
             enable_ro = true;
             break;
+        case 'n':
+            num_queues = atoi(optarg);
+            if (num_queues < 1 || num_queues > VHOST_MAX_NR_VIRTQUEUE) {
+                fprintf(stderr, "Number of queues must be between 1 and %d\n",
+                        VHOST_MAX_NR_VIRTQUEUE);
+                return -1;
+            }
+            break;
+        case 'p':
+            poll_max_ns = strtoull(optarg, NULL, 0);
+            break;
         case 'h':
         default:
             printf("Usage: %s [ -b block device or file, -s UNIX domain socket"
-                   " | -r Enable read-only ] | [ -h ]\n", argv[0]);
+                   " | -r Enable read-only | -n number of queues"
+                   " | -p max busy-poll time in ns ] | [ -h ]\n",
+                   argv[0]);
             return 0;
         }
     }
 
     if (!unix_socket || !blk_file) {
         printf("Usage: %s [ -b block device or file, -s UNIX domain socket"
-               " | -r Enable read-only ] | [ -h ]\n", argv[0]);
+               " | -r Enable read-only | -n number of queues"
+               " | -p max busy-poll time in ns ] | [ -h ]\n",
+               argv[0]);
         return -1;
     }
 
@@ -545,7 +964,7 @@ int main(int argc, char **argv)
         goto err;
     }
 
-    vdev_blk = vub_new(blk_file);
+    vdev_blk = vub_new(blk_file, num_queues, poll_max_ns);
     if (!vdev_blk) {
         goto err;
     }
@@ -752,19 +752,29 @@ static const VMStateDescription vmstate_timers = {
     }
 };
 
+static int cpu_throttle_effective_percentage(CPUState *cpu)
+{
+    return MAX(cpu_throttle_get_percentage(),
+               cpu_throttle_get_vcpu_percentage(cpu));
+}
+
+/*
+ * The timer fires once per period of CPU_THROTTLE_TIMESLICE_NS / (1 - pct),
+ * pct being the highest throttle of any vcpu; each vcpu then sleeps for its
+ * own share of the period, which is passed in @opaque.
+ */
 static void cpu_throttle_thread(CPUState *cpu, run_on_cpu_data opaque)
 {
     double pct;
-    double throttle_ratio;
     long sleeptime_ns;
 
-    if (!cpu_throttle_get_percentage()) {
+    pct = (double)cpu_throttle_effective_percentage(cpu) / 100;
+    if (!pct) {
+        atomic_set(&cpu->throttle_thread_scheduled, 0);
         return;
     }
 
-    pct = (double)cpu_throttle_get_percentage()/100;
-    throttle_ratio = pct / (1 - pct);
-    sleeptime_ns = (long)(throttle_ratio * CPU_THROTTLE_TIMESLICE_NS);
+    sleeptime_ns = (long)(pct * opaque.host_ulong);
 
     qemu_mutex_unlock_iothread();
     g_usleep(sleeptime_ns / 1000); /* Convert ns to us for usleep call */
@@ -775,22 +785,32 @@ static void cpu_throttle_thread(CPUState *cpu, run_on_cpu_data opaque)
 static void cpu_throttle_timer_tick(void *opaque)
 {
     CPUState *cpu;
+    int max_pct = 0;
     double pct;
+    unsigned long period_ns;
+
+    CPU_FOREACH(cpu) {
+        max_pct = MAX(max_pct, cpu_throttle_effective_percentage(cpu));
+    }
 
     /* Stop the timer if needed */
-    if (!cpu_throttle_get_percentage()) {
+    if (!max_pct) {
         return;
     }
+
+    pct = (double)max_pct / 100;
+    period_ns = CPU_THROTTLE_TIMESLICE_NS / (1 - pct);
+
     CPU_FOREACH(cpu) {
-        if (!atomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
+        if (cpu_throttle_effective_percentage(cpu) &&
+            !atomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
             async_run_on_cpu(cpu, cpu_throttle_thread,
-                             RUN_ON_CPU_NULL);
+                             RUN_ON_CPU_HOST_ULONG(period_ns));
         }
     }
 
-    pct = (double)cpu_throttle_get_percentage()/100;
     timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
-                                   CPU_THROTTLE_TIMESLICE_NS / (1-pct));
+                              period_ns);
 }
 
 void cpu_throttle_set(int new_throttle_pct)
@@ -805,9 +825,34 @@ void cpu_throttle_set(int new_throttle_pct)
                                        CPU_THROTTLE_TIMESLICE_NS);
 }
 
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct)
+{
+    if (new_throttle_pct) {
+        new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
+        new_throttle_pct = MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
+    }
+
+    atomic_set(&cpu->throttle_percentage, new_throttle_pct);
+
+    if (new_throttle_pct && !timer_pending(throttle_timer)) {
+        timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
+                                  CPU_THROTTLE_TIMESLICE_NS);
+    }
+}
+
+int cpu_throttle_get_vcpu_percentage(CPUState *cpu)
+{
+    return atomic_read(&cpu->throttle_percentage);
+}
+
 void cpu_throttle_stop(void)
 {
+    CPUState *cpu;
+
     atomic_set(&throttle_percentage, 0);
+    CPU_FOREACH(cpu) {
+        atomic_set(&cpu->throttle_percentage, 0);
+    }
 }
 
 bool cpu_throttle_active(void)
@@ -2663,6 +2663,13 @@ void memory_notdirty_write_prepare(NotDirtyInfo *ndi,
 /* Called within RCU critical section. */
 void memory_notdirty_write_complete(NotDirtyInfo *ndi)
 {
+    /* per-vcpu dirty accounting, used by migration auto-converge */
+    if (ndi->cpu &&
+        !cpu_physical_memory_get_dirty_flag(ndi->ram_addr,
+                                            DIRTY_MEMORY_MIGRATION)) {
+        stat64_add(&ndi->cpu->dirty_pages, 1);
+    }
+
     if (ndi->pages) {
         assert(tcg_enabled());
         page_collection_unlock(ndi->pages);
@@ -3447,53 +3454,86 @@ void cpu_flush_icache_range(hwaddr start, int len)
                                            start, NULL, len, FLUSH_CACHE);
 }
 
-typedef struct {
+/* A bounce buffer for DMA to memory that cannot be accessed directly.
+ * Each AddressSpace may have several of them in flight at once, as long
+ * as their total size stays below as->max_bounce_buffer_size.
+ */
+typedef struct BounceBuffer {
     MemoryRegion *mr;
     void *buffer;
     hwaddr addr;
     hwaddr len;
-    bool in_use;
+    QLIST_ENTRY(BounceBuffer) link;
 } BounceBuffer;
 
-static BounceBuffer bounce;
-
 typedef struct MapClient {
     QEMUBH *bh;
     QLIST_ENTRY(MapClient) link;
 } MapClient;
 
-QemuMutex map_client_list_lock;
-static QLIST_HEAD(map_client_list, MapClient) map_client_list
-    = QLIST_HEAD_INITIALIZER(map_client_list);
-
-static void cpu_unregister_map_client_do(MapClient *client)
+static void address_space_unregister_map_client_do(MapClient *client)
 {
     QLIST_REMOVE(client, link);
     g_free(client);
 }
 
-static void cpu_notify_map_clients_locked(void)
+/* Called with as->bounce_lock held */
+static void address_space_notify_map_clients_locked(AddressSpace *as)
 {
     MapClient *client;
 
-    while (!QLIST_EMPTY(&map_client_list)) {
-        client = QLIST_FIRST(&map_client_list);
+    while (!QLIST_EMPTY(&as->map_clients)) {
+        client = QLIST_FIRST(&as->map_clients);
         qemu_bh_schedule(client->bh);
-        cpu_unregister_map_client_do(client);
+        address_space_unregister_map_client_do(client);
     }
 }
 
-void cpu_register_map_client(QEMUBH *bh)
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh)
 {
     MapClient *client = g_malloc(sizeof(*client));
 
-    qemu_mutex_lock(&map_client_list_lock);
+    qemu_mutex_lock(&as->bounce_lock);
     client->bh = bh;
-    QLIST_INSERT_HEAD(&map_client_list, client, link);
-    if (!atomic_read(&bounce.in_use)) {
-        cpu_notify_map_clients_locked();
+    QLIST_INSERT_HEAD(&as->map_clients, client, link);
+    if (as->bounce_buffer_size < as->max_bounce_buffer_size) {
+        address_space_notify_map_clients_locked(as);
+    }
+    qemu_mutex_unlock(&as->bounce_lock);
+}
+
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh)
+{
+    MapClient *client;
+
+    qemu_mutex_lock(&as->bounce_lock);
+    QLIST_FOREACH(client, &as->map_clients, link) {
+        if (client->bh == bh) {
+            address_space_unregister_map_client_do(client);
+            break;
+        }
+    }
+    qemu_mutex_unlock(&as->bounce_lock);
+}
+
+void address_space_set_max_bounce_buffer_size(AddressSpace *as, size_t size)
+{
+    qemu_mutex_lock(&as->bounce_lock);
+    as->max_bounce_buffer_size = size;
+    if (as->bounce_buffer_size < as->max_bounce_buffer_size) {
+        address_space_notify_map_clients_locked(as);
     }
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_unlock(&as->bounce_lock);
+}
+
+void cpu_register_map_client(QEMUBH *bh)
+{
+    address_space_register_map_client(&address_space_memory, bh);
+}
+
+void cpu_unregister_map_client(QEMUBH *bh)
+{
+    address_space_unregister_map_client(&address_space_memory, bh);
 }
 
 void cpu_exec_init_all(void)
@@ -3509,28 +3549,6 @@ void cpu_exec_init_all(void)
     finalize_target_page_bits();
     io_mem_init();
     memory_map_init();
-    qemu_mutex_init(&map_client_list_lock);
-}
-
-void cpu_unregister_map_client(QEMUBH *bh)
-{
-    MapClient *client;
-
-    qemu_mutex_lock(&map_client_list_lock);
-    QLIST_FOREACH(client, &map_client_list, link) {
-        if (client->bh == bh) {
-            cpu_unregister_map_client_do(client);
-            break;
-        }
-    }
-    qemu_mutex_unlock(&map_client_list_lock);
-}
-
-static void cpu_notify_map_clients(void)
-{
-    qemu_mutex_lock(&map_client_list_lock);
-    cpu_notify_map_clients_locked();
-    qemu_mutex_unlock(&map_client_list_lock);
 }
 
 static bool flatview_access_valid(FlatView *fv, hwaddr addr, int len,
@@ -3596,12 +3614,82 @@ flatview_extend_translation(FlatView *fv, hwaddr addr,
     }
 }
 
+/* Reserve up to @len bytes of the bounce buffer budget of @as and return
+ * a new bounce buffer of that size, or NULL if the budget is exhausted.
+ */
+static BounceBuffer *address_space_bounce_get(AddressSpace *as,
+                                              MemoryRegion *mr,
+                                              hwaddr addr, hwaddr len)
+{
+    BounceBuffer *bounce;
+
+    qemu_mutex_lock(&as->bounce_lock);
+    if (as->bounce_buffer_size >= as->max_bounce_buffer_size) {
+        qemu_mutex_unlock(&as->bounce_lock);
+        trace_address_space_bounce_full(as, addr, len);
+        return NULL;
+    }
+    len = MIN(len, as->max_bounce_buffer_size - as->bounce_buffer_size);
+    atomic_set(&as->bounce_buffer_size, as->bounce_buffer_size + len);
+
+    bounce = g_new(BounceBuffer, 1);
+    bounce->buffer = qemu_memalign(TARGET_PAGE_SIZE, len);
+    bounce->addr = addr;
+    bounce->len = len;
+    memory_region_ref(mr);
+    bounce->mr = mr;
+    QLIST_INSERT_HEAD(&as->bounce_buffers, bounce, link);
+    trace_address_space_bounce_get(as, addr, len, as->bounce_buffer_size);
+    qemu_mutex_unlock(&as->bounce_lock);
+    return bounce;
+}
+
+/* Look up and unlink the bounce buffer whose data is at @buffer.  Returns
+ * NULL if @buffer points into guest RAM instead.
+ */
+static BounceBuffer *address_space_bounce_find(AddressSpace *as, void *buffer)
+{
+    BounceBuffer *bounce;
+
+    /* A bounce buffer is accounted for before it is returned by
+     * address_space_map(), so if nothing is in flight there is no need
+     * to take the lock.  This keeps unmapping RAM cheap.
+     */
+    if (!atomic_read(&as->bounce_buffer_size)) {
+        return NULL;
+    }
+
+    qemu_mutex_lock(&as->bounce_lock);
+    QLIST_FOREACH(bounce, &as->bounce_buffers, link) {
+        if (bounce->buffer == buffer) {
+            QLIST_REMOVE(bounce, link);
+            break;
+        }
+    }
+    qemu_mutex_unlock(&as->bounce_lock);
+    return bounce;
+}
+
+static void address_space_bounce_put(AddressSpace *as, BounceBuffer *bounce)
+{
+    qemu_vfree(bounce->buffer);
+    memory_region_unref(bounce->mr);
+
+    qemu_mutex_lock(&as->bounce_lock);
+    atomic_set(&as->bounce_buffer_size, as->bounce_buffer_size - bounce->len);
+    trace_address_space_bounce_put(as, bounce->addr, bounce->len,
+                                   as->bounce_buffer_size);
+    address_space_notify_map_clients_locked(as);
+    qemu_mutex_unlock(&as->bounce_lock);
+    g_free(bounce);
+}
+
 /* Map a physical memory region into a host virtual address.
  * May map a subset of the requested range, given by and returned in *plen.
  * May return NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
  */
 void *address_space_map(AddressSpace *as,
                         hwaddr addr,
@@ -3625,26 +3713,23 @@ void *address_space_map(AddressSpace *as,
     mr = flatview_translate(fv, addr, &xlat, &l, is_write, attrs);
 
     if (!memory_access_is_direct(mr, is_write)) {
-        if (atomic_xchg(&bounce.in_use, true)) {
+        BounceBuffer *bounce;
+
+        /* Avoid unbounded allocations */
+        bounce = address_space_bounce_get(as, mr, addr, l);
+        if (!bounce) {
             rcu_read_unlock();
             return NULL;
         }
-        /* Avoid unbounded allocations */
-        l = MIN(l, TARGET_PAGE_SIZE);
-        bounce.buffer = qemu_memalign(TARGET_PAGE_SIZE, l);
-        bounce.addr = addr;
-        bounce.len = l;
-
-        memory_region_ref(mr);
-        bounce.mr = mr;
+        l = bounce->len;
         if (!is_write) {
             flatview_read(fv, addr, MEMTXATTRS_UNSPECIFIED,
-                               bounce.buffer, l);
+                               bounce->buffer, l);
         }
 
         rcu_read_unlock();
         *plen = l;
-        return bounce.buffer;
+        return bounce->buffer;
     }
 
 
@@ -3664,7 +3749,9 @@ void *address_space_map(AddressSpace *as,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len)
 {
-    if (buffer != bounce.buffer) {
+    BounceBuffer *bounce = address_space_bounce_find(as, buffer);
+
+    if (!bounce) {
         MemoryRegion *mr;
         ram_addr_t addr1;
 
@@ -3680,14 +3767,10 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
         return;
     }
     if (is_write) {
-        address_space_write(as, bounce.addr, MEMTXATTRS_UNSPECIFIED,
-                            bounce.buffer, access_len);
-    }
-    qemu_vfree(bounce.buffer);
-    bounce.buffer = NULL;
-    memory_region_unref(bounce.mr);
-    atomic_mb_set(&bounce.in_use, false);
-    cpu_notify_map_clients();
+        address_space_write(as, bounce->addr, MEMTXATTRS_UNSPECIFIED,
+                            bounce->buffer, access_len);
+    }
+    address_space_bounce_put(as, bounce);
 }
 
 void *cpu_physical_memory_map(hwaddr addr,
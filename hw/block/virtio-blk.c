@@ -41,7 +41,16 @@ static void virtio_blk_init_request(VirtIOBlock *s, VirtQueue *vq,
 
 static void virtio_blk_free_request(VirtIOBlockReq *req)
 {
-    g_free(req);
+    virtqueue_free_element(req->vq, req);
+}
+
+static void virtio_blk_notify(VirtIOBlock *s, VirtQueue *vq)
+{
+    if (s->dataplane_started && !s->dataplane_disabled) {
+        virtio_blk_data_plane_notify(s->dataplane, vq);
+    } else {
+        virtio_notify(VIRTIO_DEVICE(s), vq);
+    }
 }
 
 static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
@@ -53,10 +62,36 @@ static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
 
     stb_p(&req->in->status, status);
     virtqueue_push(req->vq, &req->elem, req->in_len);
-    if (s->dataplane_started && !s->dataplane_disabled) {
-        virtio_blk_data_plane_notify(s->dataplane, req->vq);
-    } else {
-        virtio_notify(vdev, req->vq);
+    virtio_blk_notify(s, req->vq);
+}
+
+/* Complete a chain of successful merged requests, which all come from the
+ * same virtqueue, with a single used ring update.  */
+static void virtio_blk_req_complete_merged(VirtIOBlockReq *head)
+{
+    VirtIOBlock *s = head->dev;
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    VirtQueueElement *elems[VIRTIO_BLK_MAX_MERGE_REQS];
+    unsigned int lens[VIRTIO_BLK_MAX_MERGE_REQS];
+    VirtIOBlockReq *req, *next;
+    unsigned int num = 0;
+
+    for (req = head; req; req = req->mr_next) {
+        assert(num < VIRTIO_BLK_MAX_MERGE_REQS);
+        trace_virtio_blk_req_complete(vdev, req, VIRTIO_BLK_S_OK);
+        stb_p(&req->in->status, VIRTIO_BLK_S_OK);
+        elems[num] = &req->elem;
+        lens[num] = req->in_len;
+        num++;
+    }
+
+    virtqueue_push_batch(head->vq, elems, lens, num);
+    virtio_blk_notify(s, head->vq);
+
+    for (req = head; req; req = next) {
+        next = req->mr_next;
+        block_acct_done(blk_get_stats(s->blk), &req->acct);
+        virtio_blk_free_request(req);
     }
 }
 
@@ -90,6 +125,19 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
 
     aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
+    if (!ret) {
+        VirtIOBlockReq *req;
+
+        for (req = next; req; req = req->mr_next) {
+            trace_virtio_blk_rw_complete(vdev, req, ret);
+            if (req->qiov.nalloc != -1) {
+                qemu_iovec_destroy(&req->qiov);
+            }
+        }
+        virtio_blk_req_complete_merged(next);
+        next = NULL;
+    }
+
     while (next) {
         VirtIOBlockReq *req = next;
         next = req->mr_next;
@@ -198,14 +246,17 @@ out:
 
 #endif
 
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s, VirtQueue *vq)
+static unsigned int virtio_blk_get_requests(VirtIOBlock *s, VirtQueue *vq,
+                                            VirtIOBlockReq **reqs,
+                                            unsigned int max)
 {
-    VirtIOBlockReq *req = virtqueue_pop(vq, sizeof(VirtIOBlockReq));
+    unsigned int i, num;
 
-    if (req) {
-        virtio_blk_init_request(s, vq, req);
+    num = virtqueue_pop_batch(vq, sizeof(VirtIOBlockReq), (void **)reqs, max);
+    for (i = 0; i < num; i++) {
+        virtio_blk_init_request(s, vq, reqs[i]);
     }
-    return req;
+    return num;
 }
 
 static int virtio_blk_handle_scsi_req(VirtIOBlockReq *req)
@@ -593,9 +644,10 @@ static int virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 
 bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
 {
-    VirtIOBlockReq *req;
+    VirtIOBlockReq *reqs[VIRTIO_BLK_MAX_MERGE_REQS];
     MultiReqBuffer mrb = {};
     bool progress = false;
+    unsigned int i, num;
 
     aio_context_acquire(blk_get_aio_context(s->blk));
     blk_io_plug(s->blk);
@@ -603,11 +655,21 @@ bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
     do {
         virtio_queue_set_notification(vq, 0);
 
-        while ((req = virtio_blk_get_request(s, vq))) {
+        while ((num = virtio_blk_get_requests(s, vq, reqs, ARRAY_SIZE(reqs)))) {
             progress = true;
-            if (virtio_blk_handle_request(req, &mrb)) {
-                virtqueue_detach_element(req->vq, &req->elem, 0);
-                virtio_blk_free_request(req);
+            for (i = 0; i < num; i++) {
+                if (virtio_blk_handle_request(reqs[i], &mrb)) {
+                    break;
+                }
+            }
+            if (i < num) {
+                /* Leave the rest of the batch in the ring, newest first */
+                while (--num > i) {
+                    virtqueue_unpop(vq, &reqs[num]->elem, 0);
+                    virtio_blk_free_request(reqs[num]);
+                }
+                virtqueue_detach_element(vq, &reqs[i]->elem, 0);
+                virtio_blk_free_request(reqs[i]);
                 break;
             }
         }
@@ -861,7 +923,7 @@ static void virtio_blk_save_device(VirtIODevice *vdev, QEMUFile *f)
             qemu_put_be32(f, virtio_get_queue_index(req->vq));
         }
 
-        qemu_put_virtqueue_element(f, &req->elem);
+        qemu_put_virtqueue_element(vdev, f, &req->elem);
         req = req->next;
     }
     qemu_put_sbyte(f, 0);
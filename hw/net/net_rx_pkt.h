@@ -131,9 +131,13 @@ eth_l4_hdr_info *net_rx_pkt_get_l4_info(struct NetRxPkt *pkt);
 typedef enum {
     NetPktRssIpV4,
     NetPktRssIpV4Tcp,
-    NetPktRssIpV6Tcp,
+    NetPktRssIpV6TcpEx,
     NetPktRssIpV6,
-    NetPktRssIpV6Ex
+    NetPktRssIpV6Ex,
+    NetPktRssIpV6Tcp,
+    NetPktRssIpV4Udp,
+    NetPktRssIpV6Udp,
+    NetPktRssIpV6UdpEx,
 } NetRxPktRssType;
 
 /**
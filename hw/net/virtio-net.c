@@ -27,6 +27,8 @@
 #include "hw/virtio/virtio-access.h"
 #include "migration/misc.h"
 #include "standard-headers/linux/ethtool.h"
+#include "net_rx_pkt.h"
+#include "trace.h"
 
 #define VIRTIO_NET_VM_VERSION    11
 
@@ -41,6 +43,24 @@
 #define VIRTIO_NET_RX_QUEUE_MIN_SIZE VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE
 #define VIRTIO_NET_TX_QUEUE_MIN_SIZE VIRTIO_NET_TX_QUEUE_DEFAULT_SIZE
 
+/* TX packets popped from the ring and completed at once */
+#define VIRTIO_NET_TX_BATCH 32
+
+/* Receive segment coalescing */
+#define VIRTIO_NET_RSC_DEFAULT_INTERVAL 300000  /* 300 us */
+#define VIRTIO_NET_RSC_MAX_FLOWS 16
+#define VIRTIO_NET_RSC_BUF_SIZE (ETH_HLEN + sizeof(struct ip6_header) + 0xffff)
+
+#define VIRTIO_NET_RSS_SUPPORTED_HASHES (VIRTIO_NET_RSS_HASH_TYPE_IPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_IPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_IP_EX | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCP_EX | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDP_EX)
+
 /*
  * Calculate the number of bytes up to and including the given 'field' of
  * 'container'.
@@ -64,6 +84,8 @@ static VirtIOFeature feature_sizes[] = {
      .end = endof(struct virtio_net_config, mtu)},
     {.flags = 1ULL << VIRTIO_NET_F_SPEED_DUPLEX,
      .end = endof(struct virtio_net_config, duplex)},
+    {.flags = (1ULL << VIRTIO_NET_F_RSS) | (1ULL << VIRTIO_NET_F_HASH_REPORT),
+     .end = endof(struct virtio_net_config, supported_hash_types)},
     {}
 };
 
@@ -94,6 +116,11 @@ static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
     memcpy(netcfg.mac, n->mac, ETH_ALEN);
     virtio_stl_p(vdev, &netcfg.speed, n->net_conf.speed);
     netcfg.duplex = n->net_conf.duplex;
+    netcfg.rss_max_key_size = VIRTIO_NET_RSS_MAX_KEY_SIZE;
+    virtio_stw_p(vdev, &netcfg.rss_max_indirection_table_length,
+                 VIRTIO_NET_RSS_MAX_TABLE_LEN);
+    virtio_stl_p(vdev, &netcfg.supported_hash_types,
+                 VIRTIO_NET_RSS_SUPPORTED_HASHES);
     memcpy(config, &netcfg, n->config_size);
 }
 
@@ -248,6 +275,34 @@ static void virtio_net_drop_tx_queue_data(VirtIODevice *vdev, VirtQueue *vq)
     }
 }
 
+/*
+ * Received packets are only filled into the used ring; the used index is
+ * published and the guest notified once per batch, from a bottom half that
+ * runs after the backend has delivered everything it read in one wakeup.
+ */
+static void virtio_net_rx_flush(VirtIONetQueue *q)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(q->n);
+
+    if (!q->rx_pending) {
+        return;
+    }
+
+    rcu_read_lock();
+    virtqueue_flush(q->rx_vq, q->rx_pending);
+    rcu_read_unlock();
+    q->rx_pending = 0;
+    virtio_notify(vdev, q->rx_vq);
+}
+
+static void virtio_net_rx_bh(void *opaque)
+{
+    virtio_net_rx_flush(opaque);
+}
+
+static void virtio_net_rsc_drain(VirtIONet *n, NetClientState *nc);
+static void virtio_net_rsc_purge(VirtIONet *n, NetClientState *nc);
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -255,6 +310,18 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     int i;
     uint8_t queue_status;
 
+    /* vhost and migration expect the used ring to be up to date */
+    rcu_read_lock();
+    virtio_net_rsc_drain(n, NULL);
+    rcu_read_unlock();
+    for (i = 0; i < n->max_queues; i++) {
+        q = &n->vqs[i];
+        if (q->rx_bh) {
+            qemu_bh_cancel(q->rx_bh);
+            virtio_net_rx_flush(q);
+        }
+    }
+
     virtio_net_vnet_endian_status(n, status);
     virtio_net_vhost_status(n, status);
 
@@ -424,6 +491,15 @@ static RxFilterInfo *virtio_net_query_rxfilter(NetClientState *nc)
     return info;
 }
 
+static void virtio_net_disable_rss(VirtIONet *n)
+{
+    if (n->rss_data.enabled) {
+        trace_virtio_net_rss_disable();
+    }
+    n->rss_data.enabled = false;
+    n->rss_data.redirect = false;
+}
+
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -441,6 +517,8 @@ static void virtio_net_reset(VirtIODevice *vdev)
     timer_del(n->announce_timer);
     n->announce_counter = 0;
     n->status &= ~VIRTIO_NET_S_ANNOUNCE;
+    virtio_net_disable_rss(n);
+    virtio_net_rsc_purge(n, NULL);
 
     /* Flush any MAC and VLAN filter table state */
     n->mac_table.in_use = 0;
@@ -489,15 +567,18 @@ static int peer_has_ufo(VirtIONet *n)
 }
 
 static void virtio_net_set_mrg_rx_bufs(VirtIONet *n, int mergeable_rx_bufs,
-                                       int version_1)
+                                       int version_1, int hash_report)
 {
     int i;
     NetClientState *nc;
 
     n->mergeable_rx_bufs = mergeable_rx_bufs;
+    n->rss_data.populate_hash = version_1 && hash_report;
 
     if (version_1) {
-        n->guest_hdr_len = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+        n->guest_hdr_len = hash_report ?
+            sizeof(struct virtio_net_hdr_v1_hash) :
+            sizeof(struct virtio_net_hdr_mrg_rxbuf);
     } else {
         n->guest_hdr_len = n->mergeable_rx_bufs ?
             sizeof(struct virtio_net_hdr_mrg_rxbuf) :
@@ -614,9 +695,12 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_TSO6);
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_ECN);
 
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_CSUM);
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO4);
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO6);
+        /* receive coalescing is then the only source of GSO packets */
+        if (!n->rsc_enabled) {
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_CSUM);
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO4);
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO6);
+        }
         virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_ECN);
     }
 
@@ -625,9 +709,27 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_UFO);
     }
 
+    /* RSS and hash reports are configured through the control queue */
+    if (!virtio_has_feature(features, VIRTIO_NET_F_CTRL_VQ)) {
+        virtio_clear_feature(&features, VIRTIO_NET_F_RSS);
+        virtio_clear_feature(&features, VIRTIO_NET_F_HASH_REPORT);
+    }
+
+    /*
+     * There is one queue pair per backend queue, so with a single-queue
+     * backend RSS has nothing to spread; only hash reports are useful.
+     */
+    if (n->max_queues == 1) {
+        virtio_clear_feature(&features, VIRTIO_NET_F_RSS);
+    }
+
     if (!get_vhost_net(nc->peer)) {
         return features;
     }
+
+    /* vhost receives packets without going through virtio_net_receive() */
+    virtio_clear_feature(&features, VIRTIO_NET_F_RSS);
+    virtio_clear_feature(&features, VIRTIO_NET_F_HASH_REPORT);
     features = vhost_net_get_features(get_vhost_net(nc->peer), features);
     vdev->backend_features = features;
 
@@ -699,7 +801,9 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
                                virtio_has_feature(features,
                                                   VIRTIO_NET_F_MRG_RXBUF),
                                virtio_has_feature(features,
-                                                  VIRTIO_F_VERSION_1));
+                                                  VIRTIO_F_VERSION_1),
+                               virtio_has_feature(features,
+                                                  VIRTIO_NET_F_HASH_REPORT));
 
     if (n->has_vnet_hdr) {
         n->curr_guest_offloads =
@@ -707,6 +811,16 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
         virtio_net_apply_guest_offloads(n);
     }
 
+    n->rsc4_enabled = n->rsc_enabled && !n->has_vnet_hdr &&
+        virtio_has_feature(features, VIRTIO_NET_F_GUEST_CSUM) &&
+        virtio_has_feature(features, VIRTIO_NET_F_GUEST_TSO4);
+    n->rsc6_enabled = n->rsc_enabled && !n->has_vnet_hdr &&
+        virtio_has_feature(features, VIRTIO_NET_F_GUEST_CSUM) &&
+        virtio_has_feature(features, VIRTIO_NET_F_GUEST_TSO6);
+    if (!n->rsc4_enabled && !n->rsc6_enabled) {
+        virtio_net_rsc_purge(n, NULL);
+    }
+
     for (i = 0;  i < n->max_queues; i++) {
         NetClientState *nc = qemu_get_subqueue(n->nic, i);
 
@@ -937,6 +1051,128 @@ static int virtio_net_handle_announce(VirtIONet *n, uint8_t cmd,
     }
 }
 
+/*
+ * Parse a VIRTIO_NET_CTRL_MQ_RSS_CONFIG (do_rss) or
+ * VIRTIO_NET_CTRL_MQ_HASH_CONFIG command.  Returns the number of queue
+ * pairs the driver asked for, or 0 if the command is invalid.
+ */
+static uint16_t virtio_net_handle_rss(VirtIONet *n, struct iovec *iov,
+                                      unsigned int iov_cnt, bool do_rss)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtioNetRssData *rss = &n->rss_data;
+    struct virtio_net_rss_config cfg;
+    size_t s, offset = 0, size_get;
+    uint16_t queues, i;
+    struct {
+        uint16_t max_tx_vq;
+        uint8_t hash_key_length;
+    } QEMU_PACKED temp;
+    const char *err_msg = "";
+    uint32_t err_value = 0;
+
+    if (do_rss && !virtio_vdev_has_feature(vdev, VIRTIO_NET_F_RSS)) {
+        err_msg = "RSS is not negotiated";
+        goto error;
+    }
+    if (!do_rss && !virtio_vdev_has_feature(vdev, VIRTIO_NET_F_HASH_REPORT)) {
+        err_msg = "Hash report is not negotiated";
+        goto error;
+    }
+
+    size_get = offsetof(struct virtio_net_rss_config, indirection_table);
+    s = iov_to_buf(iov, iov_cnt, offset, &cfg, size_get);
+    if (s != size_get) {
+        err_msg = "Short command buffer";
+        err_value = (uint32_t)s;
+        goto error;
+    }
+    rss->hash_types = virtio_ldl_p(vdev, &cfg.hash_types);
+    rss->indirections_len = do_rss ?
+        virtio_lduw_p(vdev, &cfg.indirection_table_mask) + 1 : 1;
+    if (!is_power_of_2(rss->indirections_len) ||
+        rss->indirections_len > VIRTIO_NET_RSS_MAX_TABLE_LEN) {
+        err_msg = "Invalid size of indirection table";
+        err_value = rss->indirections_len;
+        goto error;
+    }
+    rss->default_queue = do_rss ?
+        virtio_lduw_p(vdev, &cfg.unclassified_queue) : 0;
+    offset += size_get;
+
+    size_get = sizeof(uint16_t) * rss->indirections_len;
+    s = iov_to_buf(iov, iov_cnt, offset, rss->indirections_table, size_get);
+    if (s != size_get) {
+        err_msg = "Short indirection table buffer";
+        err_value = (uint32_t)s;
+        goto error;
+    }
+    offset += size_get;
+
+    size_get = sizeof(temp);
+    s = iov_to_buf(iov, iov_cnt, offset, &temp, size_get);
+    if (s != size_get) {
+        err_msg = "Can't get queues";
+        err_value = (uint32_t)s;
+        goto error;
+    }
+    offset += size_get;
+
+    queues = do_rss ? virtio_lduw_p(vdev, &temp.max_tx_vq) : n->curr_queues;
+    if (queues == 0 || queues > n->max_queues) {
+        err_msg = "Invalid number of queues";
+        err_value = queues;
+        goto error;
+    }
+    if (rss->default_queue >= queues) {
+        err_msg = "Invalid default queue";
+        err_value = rss->default_queue;
+        goto error;
+    }
+    for (i = 0; i < rss->indirections_len; i++) {
+        rss->indirections_table[i] =
+            virtio_lduw_p(vdev, &rss->indirections_table[i]);
+        if (rss->indirections_table[i] >= queues) {
+            err_msg = "Invalid queue in indirection table";
+            err_value = rss->indirections_table[i];
+            goto error;
+        }
+    }
+
+    if (temp.hash_key_length > VIRTIO_NET_RSS_MAX_KEY_SIZE) {
+        err_msg = "Invalid key size";
+        err_value = temp.hash_key_length;
+        goto error;
+    }
+    if (!temp.hash_key_length && rss->hash_types) {
+        err_msg = "No key provided";
+        goto error;
+    }
+    if (!temp.hash_key_length && !rss->hash_types) {
+        virtio_net_disable_rss(n);
+        return queues;
+    }
+    memset(rss->key, 0, sizeof(rss->key));
+    size_get = temp.hash_key_length;
+    s = iov_to_buf(iov, iov_cnt, offset, rss->key, size_get);
+    if (s != size_get) {
+        err_msg = "Can't get key buffer";
+        err_value = (uint32_t)s;
+        goto error;
+    }
+
+    rss->enabled = true;
+    rss->redirect = do_rss;
+    trace_virtio_net_rss_enable(rss->hash_types, rss->indirections_len,
+                                temp.hash_key_length);
+    return queues;
+
+error:
+    trace_virtio_net_rss_error(err_msg, err_value);
+    virtio_net_disable_rss(n);
+    return 0;
+}
+
 static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
                                 struct iovec *iov, unsigned int iov_cnt)
 {
@@ -945,21 +1181,29 @@ static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
     size_t s;
     uint16_t queues;
 
-    s = iov_to_buf(iov, iov_cnt, 0, &mq, sizeof(mq));
-    if (s != sizeof(mq)) {
-        return VIRTIO_NET_ERR;
+    virtio_net_disable_rss(n);
+    if (cmd == VIRTIO_NET_CTRL_MQ_HASH_CONFIG) {
+        queues = virtio_net_handle_rss(n, iov, iov_cnt, false);
+        return queues ? VIRTIO_NET_OK : VIRTIO_NET_ERR;
     }
 
-    if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET) {
+    if (cmd == VIRTIO_NET_CTRL_MQ_RSS_CONFIG) {
+        queues = virtio_net_handle_rss(n, iov, iov_cnt, true);
+    } else if (cmd == VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET) {
+        s = iov_to_buf(iov, iov_cnt, 0, &mq, sizeof(mq));
+        if (s != sizeof(mq)) {
+            return VIRTIO_NET_ERR;
+        }
+        queues = virtio_lduw_p(vdev, &mq.virtqueue_pairs);
+    } else {
         return VIRTIO_NET_ERR;
     }
 
-    queues = virtio_lduw_p(vdev, &mq.virtqueue_pairs);
-
     if (queues < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
         queues > VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX ||
         queues > n->max_queues ||
         !n->multiqueue) {
+        virtio_net_disable_rss(n);
         return VIRTIO_NET_ERR;
     }
 
@@ -1031,8 +1275,27 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     int queue_index = vq2q(virtio_get_queue_index(vq));
+    NetClientState *nc = qemu_get_subqueue(n->nic, queue_index);
+    int i;
+
+    /* coalesced segments go first, they are older than the backlog */
+    rcu_read_lock();
+    virtio_net_rsc_drain(n, nc);
+    rcu_read_unlock();
+
+    qemu_flush_queued_packets(nc);
 
-    qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
+    /*
+     * With RSS a packet that was held back for lack of buffers in this
+     * queue sits in the backlog of the queue it arrived on.
+     */
+    if (n->rss_data.redirect) {
+        for (i = 0; i < n->curr_queues; i++) {
+            if (i != queue_index) {
+                qemu_flush_queued_packets(qemu_get_subqueue(n->nic, i));
+            }
+        }
+    }
 }
 
 static int virtio_net_can_receive(NetClientState *nc)
@@ -1116,7 +1379,8 @@ static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
 }
 
 static void receive_header(VirtIONet *n, const struct iovec *iov, int iov_cnt,
-                           const void *buf, size_t size)
+                           const void *buf, size_t size,
+                           const struct virtio_net_hdr_v1_hash *hdr)
 {
     if (n->has_vnet_hdr) {
         /* FIXME this cast is evil */
@@ -1129,11 +1393,9 @@ static void receive_header(VirtIONet *n, const struct iovec *iov, int iov_cnt,
         }
         iov_from_buf(iov, iov_cnt, 0, buf, sizeof(struct virtio_net_hdr));
     } else {
-        struct virtio_net_hdr hdr = {
-            .flags = 0,
-            .gso_type = VIRTIO_NET_HDR_GSO_NONE
-        };
-        iov_from_buf(iov, iov_cnt, 0, &hdr, sizeof hdr);
+        /* all zeroes unless the packet was built by receive coalescing */
+        iov_from_buf(iov, iov_cnt, 0, &hdr->hdr,
+                     sizeof(struct virtio_net_hdr));
     }
 }
 
@@ -1188,8 +1450,109 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
+static bool virtio_net_get_hash_type(bool isip4, bool isip6,
+                                     bool isudp, bool istcp,
+                                     uint32_t types, NetRxPktRssType *type)
+{
+    if (isip4) {
+        if (istcp && (types & VIRTIO_NET_RSS_HASH_TYPE_TCPv4)) {
+            *type = NetPktRssIpV4Tcp;
+            return true;
+        }
+        if (isudp && (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv4)) {
+            *type = NetPktRssIpV4Udp;
+            return true;
+        }
+        if (types & VIRTIO_NET_RSS_HASH_TYPE_IPv4) {
+            *type = NetPktRssIpV4;
+            return true;
+        }
+    } else if (isip6) {
+        if (istcp && (types & VIRTIO_NET_RSS_HASH_TYPE_TCP_EX)) {
+            *type = NetPktRssIpV6TcpEx;
+            return true;
+        }
+        if (istcp && (types & VIRTIO_NET_RSS_HASH_TYPE_TCPv6)) {
+            *type = NetPktRssIpV6Tcp;
+            return true;
+        }
+        if (isudp && (types & VIRTIO_NET_RSS_HASH_TYPE_UDP_EX)) {
+            *type = NetPktRssIpV6UdpEx;
+            return true;
+        }
+        if (isudp && (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv6)) {
+            *type = NetPktRssIpV6Udp;
+            return true;
+        }
+        if (types & VIRTIO_NET_RSS_HASH_TYPE_IP_EX) {
+            *type = NetPktRssIpV6Ex;
+            return true;
+        }
+        if (types & VIRTIO_NET_RSS_HASH_TYPE_IPv6) {
+            *type = NetPktRssIpV6;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Compute the Toeplitz hash the driver configured, store it in @hdr for
+ * the hash report and return the queue the packet is steered to.
+ */
+static NetClientState *virtio_net_process_rss(NetClientState *nc,
+                                              const uint8_t *buf, size_t size,
+                                              struct virtio_net_hdr_v1_hash *hdr)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtioNetRssData *rss = &n->rss_data;
+    struct NetRxPkt *pkt = n->rx_pkt;
+    static const uint8_t reports[] = {
+        [NetPktRssIpV4] = VIRTIO_NET_HASH_REPORT_IPv4,
+        [NetPktRssIpV4Tcp] = VIRTIO_NET_HASH_REPORT_TCPv4,
+        [NetPktRssIpV6TcpEx] = VIRTIO_NET_HASH_REPORT_TCPv6_EX,
+        [NetPktRssIpV6] = VIRTIO_NET_HASH_REPORT_IPv6,
+        [NetPktRssIpV6Ex] = VIRTIO_NET_HASH_REPORT_IPv6_EX,
+        [NetPktRssIpV6Tcp] = VIRTIO_NET_HASH_REPORT_TCPv6,
+        [NetPktRssIpV4Udp] = VIRTIO_NET_HASH_REPORT_UDPv4,
+        [NetPktRssIpV6Udp] = VIRTIO_NET_HASH_REPORT_UDPv6,
+        [NetPktRssIpV6UdpEx] = VIRTIO_NET_HASH_REPORT_UDPv6_EX,
+    };
+    NetRxPktRssType type;
+    bool isip4, isip6, isudp, istcp;
+    uint32_t hash;
+    uint16_t index;
+
+    net_rx_pkt_set_protocols(pkt, buf + n->host_hdr_len,
+                             size - n->host_hdr_len);
+    net_rx_pkt_get_protocols(pkt, &isip4, &isip6, &isudp, &istcp);
+
+    /* only the first fragment carries the L4 header */
+    if ((isip4 && net_rx_pkt_get_ip4_info(pkt)->fragment) ||
+        (isip6 && net_rx_pkt_get_ip6_info(pkt)->fragment)) {
+        isudp = istcp = false;
+    }
+
+    if (virtio_net_get_hash_type(isip4, isip6, isudp, istcp,
+                                 rss->hash_types, &type)) {
+        hash = net_rx_pkt_calc_rss_hash(pkt, type, rss->key);
+        virtio_stl_p(vdev, &hdr->hash_value, hash);
+        virtio_stw_p(vdev, &hdr->hash_report, reports[type]);
+        index = rss->indirections_table[hash & (rss->indirections_len - 1)];
+    } else {
+        index = rss->default_queue;
+    }
+
+    if (!rss->redirect || index == nc->queue_index) {
+        return nc;
+    }
+    return qemu_get_subqueue(n->nic, index);
+}
+
 static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
-                                      size_t size)
+                                      size_t size,
+                                      const struct virtio_net_hdr_v1_hash *hdr)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
@@ -1252,7 +1615,14 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
                                     sizeof(mhdr.num_buffers));
             }
 
-            receive_header(n, sg, elem->in_num, buf, size);
+            receive_header(n, sg, elem->in_num, buf, size, hdr);
+            if (n->rss_data.populate_hash) {
+                iov_from_buf(sg, elem->in_num,
+                             offsetof(typeof(*hdr), hash_value),
+                             &hdr->hash_value,
+                             sizeof(*hdr) - offsetof(typeof(*hdr),
+                                                     hash_value));
+            }
             offset = n->host_hdr_len;
             total += n->guest_hdr_len;
             guest_offset = n->guest_hdr_len;
@@ -1275,7 +1645,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
         }
 
         /* signal other side */
-        virtqueue_fill(q->rx_vq, elem, total, i++);
+        virtqueue_fill(q->rx_vq, elem, total, q->rx_pending + i++);
         g_free(elem);
     }
 
@@ -1286,8 +1656,378 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
                      &mhdr.num_buffers, sizeof mhdr.num_buffers);
     }
 
-    virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    q->rx_pending += i;
+    qemu_bh_schedule(q->rx_bh);
+
+    return size;
+}
+
+/*
+ * Receive segment coalescing.  Backends without a virtio-net header pass
+ * TCP streams as MTU-sized frames; in-order segments of a flow are merged
+ * into one GSO packet, which is delivered when the sender pushes, the flow
+ * goes out of order or rsc_interval expires, whichever comes first.
+ */
+struct VirtioNetRscSeg {
+    QTAILQ_ENTRY(VirtioNetRscSeg) next;
+    NetClientState *nc;
+    struct virtio_net_hdr_v1_hash hdr;
+    uint8_t *buf;
+    size_t size;
+    size_t l4_off;
+    size_t l5_off;
+    uint32_t next_seq;
+    uint16_t mss;
+    uint16_t packets;
+    bool is_ipv6;
+    bool stalled;       /* waiting for rx buffers, takes no more segments */
+};
+
+#define VIRTIO_NET_RSC_BYPASS_FLAGS (TH_FIN | TH_SYN | TH_RST | TH_URG | \
+                                     0x40 /* ECE */ | 0x80 /* CWR */)
+
+/* Fill in @pkt for a plain IPv4/IPv6 TCP frame that may be coalesced */
+static bool virtio_net_rsc_parse(VirtioNetRscSeg *pkt, const uint8_t *buf,
+                                 size_t size)
+{
+    const struct tcp_header *tcp;
+    size_t l3_len, tcp_len;
+
+    if (size < ETH_HLEN) {
+        return false;
+    }
+
+    switch (lduw_be_p(&PKT_GET_ETH_HDR(buf)->h_proto)) {
+    case ETH_P_IP: {
+        const struct ip_header *ip = (const void *)(buf + ETH_HLEN);
+
+        /* no options, no fragments */
+        if (size < ETH_HLEN + sizeof(*ip) ||
+            ldub_p(&ip->ip_ver_len) != 0x45 ||
+            ldub_p(&ip->ip_p) != IP_PROTO_TCP ||
+            (lduw_be_p(&ip->ip_off) & (IP_OFFMASK | IP_MF))) {
+            return false;
+        }
+        l3_len = lduw_be_p(&ip->ip_len);
+        pkt->l4_off = ETH_HLEN + sizeof(*ip);
+        pkt->is_ipv6 = false;
+        break;
+    }
+    case ETH_P_IPV6: {
+        const struct ip6_header *ip6 = (const void *)(buf + ETH_HLEN);
+
+        /* no extension headers */
+        if (size < ETH_HLEN + sizeof(*ip6) ||
+            ldub_p(&ip6->ip6_ctlun.ip6_un2_vfc) >> 4 != IP_HEADER_VERSION_6 ||
+            ldub_p(&ip6->ip6_nxt) != IP_PROTO_TCP) {
+            return false;
+        }
+        l3_len = sizeof(*ip6) +
+                 lduw_be_p(&ip6->ip6_ctlun.ip6_un1.ip6_un1_plen);
+        pkt->l4_off = ETH_HLEN + sizeof(*ip6);
+        pkt->is_ipv6 = true;
+        break;
+    }
+    default:
+        return false;
+    }
+
+    /* the frame may carry link-layer padding after the IP packet */
+    if (ETH_HLEN + l3_len > size ||
+        pkt->l4_off + sizeof(*tcp) > ETH_HLEN + l3_len) {
+        return false;
+    }
+    tcp = (const void *)(buf + pkt->l4_off);
+    tcp_len = (lduw_be_p(&tcp->th_offset_flags) >> 12) << 2;
+    if (tcp_len < sizeof(*tcp) || pkt->l4_off + tcp_len > ETH_HLEN + l3_len) {
+        return false;
+    }
+
+    pkt->buf = (uint8_t *)buf;
+    pkt->size = ETH_HLEN + l3_len;
+    pkt->l5_off = pkt->l4_off + tcp_len;
+    return true;
+}
+
+static bool virtio_net_rsc_same_flow(VirtioNetRscSeg *seg,
+                                     VirtioNetRscSeg *pkt)
+{
+    size_t addr_off, addr_len;
+
+    if (seg->nc != pkt->nc || seg->is_ipv6 != pkt->is_ipv6) {
+        return false;
+    }
+
+    if (pkt->is_ipv6) {
+        addr_off = ETH_HLEN + offsetof(struct ip6_header, ip6_src);
+        addr_len = 2 * sizeof(struct in6_address);
+    } else {
+        addr_off = ETH_HLEN + offsetof(struct ip_header, ip_src);
+        addr_len = 2 * sizeof(uint32_t);
+    }
+
+    return !memcmp(seg->buf, pkt->buf, ETH_HLEN) &&
+           !memcmp(seg->buf + addr_off, pkt->buf + addr_off, addr_len) &&
+           !memcmp(seg->buf + seg->l4_off, pkt->buf + pkt->l4_off,
+                   2 * sizeof(uint16_t));
+}
+
+/* Same rules as the guest's own GRO: anything unusual ends the packet */
+static bool virtio_net_rsc_can_merge(VirtioNetRscSeg *seg,
+                                     VirtioNetRscSeg *pkt, size_t payload)
+{
+    const struct tcp_header *stcp = (const void *)(seg->buf + seg->l4_off);
+    const struct tcp_header *ptcp = (const void *)(pkt->buf + pkt->l4_off);
+    size_t tcp_len = seg->l5_off - seg->l4_off;
+    size_t l3_len;
+
+    if (seg->stalled ||
+        pkt->l5_off - pkt->l4_off != tcp_len ||
+        payload > seg->mss ||
+        ldl_be_p(&ptcp->th_seq) != seg->next_seq ||
+        ldl_be_p(&ptcp->th_ack) != ldl_be_p(&stcp->th_ack) ||
+        lduw_be_p(&ptcp->th_win) != lduw_be_p(&stcp->th_win) ||
+        memcmp(stcp + 1, ptcp + 1, tcp_len - sizeof(*stcp))) {
+        return false;
+    }
+
+    if (seg->is_ipv6) {
+        const struct ip6_header *sip6 = (const void *)(seg->buf + ETH_HLEN);
+        const struct ip6_header *pip6 = (const void *)(pkt->buf + ETH_HLEN);
+
+        l3_len = seg->size - seg->l4_off;
+        if (ldl_be_p(&sip6->ip6_ctlun.ip6_un1.ip6_un1_flow) !=
+            ldl_be_p(&pip6->ip6_ctlun.ip6_un1.ip6_un1_flow) ||
+            ldub_p(&sip6->ip6_ctlun.ip6_un1.ip6_un1_hlim) !=
+            ldub_p(&pip6->ip6_ctlun.ip6_un1.ip6_un1_hlim)) {
+            return false;
+        }
+    } else {
+        const struct ip_header *sip = (const void *)(seg->buf + ETH_HLEN);
+        const struct ip_header *pip = (const void *)(pkt->buf + ETH_HLEN);
+
+        l3_len = seg->size - ETH_HLEN;
+        if (ldub_p(&sip->ip_tos) != ldub_p(&pip->ip_tos) ||
+            ldub_p(&sip->ip_ttl) != ldub_p(&pip->ip_ttl) ||
+            lduw_be_p(&sip->ip_off) != lduw_be_p(&pip->ip_off)) {
+            return false;
+        }
+    }
+
+    return l3_len + payload <= 0xffff;
+}
+
+/*
+ * The guest does not verify the checksum of a merged packet, so only
+ * segments that arrived intact may be merged.
+ */
+static bool virtio_net_rsc_csum_valid(VirtioNetRscSeg *pkt)
+{
+    uint16_t l4_len = pkt->size - pkt->l4_off;
+    uint32_t csum;
+
+    if (pkt->is_ipv6) {
+        struct ip6_header *ip6 = (void *)(pkt->buf + ETH_HLEN);
+
+        csum = net_checksum_add(2 * sizeof(struct in6_address),
+                                (uint8_t *)&ip6->ip6_src);
+    } else {
+        struct ip_header *ip = (void *)(pkt->buf + ETH_HLEN);
+
+        if (net_raw_checksum((uint8_t *)ip, sizeof(*ip))) {
+            return false;
+        }
+        csum = net_checksum_add(2 * sizeof(uint32_t),
+                                (uint8_t *)&ip->ip_src);
+    }
+
+    csum += IP_PROTO_TCP + l4_len;
+    csum += net_checksum_add(l4_len, pkt->buf + pkt->l4_off);
+    return !net_checksum_finish(csum);
+}
+
+/* Turn the merged frame into a GSO packet that the guest checksums */
+static void virtio_net_rsc_build_gso(VirtIONet *n, VirtioNetRscSeg *seg)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    struct tcp_header *tcp = (void *)(seg->buf + seg->l4_off);
+    uint16_t l4_len = seg->size - seg->l4_off;
+    uint32_t csum;
+
+    if (seg->is_ipv6) {
+        struct ip6_header *ip6 = (void *)(seg->buf + ETH_HLEN);
+
+        stw_be_p(&ip6->ip6_ctlun.ip6_un1.ip6_un1_plen, l4_len);
+        csum = net_checksum_add(2 * sizeof(struct in6_address),
+                                (uint8_t *)&ip6->ip6_src);
+        seg->hdr.hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
+    } else {
+        struct ip_header *ip = (void *)(seg->buf + ETH_HLEN);
+
+        stw_be_p(&ip->ip_len, seg->size - ETH_HLEN);
+        stw_be_p(&ip->ip_sum, 0);
+        stw_be_p(&ip->ip_sum, net_raw_checksum((uint8_t *)ip, sizeof(*ip)));
+        csum = net_checksum_add(2 * sizeof(uint32_t),
+                                (uint8_t *)&ip->ip_src);
+        seg->hdr.hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+    }
+
+    /* pseudo-header sum only, like any other partially checksummed packet */
+    csum += IP_PROTO_TCP + l4_len;
+    stw_be_p(&tcp->th_sum, (uint16_t)~net_checksum_finish(csum));
+
+    seg->hdr.hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    virtio_stw_p(vdev, &seg->hdr.hdr.hdr_len, seg->l5_off);
+    virtio_stw_p(vdev, &seg->hdr.hdr.gso_size, seg->mss);
+    virtio_stw_p(vdev, &seg->hdr.hdr.csum_start, seg->l4_off);
+    virtio_stw_p(vdev, &seg->hdr.hdr.csum_offset,
+                 offsetof(struct tcp_header, th_sum));
+}
+
+static void virtio_net_rsc_free_seg(VirtIONet *n, VirtioNetRscSeg *seg)
+{
+    QTAILQ_REMOVE(&n->rsc_segs, seg, next);
+    n->rsc_nr_segs--;
+    g_free(seg->buf);
+    g_free(seg);
+}
+
+/*
+ * Returns false if the queue has no room for the packet; it is then kept
+ * and retried when the guest adds buffers.  Called within rcu_read_lock().
+ */
+static bool virtio_net_rsc_drain_seg(VirtIONet *n, VirtioNetRscSeg *seg)
+{
+    if (seg->packets > 1) {
+        virtio_net_rsc_build_gso(n, seg);
+    }
+    if (!virtio_net_receive_rcu(seg->nc, seg->buf, seg->size, &seg->hdr)) {
+        seg->stalled = true;
+        return false;
+    }
+    virtio_net_rsc_free_seg(n, seg);
+    return true;
+}
+
+/* Drain the flows of @nc, or of every queue if NULL.
+ * Called within rcu_read_lock().
+ */
+static void virtio_net_rsc_drain(VirtIONet *n, NetClientState *nc)
+{
+    VirtioNetRscSeg *seg, *tmp;
+
+    QTAILQ_FOREACH_SAFE(seg, &n->rsc_segs, next, tmp) {
+        if (!nc || seg->nc == nc) {
+            virtio_net_rsc_drain_seg(n, seg);
+        }
+    }
+}
+
+/* Drop the flows of @nc, or of every queue if NULL.  */
+static void virtio_net_rsc_purge(VirtIONet *n, NetClientState *nc)
+{
+    VirtioNetRscSeg *seg, *tmp;
+
+    QTAILQ_FOREACH_SAFE(seg, &n->rsc_segs, next, tmp) {
+        if (!nc || seg->nc == nc) {
+            virtio_net_rsc_free_seg(n, seg);
+        }
+    }
+    if (QTAILQ_EMPTY(&n->rsc_segs)) {
+        timer_del(n->rsc_timer);
+    }
+}
+
+static void virtio_net_rsc_timer(void *opaque)
+{
+    VirtIONet *n = opaque;
+
+    rcu_read_lock();
+    virtio_net_rsc_drain(n, NULL);
+    rcu_read_unlock();
+}
+
+static ssize_t virtio_net_rsc_receive(NetClientState *nc, const uint8_t *buf,
+                                      size_t size,
+                                      const struct virtio_net_hdr_v1_hash *hdr)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtioNetRscSeg pkt = { .nc = nc }, *seg;
+    const struct tcp_header *tcp;
+    size_t payload;
+    uint8_t flags;
+
+    if (!virtio_net_rsc_parse(&pkt, buf, size) ||
+        !(pkt.is_ipv6 ? n->rsc6_enabled : n->rsc4_enabled)) {
+        return virtio_net_receive_rcu(nc, buf, size, hdr);
+    }
+
+    tcp = (const void *)(buf + pkt.l4_off);
+    flags = lduw_be_p(&tcp->th_offset_flags) & 0xff;
+    payload = pkt.size - pkt.l5_off;
+
+    QTAILQ_FOREACH(seg, &n->rsc_segs, next) {
+        if (virtio_net_rsc_same_flow(seg, &pkt)) {
+            break;
+        }
+    }
+
+    /*
+     * Control segments, pure ACKs and corrupted segments are delivered in
+     * order, right away.  If the flow can't be delivered first, the packet
+     * waits in the backlog like when the queue is full.
+     */
+    if (!payload || (flags & VIRTIO_NET_RSC_BYPASS_FLAGS) ||
+        !virtio_net_rsc_csum_valid(&pkt)) {
+        if (seg && !virtio_net_rsc_drain_seg(n, seg)) {
+            return 0;
+        }
+        return virtio_net_receive_rcu(nc, buf, size, hdr);
+    }
+
+    if (seg && virtio_net_rsc_can_merge(seg, &pkt, payload)) {
+        memcpy(seg->buf + seg->size, buf + pkt.l5_off, payload);
+        seg->size += payload;
+        seg->next_seq += payload;
+        seg->packets++;
+        if (flags & TH_PUSH) {
+            struct tcp_header *stcp = (void *)(seg->buf + seg->l4_off);
+
+            stw_be_p(&stcp->th_offset_flags,
+                     lduw_be_p(&stcp->th_offset_flags) | TH_PUSH);
+        }
+    } else {
+        if (seg) {
+            if (!virtio_net_rsc_drain_seg(n, seg)) {
+                return 0;
+            }
+        } else if (n->rsc_nr_segs == VIRTIO_NET_RSC_MAX_FLOWS) {
+            if (!virtio_net_rsc_drain_seg(n, QTAILQ_FIRST(&n->rsc_segs))) {
+                return 0;
+            }
+        }
+
+        seg = g_new(VirtioNetRscSeg, 1);
+        *seg = pkt;
+        seg->buf = g_malloc(VIRTIO_NET_RSC_BUF_SIZE);
+        memcpy(seg->buf, buf, pkt.size);
+        seg->hdr = *hdr;
+        seg->next_seq = ldl_be_p(&tcp->th_seq) + payload;
+        seg->mss = payload;
+        seg->packets = 1;
+        QTAILQ_INSERT_TAIL(&n->rsc_segs, seg, next);
+        n->rsc_nr_segs++;
+
+        if (!timer_pending(n->rsc_timer)) {
+            timer_mod(n->rsc_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                                    n->rsc_interval);
+        }
+    }
+
+    /* a pushed or short segment ends the burst; it is retried if stuck */
+    if ((flags & TH_PUSH) || payload < seg->mss) {
+        virtio_net_rsc_drain_seg(n, seg);
+    }
 
     return size;
 }
@@ -1295,10 +2035,19 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
 static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
                                   size_t size)
 {
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    struct virtio_net_hdr_v1_hash hdr = {};
     ssize_t r;
 
     rcu_read_lock();
-    r = virtio_net_receive_rcu(nc, buf, size);
+    if (n->rss_data.enabled && virtio_net_can_receive(nc)) {
+        nc = virtio_net_process_rss(nc, buf, size, &hdr);
+    }
+    if ((n->rsc4_enabled || n->rsc6_enabled) && virtio_net_can_receive(nc)) {
+        r = virtio_net_rsc_receive(nc, buf, size, &hdr);
+    } else {
+        r = virtio_net_receive_rcu(nc, buf, size, &hdr);
+    }
     rcu_read_unlock();
     return r;
 }
@@ -1314,21 +2063,90 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
     virtio_notify(vdev, q->tx_vq);
 
-    g_free(q->async_tx.elem);
+    virtqueue_free_element(q->tx_vq, q->async_tx.elem);
     q->async_tx.elem = NULL;
 
     virtio_queue_set_notification(q->tx_vq, 1);
     virtio_net_flush_tx(q);
 }
 
+/* Hand one packet to the backend.  Returns 0 if it was sent or dropped,
+ * -EBUSY if the backend queued it, or -EINVAL if the element was malformed,
+ * in which case it has been detached and freed.  */
+static int virtio_net_tx_packet(VirtIONetQueue *q, VirtQueueElement *elem)
+{
+    VirtIONet *n = q->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    ssize_t ret;
+    unsigned int out_num;
+    struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
+    struct virtio_net_hdr_v1_hash mhdr;
+
+    out_num = elem->out_num;
+    out_sg = elem->out_sg;
+    if (out_num < 1) {
+        virtio_error(vdev, "virtio-net header not in first element");
+        virtqueue_detach_element(q->tx_vq, elem, 0);
+        virtqueue_free_element(q->tx_vq, elem);
+        return -EINVAL;
+    }
+
+    if (n->has_vnet_hdr) {
+        if (iov_to_buf(out_sg, out_num, 0, &mhdr, n->guest_hdr_len) <
+            n->guest_hdr_len) {
+            virtio_error(vdev, "virtio-net header incorrect");
+            virtqueue_detach_element(q->tx_vq, elem, 0);
+            virtqueue_free_element(q->tx_vq, elem);
+            return -EINVAL;
+        }
+        if (n->needs_vnet_hdr_swap) {
+            virtio_net_hdr_swap(vdev, (void *) &mhdr);
+            sg2[0].iov_base = &mhdr;
+            sg2[0].iov_len = n->guest_hdr_len;
+            out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
+                               out_sg, out_num,
+                               n->guest_hdr_len, -1);
+            if (out_num == VIRTQUEUE_MAX_SIZE) {
+                return 0;
+            }
+            out_num += 1;
+            out_sg = sg2;
+        }
+    }
+    /*
+     * If host wants to see the guest header as is, we can
+     * pass it on unchanged. Otherwise, copy just the parts
+     * that host is interested in.
+     */
+    assert(n->host_hdr_len <= n->guest_hdr_len);
+    if (n->host_hdr_len != n->guest_hdr_len) {
+        unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
+                                   out_sg, out_num,
+                                   0, n->host_hdr_len);
+        sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
+                         out_sg, out_num,
+                         n->guest_hdr_len, -1);
+        out_num = sg_num;
+        out_sg = sg;
+    }
+
+    ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
+                                  out_sg, out_num, virtio_net_tx_complete);
+    return ret == 0 ? -EBUSY : 0;
+}
+
 /* TX */
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    VirtQueueElement *elem;
+    VirtQueueElement *elems[VIRTIO_NET_TX_BATCH];
+    unsigned int lens[VIRTIO_NET_TX_BATCH] = {};
+    unsigned int i, num, sent;
     int32_t num_packets = 0;
-    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    int ret = 0;
+
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
     }
@@ -1338,80 +2156,43 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         return num_packets;
     }
 
-    for (;;) {
-        ssize_t ret;
-        unsigned int out_num;
-        struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
-        struct virtio_net_hdr_mrg_rxbuf mhdr;
-
-        elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
-        if (!elem) {
+    while (num_packets < n->tx_burst) {
+        num = virtqueue_pop_batch(q->tx_vq, sizeof(VirtQueueElement),
+                                  (void **)elems,
+                                  MIN(VIRTIO_NET_TX_BATCH,
+                                      n->tx_burst - num_packets));
+        if (!num) {
             break;
         }
 
-        out_num = elem->out_num;
-        out_sg = elem->out_sg;
-        if (out_num < 1) {
-            virtio_error(vdev, "virtio-net header not in first element");
-            virtqueue_detach_element(q->tx_vq, elem, 0);
-            g_free(elem);
-            return -EINVAL;
+        for (sent = 0; sent < num; sent++) {
+            ret = virtio_net_tx_packet(q, elems[sent]);
+            if (ret < 0) {
+                break;
+            }
         }
 
-        if (n->has_vnet_hdr) {
-            if (iov_to_buf(out_sg, out_num, 0, &mhdr, n->guest_hdr_len) <
-                n->guest_hdr_len) {
-                virtio_error(vdev, "virtio-net header incorrect");
-                virtqueue_detach_element(q->tx_vq, elem, 0);
-                g_free(elem);
-                return -EINVAL;
+        /* Complete everything that went out with one used ring update */
+        if (sent) {
+            virtqueue_push_batch(q->tx_vq, elems, lens, sent);
+            virtio_notify(vdev, q->tx_vq);
+            for (i = 0; i < sent; i++) {
+                virtqueue_free_element(q->tx_vq, elems[i]);
             }
-            if (n->needs_vnet_hdr_swap) {
-                virtio_net_hdr_swap(vdev, (void *) &mhdr);
-                sg2[0].iov_base = &mhdr;
-                sg2[0].iov_len = n->guest_hdr_len;
-                out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
-                                   out_sg, out_num,
-                                   n->guest_hdr_len, -1);
-                if (out_num == VIRTQUEUE_MAX_SIZE) {
-                    goto drop;
-		}
-                out_num += 1;
-                out_sg = sg2;
-	    }
+            num_packets += sent;
         }
-        /*
-         * If host wants to see the guest header as is, we can
-         * pass it on unchanged. Otherwise, copy just the parts
-         * that host is interested in.
-         */
-        assert(n->host_hdr_len <= n->guest_hdr_len);
-        if (n->host_hdr_len != n->guest_hdr_len) {
-            unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
-                                       out_sg, out_num,
-                                       0, n->host_hdr_len);
-            sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
-                             out_sg, out_num,
-                             n->guest_hdr_len, -1);
-            out_num = sg_num;
-            out_sg = sg;
-        }
-
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
-        if (ret == 0) {
-            virtio_queue_set_notification(q->tx_vq, 0);
-            q->async_tx.elem = elem;
-            return -EBUSY;
-        }
-
-drop:
-        virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-        g_free(elem);
 
-        if (++num_packets >= n->tx_burst) {
-            break;
+        if (ret < 0) {
+            if (ret == -EBUSY) {
+                virtio_queue_set_notification(q->tx_vq, 0);
+                q->async_tx.elem = elems[sent];
+            }
+            /* Leave the rest of the batch in the ring, newest first */
+            for (i = num - 1; i > sent; i--) {
+                virtqueue_unpop(q->tx_vq, elems[i], 0);
+                virtqueue_free_element(q->tx_vq, elems[i]);
+            }
+            return ret;
         }
     }
     return num_packets;
@@ -1548,6 +2329,8 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
 
     n->vqs[index].rx_vq = virtio_add_queue(vdev, n->net_conf.rx_queue_size,
                                            virtio_net_handle_rx);
+    n->vqs[index].rx_bh = qemu_bh_new(virtio_net_rx_bh, &n->vqs[index]);
+    n->vqs[index].rx_pending = 0;
 
     if (n->net_conf.tx && !strcmp(n->net_conf.tx, "timer")) {
         n->vqs[index].tx_vq =
@@ -1574,7 +2357,11 @@ static void virtio_net_del_queue(VirtIONet *n, int index)
     NetClientState *nc = qemu_get_subqueue(n->nic, index);
 
     qemu_purge_queued_packets(nc);
+    virtio_net_rsc_purge(n, nc);
 
+    qemu_bh_delete(q->rx_bh);
+    q->rx_bh = NULL;
+    virtio_net_rx_flush(q);
     virtio_del_queue(vdev, index * 2);
     if (q->tx_timer) {
         timer_del(q->tx_timer);
@@ -1641,7 +2428,9 @@ static int virtio_net_post_load_device(void *opaque, int version_id)
 
     virtio_net_set_mrg_rx_bufs(n, n->mergeable_rx_bufs,
                                virtio_vdev_has_feature(vdev,
-                                                       VIRTIO_F_VERSION_1));
+                                                       VIRTIO_F_VERSION_1),
+                               virtio_vdev_has_feature(vdev,
+                                                       VIRTIO_NET_F_HASH_REPORT));
 
     /* MAC_TABLE_ENTRIES may be different from the saved image */
     if (n->mac_table.in_use > MAC_TABLE_ENTRIES) {
@@ -1840,6 +2629,50 @@ static const VMStateDescription vmstate_virtio_net_has_vnet = {
     },
 };
 
+static bool virtio_net_rss_needed(void *opaque)
+{
+    return VIRTIO_NET(opaque)->rss_data.enabled;
+}
+
+static int virtio_net_rss_post_load(void *opaque, int version_id)
+{
+    VirtIONet *n = opaque;
+    VirtioNetRssData *rss = &n->rss_data;
+    int i;
+
+    if (!is_power_of_2(rss->indirections_len) ||
+        rss->indirections_len > VIRTIO_NET_RSS_MAX_TABLE_LEN ||
+        rss->default_queue >= n->max_queues) {
+        return -EINVAL;
+    }
+    for (i = 0; i < rss->indirections_len; i++) {
+        if (rss->indirections_table[i] >= n->max_queues) {
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_virtio_net_rss = {
+    .name = "virtio-net-device/rss",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = virtio_net_rss_needed,
+    .post_load = virtio_net_rss_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(rss_data.enabled, VirtIONet),
+        VMSTATE_BOOL(rss_data.redirect, VirtIONet),
+        VMSTATE_UINT32(rss_data.hash_types, VirtIONet),
+        VMSTATE_UINT16(rss_data.indirections_len, VirtIONet),
+        VMSTATE_UINT16(rss_data.default_queue, VirtIONet),
+        VMSTATE_UINT8_ARRAY(rss_data.key, VirtIONet,
+                            VIRTIO_NET_RSS_MAX_KEY_SIZE),
+        VMSTATE_UINT16_ARRAY(rss_data.indirections_table, VirtIONet,
+                             VIRTIO_NET_RSS_MAX_TABLE_LEN),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static const VMStateDescription vmstate_virtio_net_device = {
     .name = "virtio-net-device",
     .version_id = VIRTIO_NET_VM_VERSION,
@@ -1890,6 +2723,10 @@ static const VMStateDescription vmstate_virtio_net_device = {
                             has_ctrl_guest_offloads),
         VMSTATE_END_OF_LIST()
    },
+    .subsections = (const VMStateDescription * []) {
+        &vmstate_virtio_net_rss,
+        NULL
+    }
 };
 
 static NetClientInfo net_virtio_info = {
@@ -2065,7 +2902,7 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 
     n->vqs[0].tx_waiting = 0;
     n->tx_burst = n->net_conf.txburst;
-    virtio_net_set_mrg_rx_bufs(n, 0, 0);
+    virtio_net_set_mrg_rx_bufs(n, 0, 0, 0);
     n->promisc = 1; /* for compatibility */
 
     n->mac_table.macs = g_malloc0(MAC_TABLE_ENTRIES * ETH_ALEN);
@@ -2075,6 +2912,11 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     nc = qemu_get_queue(n->nic);
     nc->rxfilter_notify_enabled = 1;
 
+    net_rx_pkt_init(&n->rx_pkt, false);
+
+    QTAILQ_INIT(&n->rsc_segs);
+    n->rsc_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, virtio_net_rsc_timer, n);
+
     n->qdev = dev;
 }
 
@@ -2102,8 +2944,11 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
 
     timer_del(n->announce_timer);
     timer_free(n->announce_timer);
+    virtio_net_rsc_purge(n);
+    timer_free(n->rsc_timer);
     g_free(n->vqs);
     qemu_del_nic(n->nic);
+    net_rx_pkt_uninit(n->rx_pkt);
     virtio_cleanup(vdev);
 }
 
@@ -2184,6 +3029,13 @@ static Property virtio_net_properties[] = {
     DEFINE_PROP_BIT64("ctrl_guest_offloads", VirtIONet, host_features,
                     VIRTIO_NET_F_CTRL_GUEST_OFFLOADS, true),
     DEFINE_PROP_BIT64("mq", VirtIONet, host_features, VIRTIO_NET_F_MQ, false),
+    DEFINE_PROP_BIT64("rss", VirtIONet, host_features,
+                    VIRTIO_NET_F_RSS, false),
+    DEFINE_PROP_BIT64("hash", VirtIONet, host_features,
+                    VIRTIO_NET_F_HASH_REPORT, false),
+    DEFINE_PROP_BOOL("rsc", VirtIONet, rsc_enabled, false),
+    DEFINE_PROP_UINT32("rsc_interval", VirtIONet, rsc_interval,
+                       VIRTIO_NET_RSC_DEFAULT_INTERVAL),
     DEFINE_NIC_PROPERTIES(VirtIONet, nic_conf),
     DEFINE_PROP_UINT32("x-txtimer", VirtIONet, net_conf.txtimer,
                        TX_TIMER_INTERVAL),
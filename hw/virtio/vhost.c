@@ -19,6 +19,7 @@
 #include "hw/hw.h"
 #include "qemu/atomic.h"
 #include "qemu/range.h"
+#include "qemu/units.h"
 #include "qemu/error-report.h"
 #include "qemu/memfd.h"
 #include <linux/vhost.h>
@@ -41,6 +42,9 @@
     do { } while (0)
 #endif
 
+/* How far past a missing IOVA the IOTLB miss handler translates ahead */
+#define VHOST_IOTLB_PREFETCH_SIZE (2 * MiB)
+
 static struct vhost_log *vhost_log;
 static struct vhost_log *vhost_log_shm;
 
@@ -643,14 +647,83 @@ static void vhost_region_addnop(MemoryListener *listener,
     vhost_region_add_section(dev, section);
 }
 
+/*
+ * hdev->iotlb_cache tracks the IOVA ranges that have been sent to the
+ * backend with an IOTLB update.  It may be larger than what the backend
+ * actually caches, but never smaller: unmaps that do not hit it need no
+ * invalidation message at all.
+ */
+static void vhost_iotlb_cache_destroy(struct vhost_dev *hdev)
+{
+    if (hdev->iotlb_cache) {
+        iova_tree_destroy(hdev->iotlb_cache);
+        hdev->iotlb_cache = NULL;
+    }
+}
+
+/*
+ * Remove every cached range overlapping [*start, *end] and widen the
+ * interval so that it covers them.  Returns false if nothing was cached.
+ */
+static bool vhost_iotlb_cache_take(struct vhost_dev *hdev,
+                                   uint64_t *start, uint64_t *end)
+{
+    DMAMap map = { .iova = *start, .size = *end - *start };
+    DMAMap *found;
+    bool hit = false;
+
+    if (!hdev->iotlb_cache) {
+        return true;
+    }
+
+    while ((found = iova_tree_find(hdev->iotlb_cache, &map))) {
+        *start = MIN(*start, found->iova);
+        *end = MAX(*end, found->iova + found->size);
+        iova_tree_remove(hdev->iotlb_cache, found);
+        hit = true;
+    }
+    return hit;
+}
+
+static void vhost_iotlb_cache_add(struct vhost_dev *hdev,
+                                  uint64_t iova, uint64_t len)
+{
+    uint64_t start = iova, end = iova + len - 1;
+    DMAMap map;
+
+    if (!hdev->iotlb_cache) {
+        return;
+    }
+
+    /* The backend may still hold the old ranges, keep them covered */
+    vhost_iotlb_cache_take(hdev, &start, &end);
+    map = (DMAMap) {
+        .iova = start,
+        .size = end - start,
+        .perm = IOMMU_RW,
+    };
+    iova_tree_insert(hdev->iotlb_cache, &map);
+}
+
 static void vhost_iommu_unmap_notify(IOMMUNotifier *n, IOMMUTLBEntry *iotlb)
 {
     struct vhost_iommu *iommu = container_of(n, struct vhost_iommu, n);
     struct vhost_dev *hdev = iommu->hdev;
-    hwaddr iova = iotlb->iova + iommu->iommu_offset;
+    uint64_t start = iotlb->iova + iommu->iommu_offset;
+    uint64_t end = start + iotlb->addr_mask;
+
+    /*
+     * Unmaps of pages the backend never saw are dropped, and a single
+     * invalidation covers every cached range the unmap touches.
+     */
+    if (!vhost_iotlb_cache_take(hdev, &start, &end)) {
+        trace_vhost_iotlb_invalidate_skip(hdev, start, iotlb->addr_mask + 1);
+        return;
+    }
 
-    if (vhost_backend_invalidate_device_iotlb(hdev, iova,
-                                              iotlb->addr_mask + 1)) {
+    trace_vhost_iotlb_invalidate(hdev, start, end - start + 1);
+    if (vhost_backend_invalidate_device_iotlb(hdev, start,
+                                              end - start + 1)) {
         error_report("Fail to invalidate device iotlb");
     }
 }
@@ -898,47 +971,124 @@ static int vhost_memory_region_lookup(struct vhost_dev *hdev,
     return -EFAULT;
 }
 
-int vhost_device_iotlb_miss(struct vhost_dev *dev, uint64_t iova, int write)
+/*
+ * Translate @iova and fill in the host range it maps to.  The range is
+ * clamped to the vhost memory region, so that consecutive translations
+ * can be merged only while they stay inside one region.
+ */
+static int vhost_iotlb_translate(struct vhost_dev *dev, uint64_t iova,
+                                 int write, uint64_t *start, uint64_t *uaddr,
+                                 uint64_t *len, IOMMUAccessFlags *perm)
 {
     IOMMUTLBEntry iotlb;
-    uint64_t uaddr, len;
-    int ret = -EFAULT;
+    uint64_t region_len;
+
+    iotlb = address_space_get_iotlb_entry(dev->vdev->dma_as,
+                                          iova, write,
+                                          MEMTXATTRS_UNSPECIFIED);
+    if (iotlb.target_as == NULL || iotlb.perm == IOMMU_NONE) {
+        return -ENOENT;
+    }
+
+    if (vhost_memory_region_lookup(dev, iotlb.translated_addr,
+                                   uaddr, &region_len)) {
+        return -EFAULT;
+    }
+
+    *start = iova & ~iotlb.addr_mask;
+    *len = MIN(iotlb.addr_mask + 1, region_len);
+    *perm = iotlb.perm;
+    return 0;
+}
+
+static int vhost_iotlb_update(struct vhost_dev *dev, uint64_t iova,
+                              uint64_t uaddr, uint64_t len,
+                              IOMMUAccessFlags perm)
+{
+    int ret;
+
+    trace_vhost_iotlb_update(dev, iova, uaddr, len, perm);
+    ret = vhost_backend_update_device_iotlb(dev, iova, uaddr, len, perm);
+    if (!ret) {
+        vhost_iotlb_cache_add(dev, iova, len);
+    }
+    return ret;
+}
+
+int vhost_device_iotlb_miss(struct vhost_dev *dev, uint64_t iova, int write)
+{
+    uint64_t start, uaddr, len, limit;
+    uint64_t next, piece, next_uaddr, next_len;
+    IOMMUAccessFlags perm, next_perm;
+    int ret;
 
     rcu_read_lock();
 
     trace_vhost_iotlb_miss(dev, 1);
 
-    iotlb = address_space_get_iotlb_entry(dev->vdev->dma_as,
-                                          iova, write,
-                                          MEMTXATTRS_UNSPECIFIED);
-    if (iotlb.target_as != NULL) {
-        ret = vhost_memory_region_lookup(dev, iotlb.translated_addr,
-                                         &uaddr, &len);
-        if (ret) {
-            trace_vhost_iotlb_miss(dev, 3);
-            error_report("Fail to lookup the translated address "
-                         "%"PRIx64, iotlb.translated_addr);
-            goto out;
-        }
+    ret = vhost_iotlb_translate(dev, iova, write, &start, &uaddr, &len, &perm);
+    if (ret == -ENOENT) {
+        ret = -EFAULT;
+        goto done;
+    }
+    if (ret) {
+        trace_vhost_iotlb_miss(dev, 3);
+        error_report("Fail to lookup the translated address "
+                     "%"PRIx64, iova);
+        goto out;
+    }
 
-        len = MIN(iotlb.addr_mask + 1, len);
-        iova = iova & ~iotlb.addr_mask;
+    /*
+     * A miss is a synchronous round trip for the backend, so answer it
+     * with as much as we can: the following IOVA pages are translated
+     * as well, up to VHOST_IOTLB_PREFETCH_SIZE past the faulting
+     * address.  Translations that are contiguous in both IOVA and host
+     * space are merged into a single update; a discontinuity starts a
+     * new one.  Prefetching stops at the first unmapped page or at the
+     * first page the backend already has.
+     */
+    limit = MAX(iova, start + len) + VHOST_IOTLB_PREFETCH_SIZE;
+    for (next = start + len; next && next < limit; next += next_len) {
+        if (dev->iotlb_cache &&
+            iova_tree_find_address(dev->iotlb_cache, next)) {
+            break;
+        }
+        if (vhost_iotlb_translate(dev, next, write, &piece, &next_uaddr,
+                                  &next_len, &next_perm) || piece != next) {
+            break;
+        }
+        if (next_uaddr == uaddr + len && next_perm == perm) {
+            len += next_len;
+            continue;
+        }
 
-        ret = vhost_backend_update_device_iotlb(dev, iova, uaddr,
-                                                len, iotlb.perm);
+        ret = vhost_iotlb_update(dev, start, uaddr, len, perm);
         if (ret) {
-            trace_vhost_iotlb_miss(dev, 4);
-            error_report("Fail to update device iotlb");
-            goto out;
+            goto fail;
         }
+        start = next;
+        uaddr = next_uaddr;
+        len = next_len;
+        perm = next_perm;
     }
 
+    ret = vhost_iotlb_update(dev, start, uaddr, len, perm);
+    if (ret) {
+        goto fail;
+    }
+
+done:
     trace_vhost_iotlb_miss(dev, 2);
 
 out:
     rcu_read_unlock();
 
     return ret;
+
+fail:
+    trace_vhost_iotlb_miss(dev, 4);
+    error_report("Fail to update device iotlb");
+    goto out;
 }
 
 static int vhost_virtqueue_start(struct vhost_dev *dev,
@@ -1320,6 +1470,7 @@ void vhost_dev_cleanup(struct vhost_dev *hdev)
         hdev->vhost_ops->vhost_backend_cleanup(hdev);
     }
     assert(!hdev->log);
+    vhost_iotlb_cache_destroy(hdev);
 
     memset(hdev, 0, sizeof(struct vhost_dev));
 }
@@ -1498,6 +1649,9 @@ int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
     }
 
     if (vhost_dev_has_iommu(hdev)) {
+        if (!hdev->iotlb_cache) {
+            hdev->iotlb_cache = iova_tree_new();
+        }
         memory_listener_register(&hdev->iommu_listener, vdev->dma_as);
     }
 
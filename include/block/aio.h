@@ -51,6 +51,8 @@ struct Coroutine;
 struct ThreadPool;
 struct LinuxAioState;
 
+typedef QLIST_HEAD(, AioHandler) AioHandlerList;
+
 struct AioContext {
     GSource source;
 
@@ -58,7 +60,19 @@ struct AioContext {
     QemuRecMutex lock;
 
     /* The list of registered AIO handlers.  Protected by ctx->list_lock. */
-    QLIST_HEAD(, AioHandler) aio_handlers;
+    AioHandlerList aio_handlers;
+
+    /* The list of AIO handlers that were removed while ctx->aio_handlers
+     * was being walked, and that are freed once the walk is over.
+     * Protected by ctx->list_lock.
+     */
+    AioHandlerList deleted_aio_handlers;
+
+    /* The subset of ctx->aio_handlers that has an io_poll callback, so
+     * that poll mode does not have to walk every handler.  Protected by
+     * ctx->list_lock.
+     */
+    AioHandlerList poll_aio_handlers;
 
     /* Used to avoid unnecessary event_notifier_set calls in aio_notify;
      * accessed with atomic primitives.  If this field is 0, everything
@@ -435,6 +435,9 @@ struct MemoryListener {
     QTAILQ_ENTRY(MemoryListener) link_as;
 };
 
+/* Default total size of the bounce buffers of an #AddressSpace */
+#define DEFAULT_MAX_BOUNCE_BUFFER_SIZE 4096
+
 /**
  * AddressSpace: describes a mapping of addresses to #MemoryRegion objects
  */
@@ -451,6 +454,16 @@ struct AddressSpace {
     struct MemoryRegionIoeventfd *ioeventfds;
     QTAILQ_HEAD(memory_listeners_as, MemoryListener) listeners;
     QTAILQ_ENTRY(AddressSpace) address_spaces_link;
+
+    /* Bounce buffers used by address_space_map() for memory that cannot
+     * be accessed directly.  bounce_buffer_size is the total size of the
+     * buffers in flight; it is only written with bounce_lock held.
+     */
+    QemuMutex bounce_lock;
+    size_t max_bounce_buffer_size;
+    size_t bounce_buffer_size;
+    QLIST_HEAD(, BounceBuffer) bounce_buffers;
+    QLIST_HEAD(, MapClient) map_clients;
 };
 
 typedef struct AddressSpaceDispatch AddressSpaceDispatch;
@@ -1979,8 +1992,8 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len,
  * May map a subset of the requested range, given by and returned in @plen.
  * May return %NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
  *
  * @as: #AddressSpace to be accessed
  * @addr: address within that address space
@@ -2005,6 +2018,39 @@ void *address_space_map(AddressSpace *as, hwaddr addr,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len);
 
+/* address_space_register_map_client: schedule a bottom half once mapping
+ * non-RAM memory of an address space may succeed again
+ *
+ * The bottom half is scheduled right away if the bounce buffers of @as
+ * are not exhausted, otherwise as soon as one of them is unmapped.  The
+ * registration is dropped after the bottom half has been scheduled.
+ *
+ * @as: #AddressSpace passed to the failed address_space_map() call
+ * @bh: bottom half to schedule
+ */
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh);
+
+/* address_space_unregister_map_client: cancel
+ * address_space_register_map_client()
+ *
+ * @as: #AddressSpace passed to address_space_register_map_client()
+ * @bh: bottom half passed to address_space_register_map_client()
+ */
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh);
+
+/* address_space_set_max_bounce_buffer_size: limit the memory used for
+ * bounce buffers
+ *
+ * address_space_map() of memory that cannot be accessed directly copies
+ * the data through a temporary buffer.  Any number of such mappings may be
+ * in flight at the same time, as long as their total size does not exceed
+ * @size.  The default is %DEFAULT_MAX_BOUNCE_BUFFER_SIZE.
+ *
+ * @as: #AddressSpace to be configured
+ * @size: maximum total size of the bounce buffers, in bytes
+ */
+void address_space_set_max_bounce_buffer_size(AddressSpace *as, size_t size);
+
 
 /* Internal functions, part of the implementation of address_space_read.  */
 MemTxResult address_space_read_full(AddressSpace *as, hwaddr addr,
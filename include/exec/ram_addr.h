@@ -49,6 +49,14 @@ struct RAMBlock {
     unsigned long *unsentmap;
     /* bitmap of already received pages in postcopy */
     unsigned long *receivedmap;
+    /* bitmap of the migration sync chunks whose part of the global dirty
+     * log has not been synced into bmap yet
+     */
+    unsigned long *sync_bmap;
+    /* for each such chunk, the dirty log pages already accounted for in
+     * migration_dirty_pages
+     */
+    uint32_t *sync_pending;
 };
 
 static inline bool offset_in_ramblock(RAMBlock *b, ram_addr_t offset)
@@ -405,6 +413,60 @@ static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
     cpu_physical_memory_test_and_clear_dirty(start, length, DIRTY_MEMORY_CODE);
 }
 
+static inline bool cpu_physical_memory_dirty_bitmap_aligned(RAMBlock *rb,
+                                                            ram_addr_t start,
+                                                            ram_addr_t length)
+{
+    unsigned long word = BIT_WORD((start + rb->offset) >> TARGET_PAGE_BITS);
+
+    return ((word * BITS_PER_LONG) << TARGET_PAGE_BITS) ==
+           (start + rb->offset) &&
+           !(length & ((BITS_PER_LONG << TARGET_PAGE_BITS) - 1));
+}
+
+/*
+ * Count the pages of the global migration dirty log that are not dirty
+ * in rb->bmap yet, without touching either bitmap.  Only works on ranges
+ * for which cpu_physical_memory_dirty_bitmap_aligned is true.
+ */
+static inline
+uint64_t cpu_physical_memory_count_dirty_bitmap(RAMBlock *rb,
+                                                ram_addr_t start,
+                                                ram_addr_t length)
+{
+    unsigned long word = BIT_WORD((start + rb->offset) >> TARGET_PAGE_BITS);
+    uint64_t num_dirty = 0;
+    unsigned long *dest = rb->bmap;
+    int k;
+    int nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
+    unsigned long * const *src;
+    unsigned long idx = (word * BITS_PER_LONG) / DIRTY_MEMORY_BLOCK_SIZE;
+    unsigned long offset = BIT_WORD((word * BITS_PER_LONG) %
+                                    DIRTY_MEMORY_BLOCK_SIZE);
+    unsigned long page = BIT_WORD(start >> TARGET_PAGE_BITS);
+
+    rcu_read_lock();
+
+    src = atomic_rcu_read(
+            &ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION])->blocks;
+
+    for (k = page; k < page + nr; k++) {
+        unsigned long bits = atomic_read(&src[idx][offset]);
+
+        if (bits) {
+            num_dirty += ctpopl(bits & ~dest[k]);
+        }
+
+        if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
+            offset = 0;
+            idx++;
+        }
+    }
+
+    rcu_read_unlock();
+
+    return num_dirty;
+}
 
 static inline
 uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
@@ -418,9 +480,7 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
     unsigned long *dest = rb->bmap;
 
     /* start address and length is aligned at the start of a word? */
-    if (((word * BITS_PER_LONG) << TARGET_PAGE_BITS) ==
-         (start + rb->offset) &&
-        !(length & ((BITS_PER_LONG << TARGET_PAGE_BITS) - 1))) {
+    if (cpu_physical_memory_dirty_bitmap_aligned(rb, start, length)) {
         int k;
         int nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
         unsigned long * const *src;
@@ -293,6 +293,8 @@ struct PCIDevice {
     AddressSpace bus_master_as;
     MemoryRegion bus_master_container_region;
     MemoryRegion bus_master_enable_region;
+    /* Total size of the DMA bounce buffers of bus_master_as */
+    uint64_t max_bounce_buffer_size;
 
     /* do not access the following fields */
     PCIConfigReadFunc *config_read;
@@ -5,6 +5,7 @@
 #include "hw/virtio/vhost-backend.h"
 #include "hw/virtio/virtio.h"
 #include "exec/memory.h"
+#include "qemu/iova-tree.h"
 
 /* Generic structures common for any vhost based device. */
 struct vhost_virtqueue {
@@ -80,6 +81,8 @@ struct vhost_dev {
     struct vhost_log *log;
     QLIST_ENTRY(vhost_dev) entry;
     QLIST_HEAD(, vhost_iommu) iommu_list;
+    /* IOVA ranges sent to the backend's IOTLB */
+    IOVATree *iotlb_cache;
     IOMMUNotifier n;
     const VhostDevConfigOps *config_ops;
 };
@@ -47,9 +47,27 @@ typedef struct virtio_net_conf
 /* Maximum packet size we can receive from tap device: header + 64k */
 #define VIRTIO_NET_MAX_BUFSIZE (sizeof(struct virtio_net_hdr) + (64 * KiB))
 
+#define VIRTIO_NET_RSS_MAX_KEY_SIZE     40
+#define VIRTIO_NET_RSS_MAX_TABLE_LEN    128
+
+typedef struct VirtioNetRssData {
+    bool enabled;
+    bool redirect;
+    bool populate_hash;
+    uint32_t hash_types;
+    uint8_t key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
+    uint16_t indirections_len;
+    uint16_t indirections_table[VIRTIO_NET_RSS_MAX_TABLE_LEN];
+    uint16_t default_queue;
+} VirtioNetRssData;
+
+typedef struct VirtioNetRscSeg VirtioNetRscSeg;
+
 typedef struct VirtIONetQueue {
     VirtQueue *rx_vq;
     VirtQueue *tx_vq;
+    QEMUBH *rx_bh;
+    uint32_t rx_pending;
     QEMUTimer *tx_timer;
     QEMUBH *tx_bh;
     uint32_t tx_waiting;
@@ -103,6 +121,15 @@ typedef struct VirtIONet {
     int announce_counter;
     bool needs_vnet_hdr_swap;
     bool mtu_bypass_backend;
+    VirtioNetRssData rss_data;
+    struct NetRxPkt *rx_pkt;
+    bool rsc_enabled;
+    bool rsc4_enabled;
+    bool rsc6_enabled;
+    uint32_t rsc_interval;
+    QEMUTimer *rsc_timer;
+    QTAILQ_HEAD(, VirtioNetRscSeg) rsc_segs;
+    int rsc_nr_segs;
 } VirtIONet;
 
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
@@ -159,7 +159,29 @@ void qemu_co_mutex_init(CoMutex *mutex);
  * Locks the mutex. If the lock cannot be taken immediately, control is
  * transferred to the caller of the current coroutine.
  */
-void coroutine_fn qemu_co_mutex_lock(CoMutex *mutex);
+void coroutine_fn qemu_co_mutex_lock_impl(CoMutex *mutex,
+                                          const char *file, int line);
+
+typedef void (*QemuCoMutexLockFunc)(CoMutex *m, const char *f, int l);
+extern QemuCoMutexLockFunc qemu_co_mutex_lock_func;
+
+/* convenience macro to bypass the profiler */
+#define qemu_co_mutex_lock__raw(m)                      \
+        qemu_co_mutex_lock_impl(m, __FILE__, __LINE__)
+
+#define qemu_co_mutex_lock(m) ({                                        \
+            QemuCoMutexLockFunc _f = atomic_read(&qemu_co_mutex_lock_func); \
+            _f(m, __FILE__, __LINE__);                                  \
+        })
+
+/*
+ * QemuLockable callback.  It bypasses the profiler: the wait to take the
+ * lock again in qemu_co_queue_wait is accounted to the queue's call site.
+ */
+static inline void coroutine_fn qemu_co_mutex_lock_lockable(CoMutex *mutex)
+{
+    qemu_co_mutex_lock__raw(mutex);
+}
 
 /**
  * Unlocks the mutex and schedules the next coroutine that was waiting for this
@@ -188,9 +210,22 @@ void qemu_co_queue_init(CoQueue *queue);
  * caller of the coroutine.  The mutex is unlocked during the wait and
  * locked again afterwards.
  */
-#define qemu_co_queue_wait(queue, lock) \
-    qemu_co_queue_wait_impl(queue, QEMU_MAKE_LOCKABLE(lock))
-void coroutine_fn qemu_co_queue_wait_impl(CoQueue *queue, QemuLockable *lock);
+void coroutine_fn qemu_co_queue_wait_impl(CoQueue *queue, QemuLockable *lock,
+                                          const char *file, int line);
+
+typedef void (*QemuCoQueueWaitFunc)(CoQueue *q, QemuLockable *lock,
+                                    const char *f, int l);
+extern QemuCoQueueWaitFunc qemu_co_queue_wait_func;
+
+/* convenience macro to bypass the profiler */
+#define qemu_co_queue_wait__raw(queue, lock)                            \
+        qemu_co_queue_wait_impl(queue, QEMU_MAKE_LOCKABLE(lock),        \
+                                __FILE__, __LINE__)
+
+#define qemu_co_queue_wait(queue, lock) ({                              \
+            QemuCoQueueWaitFunc _f = atomic_read(&qemu_co_queue_wait_func); \
+            _f(queue, QEMU_MAKE_LOCKABLE(lock), __FILE__, __LINE__);    \
+        })
 
 /**
  * Removes the next coroutine from the CoQueue, and wake it up.
@@ -240,7 +275,7 @@ void qemu_co_rwlock_init(CoRwlock *lock);
  * of a parallel writer, control is transferred to the caller of the current
  * coroutine.
  */
-void qemu_co_rwlock_rdlock(CoRwlock *lock);
+void qemu_co_rwlock_rdlock_impl(CoRwlock *lock, const char *file, int line);
 
 /**
  * Write Locks the CoRwlock from a reader.  This is a bit more efficient than
@@ -250,7 +285,7 @@ void qemu_co_rwlock_rdlock(CoRwlock *lock);
  * only overrides CoRwlock fairness if there are no concurrent readers, so
  * another writer might run while @qemu_co_rwlock_upgrade blocks.
  */
-void qemu_co_rwlock_upgrade(CoRwlock *lock);
+void qemu_co_rwlock_upgrade_impl(CoRwlock *lock, const char *file, int line);
 
 /**
  * Downgrades a write-side critical section to a reader.  Downgrading with
@@ -265,7 +300,30 @@ void qemu_co_rwlock_downgrade(CoRwlock *lock);
  * of a parallel reader, control is transferred to the caller of the current
  * coroutine.
  */
-void qemu_co_rwlock_wrlock(CoRwlock *lock);
+void qemu_co_rwlock_wrlock_impl(CoRwlock *lock, const char *file, int line);
+
+typedef void (*QemuCoRwlockLockFunc)(CoRwlock *lock, const char *f, int l);
+extern QemuCoRwlockLockFunc qemu_co_rwlock_rdlock_func;
+extern QemuCoRwlockLockFunc qemu_co_rwlock_upgrade_func;
+extern QemuCoRwlockLockFunc qemu_co_rwlock_wrlock_func;
+
+#define qemu_co_rwlock_rdlock(l) ({                                     \
+            QemuCoRwlockLockFunc _f;                                    \
+            _f = atomic_read(&qemu_co_rwlock_rdlock_func);              \
+            _f(l, __FILE__, __LINE__);                                  \
+        })
+
+#define qemu_co_rwlock_upgrade(l) ({                                    \
+            QemuCoRwlockLockFunc _f;                                    \
+            _f = atomic_read(&qemu_co_rwlock_upgrade_func);             \
+            _f(l, __FILE__, __LINE__);                                  \
+        })
+
+#define qemu_co_rwlock_wrlock(l) ({                                     \
+            QemuCoRwlockLockFunc _f;                                    \
+            _f = atomic_read(&qemu_co_rwlock_wrlock_func);              \
+            _f(l, __FILE__, __LINE__);                                  \
+        })
 
 /**
  * Unlocks the read/write lock and schedules the next coroutine that was
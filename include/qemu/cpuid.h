@@ -54,4 +54,9 @@
 #define bit_LZCNT       (1 << 5)
 #endif
 
+/* Leaf 0x80000007, %edx */
+#ifndef bit_INVTSC
+#define bit_INVTSC      (1 << 8)
+#endif
+
 #endif /* QEMU_CPUID_H */
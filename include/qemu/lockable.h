@@ -47,11 +47,11 @@ qemu_make_lockable(void *x, QemuLockable *lockable)
 }
 
 /* Auxiliary macros to simplify QEMU_MAKE_LOCABLE.  */
-#define QEMU_LOCK_FUNC(x) ((QemuLockUnlockFunc *)    \
-    QEMU_GENERIC(x,                                  \
-                 (QemuMutex *, qemu_mutex_lock),     \
-                 (CoMutex *, qemu_co_mutex_lock),    \
-                 (QemuSpin *, qemu_spin_lock),       \
+#define QEMU_LOCK_FUNC(x) ((QemuLockUnlockFunc *)          \
+    QEMU_GENERIC(x,                                        \
+                 (QemuMutex *, qemu_mutex_lock),           \
+                 (CoMutex *, qemu_co_mutex_lock_lockable), \
+                 (QemuSpin *, qemu_spin_lock),             \
                  unknown_lock_type))
 
 #define QEMU_UNLOCK_FUNC(x) ((QemuLockUnlockFunc *)  \
@@ -66,8 +66,9 @@ struct QEMUTimer {
     QEMUTimerList *timer_list;
     QEMUTimerCB *cb;
     void *opaque;
-    QEMUTimer *next;
+    int heap_index;             /* position in timer_list's heap */
     int scale;
+    uint64_t heap_seq;          /* orders timers with equal expire_time */
 };
 
 extern QEMUTimerListGroup main_loop_tlg;
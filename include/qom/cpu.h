@@ -28,6 +28,7 @@
 #include "qemu/bitmap.h"
 #include "qemu/rcu_queue.h"
 #include "qemu/queue.h"
+#include "qemu/stats64.h"
 #include "qemu/thread.h"
 
 typedef int (*WriteCoreDumpFunction)(const void *buf, size_t size,
@@ -415,6 +416,10 @@ struct CPUState {
      * autoconverge
      */
     bool throttle_thread_scheduled;
+    /* Per-vcpu throttle percentage, applied on top of the global one */
+    int throttle_percentage;
+    /* Pages this vcpu dirtied through the TCG notdirty slow path */
+    Stat64 dirty_pages;
 
     bool ignore_memory_transaction_failures;
 
@@ -843,6 +848,26 @@ bool cpu_throttle_active(void);
  */
 int cpu_throttle_get_percentage(void);
 
+/**
+ * cpu_throttle_set_vcpu:
+ * @cpu: The vCPU to throttle.
+ * @new_throttle_pct: Percent of sleep time. Valid range is 1 to 99, 0
+ * disables the per-vcpu throttle.
+ *
+ * Like cpu_throttle_set, but only for @cpu.  The vcpu sleeps for the larger
+ * of its own throttle percentage and the global one.  The per-vcpu throttle
+ * is cleared by cpu_throttle_stop.
+ */
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct);
+
+/**
+ * cpu_throttle_get_vcpu_percentage:
+ * @cpu: The vCPU to query.
+ *
+ * Returns: The per-vcpu throttle percentage of @cpu, 0 if not throttled.
+ */
+int cpu_throttle_get_vcpu_percentage(CPUState *cpu);
+
 #ifndef CONFIG_USER_ONLY
 
 typedef void (*CPUInterruptHandler)(CPUState *, int);
@@ -243,6 +243,23 @@ static bool flatrange_equal(FlatRange *a, FlatRange *b)
         && a->readonly == b->readonly;
 }
 
+/* Same as flatrange_equal, but also compare the dirty logging state */
+static bool flatview_equal(FlatView *a, FlatView *b)
+{
+    unsigned i;
+
+    if (a->nr != b->nr) {
+        return false;
+    }
+    for (i = 0; i < a->nr; i++) {
+        if (!flatrange_equal(&a->ranges[i], &b->ranges[i]) ||
+            a->ranges[i].dirty_log_mask != b->ranges[i].dirty_log_mask) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static FlatView *flatview_new(MemoryRegion *mr_root)
 {
     FlatView *view;
@@ -612,6 +629,23 @@ static AddressSpace *memory_region_to_address_space(MemoryRegion *mr)
     return NULL;
 }
 
+/* Return the index of the first range in @view that ends after @addr */
+static unsigned flatview_first_range_after(FlatView *view, Int128 addr)
+{
+    unsigned lo = 0, hi = view->nr;
+
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+
+        if (int128_ge(addr, addrrange_end(view->ranges[mid].addr))) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
 /* Render a memory region into the global view.  Ranges in @view obscure
  * ranges in @mr.
  */
@@ -669,8 +703,11 @@ static void render_memory_region(FlatView *view,
     fr.romd_mode = mr->romd_mode;
     fr.readonly = readonly;
 
-    /* Render the region itself into any gaps left by the current view. */
-    for (i = 0; i < view->nr && int128_nz(remain); ++i) {
+    /* Render the region itself into any gaps left by the current view.
+     * Ranges are sorted and disjoint, so skip those before base at once.
+     */
+    for (i = flatview_first_range_after(view, base);
+         i < view->nr && int128_nz(remain); ++i) {
         if (int128_ge(base, addrrange_end(view->ranges[i].addr))) {
             continue;
         }
@@ -743,11 +780,15 @@ static MemoryRegion *memory_region_get_flatview_root(MemoryRegion *mr)
     return NULL;
 }
 
-/* Render a memory topology into a list of disjoint absolute ranges. */
-static FlatView *generate_memory_topology(MemoryRegion *mr)
+/* Render a memory topology into a list of disjoint absolute ranges.
+ * If @old_views has a FlatView for @mr with the same ranges, reuse it
+ * together with its dispatch tree.
+ */
+static FlatView *generate_memory_topology(MemoryRegion *mr,
+                                          GHashTable *old_views)
 {
     int i;
-    FlatView *view;
+    FlatView *view, *old_view;
 
     view = flatview_new(mr);
 
@@ -757,6 +798,16 @@ static FlatView *generate_memory_topology(MemoryRegion *mr)
     }
     flatview_simplify(view);
 
+    old_view = old_views ? g_hash_table_lookup(old_views, mr) : NULL;
+    if (old_view && flatview_equal(view, old_view)) {
+        /* The new view was never published, no need to wait for RCU.  */
+        flatview_destroy(view);
+        flatview_ref(old_view);
+        trace_flatview_reuse(old_view, mr);
+        g_hash_table_replace(flat_views, mr, old_view);
+        return old_view;
+    }
+
     view->dispatch = address_space_dispatch_new(view);
     for (i = 0; i < view->nr; i++) {
         MemoryRegionSection mrs =
@@ -945,7 +996,7 @@ static void flatviews_init(void)
     flat_views = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
                                        (GDestroyNotify) flatview_unref);
     if (!empty_view) {
-        empty_view = generate_memory_topology(NULL);
+        empty_view = generate_memory_topology(NULL, NULL);
         /* We keep it alive forever in the global variable.  */
         flatview_ref(empty_view);
     } else {
@@ -956,15 +1007,17 @@ static void flatviews_init(void)
 
 static void flatviews_reset(void)
 {
+    GHashTable *old_views = flat_views;
     AddressSpace *as;
 
-    if (flat_views) {
-        g_hash_table_unref(flat_views);
-        flat_views = NULL;
-    }
+    flat_views = NULL;
     flatviews_init();
 
-    /* Render unique FVs */
+    /*
+     * Render unique FVs.  Address spaces whose ranges did not change keep
+     * their FlatView and dispatch tree; any change re-renders the whole
+     * view and rebuilds its dispatch tree from scratch.
+     */
     QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
         MemoryRegion *physmr = memory_region_get_flatview_root(as->root);
 
@@ -972,7 +1025,11 @@ static void flatviews_reset(void)
             continue;
         }
 
-        generate_memory_topology(physmr);
+        generate_memory_topology(physmr, old_views);
+    }
+
+    if (old_views) {
+        g_hash_table_unref(old_views);
     }
 }
 
@@ -985,6 +1042,12 @@ static void address_space_set_flatview(AddressSpace *as)
     assert(new_view);
 
     if (old_view == new_view) {
+        /* Nothing changed, but listeners still expect to hear about
+         * every range between begin and commit.
+         */
+        if (!QTAILQ_EMPTY(&as->listeners)) {
+            address_space_update_topology_pass(as, new_view, new_view, true);
+        }
         return;
     }
 
@@ -1027,7 +1090,7 @@ static void address_space_update_topology(AddressSpace *as)
 
     flatviews_init();
     if (!g_hash_table_lookup(flat_views, physmr)) {
-        generate_memory_topology(physmr);
+        generate_memory_topology(physmr, NULL);
     }
     address_space_set_flatview(as);
 }
@@ -2689,6 +2752,11 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
     as->ioeventfd_nb = 0;
     as->ioeventfds = NULL;
     QTAILQ_INIT(&as->listeners);
+    qemu_mutex_init(&as->bounce_lock);
+    as->max_bounce_buffer_size = DEFAULT_MAX_BOUNCE_BUFFER_SIZE;
+    as->bounce_buffer_size = 0;
+    QLIST_INIT(&as->bounce_buffers);
+    QLIST_INIT(&as->map_clients);
     QTAILQ_INSERT_TAIL(&address_spaces, as, address_spaces_link);
     as->name = g_strdup(name ? name : "anonymous");
     address_space_update_topology(as);
@@ -2698,8 +2766,11 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
 static void do_address_space_destroy(AddressSpace *as)
 {
     assert(QTAILQ_EMPTY(&as->listeners));
+    assert(QLIST_EMPTY(&as->bounce_buffers));
+    assert(QLIST_EMPTY(&as->map_clients));
 
     flatview_unref(as->current_map);
+    qemu_mutex_destroy(&as->bounce_lock);
     g_free(as->name);
     g_free(as->ioeventfds);
     memory_region_unref(as->root);
@@ -0,0 +1,254 @@
+/*
+ * Guest dirty page rate measurement
+ *
+ * Estimates how fast the guest dirties its memory without migrating it or
+ * enabling dirty logging: a random sample of the pages of every migratable
+ * RAM block is hashed at the start and at the end of a measurement window,
+ * and the share of sampled pages that changed is extrapolated to the block.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "cpu.h"
+#include "qemu/crc32c.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-migration.h"
+#include "qapi/qmp/qerror.h"
+#include "exec/ram_addr.h"
+#include "exec/target_page.h"
+#include "trace.h"
+
+#define DIRTYRATE_DEFAULT_SAMPLE_PAGES  512
+#define DIRTYRATE_MAX_SAMPLE_PAGES      10000
+#define DIRTYRATE_MIN_BLOCK_PAGES       16
+#define DIRTYRATE_MAX_CALC_TIME         60
+
+typedef struct RAMBlockDirtySample {
+    char idstr[256];
+    uint64_t used_length;
+    uint64_t nr_pages;
+    uint64_t *offsets;
+    uint32_t *hashes;
+    uint64_t dirty_pages;
+    bool valid;
+} RAMBlockDirtySample;
+
+typedef struct DirtyRateState {
+    int status;
+    int64_t start_time;
+    int64_t calc_time;
+    int64_t sample_pages;
+    RAMBlockDirtySample *samples;
+    int nr_samples;
+    QemuThread thread;
+} DirtyRateState;
+
+static DirtyRateState dirty_rate_state;
+
+static uint32_t dirtyrate_hash_page(RAMBlock *block, uint64_t offset)
+{
+    return crc32c(0xffffffff, block->host + offset, qemu_target_page_size());
+}
+
+static uint64_t dirtyrate_random_page(uint64_t nr_pages)
+{
+    uint64_t r = ((uint64_t)g_random_int() << 32) | g_random_int();
+
+    return r % nr_pages;
+}
+
+/* Called within RCU critical section */
+static void dirtyrate_sample_block(RAMBlockDirtySample *s, RAMBlock *block,
+                                   int64_t sample_pages)
+{
+    size_t page_size = qemu_target_page_size();
+    uint64_t block_pages = block->used_length / page_size;
+    uint64_t i;
+
+    pstrcpy(s->idstr, sizeof(s->idstr), qemu_ram_get_idstr(block));
+    s->used_length = block->used_length;
+    /* sample_pages is per GiB; still sample a few pages of small blocks */
+    s->nr_pages = (block->used_length * sample_pages) >> 30;
+    s->nr_pages = MAX(s->nr_pages, DIRTYRATE_MIN_BLOCK_PAGES);
+    s->nr_pages = MIN(s->nr_pages, block_pages);
+    s->offsets = g_new(uint64_t, s->nr_pages);
+    s->hashes = g_new(uint32_t, s->nr_pages);
+    s->dirty_pages = 0;
+    s->valid = s->nr_pages != 0;
+
+    for (i = 0; i < s->nr_pages; i++) {
+        s->offsets[i] = dirtyrate_random_page(block_pages) * page_size;
+        s->hashes[i] = dirtyrate_hash_page(block, s->offsets[i]);
+    }
+}
+
+static void dirtyrate_record_samples(DirtyRateState *ds)
+{
+    RAMBlock *block;
+    int i = 0;
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH(block) {
+        if (qemu_ram_is_migratable(block)) {
+            ds->nr_samples++;
+        }
+    }
+    ds->samples = g_new0(RAMBlockDirtySample, ds->nr_samples);
+    RAMBLOCK_FOREACH(block) {
+        if (!qemu_ram_is_migratable(block) || i == ds->nr_samples) {
+            continue;
+        }
+        dirtyrate_sample_block(&ds->samples[i++], block, ds->sample_pages);
+    }
+    ds->nr_samples = i;
+    rcu_read_unlock();
+}
+
+static void dirtyrate_compare_samples(DirtyRateState *ds)
+{
+    RAMBlock *block;
+    uint64_t i;
+    int n;
+
+    rcu_read_lock();
+    for (n = 0; n < ds->nr_samples; n++) {
+        RAMBlockDirtySample *s = &ds->samples[n];
+
+        block = qemu_ram_block_by_name(s->idstr);
+        /* unplugged or resized while we were sleeping */
+        if (!block || block->used_length != s->used_length) {
+            s->valid = false;
+            continue;
+        }
+        for (i = 0; i < s->nr_pages; i++) {
+            if (dirtyrate_hash_page(block, s->offsets[i]) != s->hashes[i]) {
+                s->dirty_pages++;
+            }
+        }
+    }
+    rcu_read_unlock();
+}
+
+static void dirtyrate_free_samples(DirtyRateState *ds)
+{
+    int n;
+
+    for (n = 0; n < ds->nr_samples; n++) {
+        g_free(ds->samples[n].offsets);
+        g_free(ds->samples[n].hashes);
+    }
+    g_free(ds->samples);
+    ds->samples = NULL;
+    ds->nr_samples = 0;
+}
+
+/* Estimated dirty rate of a block in MB/s */
+static int64_t dirtyrate_block_rate(RAMBlockDirtySample *s, int64_t calc_time)
+{
+    uint64_t dirty_bytes;
+
+    if (!s->valid) {
+        return 0;
+    }
+    dirty_bytes = s->used_length / s->nr_pages * s->dirty_pages;
+    return dirty_bytes / calc_time >> 20;
+}
+
+static void *dirtyrate_thread(void *opaque)
+{
+    DirtyRateState *ds = opaque;
+
+    rcu_register_thread();
+
+    dirtyrate_record_samples(ds);
+    trace_dirtyrate_start(ds->nr_samples, ds->calc_time);
+
+    g_usleep(ds->calc_time * G_USEC_PER_SEC);
+
+    dirtyrate_compare_samples(ds);
+    atomic_mb_set(&ds->status, DIRTY_RATE_STATUS_MEASURED);
+    trace_dirtyrate_end();
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
+                         int64_t sample_pages, Error **errp)
+{
+    DirtyRateState *ds = &dirty_rate_state;
+
+    if (calc_time < 1 || calc_time > DIRTYRATE_MAX_CALC_TIME) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "calc-time",
+                   "an integer in the range of 1 to 60");
+        return;
+    }
+
+    if (!has_sample_pages) {
+        sample_pages = DIRTYRATE_DEFAULT_SAMPLE_PAGES;
+    } else if (sample_pages < 1 || sample_pages > DIRTYRATE_MAX_SAMPLE_PAGES) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "sample-pages",
+                   "an integer in the range of 1 to 10000");
+        return;
+    }
+
+    if (atomic_mb_read(&ds->status) == DIRTY_RATE_STATUS_MEASURING) {
+        error_setg(errp, "The dirty rate is already being measured");
+        return;
+    }
+
+    /* The previous thread, if any, is done with the samples */
+    if (ds->status == DIRTY_RATE_STATUS_MEASURED) {
+        qemu_thread_join(&ds->thread);
+    }
+    dirtyrate_free_samples(ds);
+
+    ds->start_time = g_get_real_time() / G_USEC_PER_SEC;
+    ds->calc_time = calc_time;
+    ds->sample_pages = sample_pages;
+    atomic_mb_set(&ds->status, DIRTY_RATE_STATUS_MEASURING);
+
+    qemu_thread_create(&ds->thread, "dirtyrate", dirtyrate_thread, ds,
+                       QEMU_THREAD_JOINABLE);
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateState *ds = &dirty_rate_state;
+    DirtyRateInfo *info = g_new0(DirtyRateInfo, 1);
+    RAMBlockDirtyRateList **tail = &info->ramblocks;
+    int64_t total = 0;
+    int n;
+
+    info->status = atomic_mb_read(&ds->status);
+    info->start_time = ds->start_time;
+    info->calc_time = ds->calc_time;
+
+    if (info->status != DIRTY_RATE_STATUS_MEASURED) {
+        return info;
+    }
+
+    for (n = 0; n < ds->nr_samples; n++) {
+        RAMBlockDirtySample *s = &ds->samples[n];
+        RAMBlockDirtyRate *rate = g_new0(RAMBlockDirtyRate, 1);
+
+        rate->id = g_strdup(s->idstr);
+        rate->dirty_rate = dirtyrate_block_rate(s, ds->calc_time);
+        rate->sampled_pages = s->nr_pages;
+        rate->dirty_pages = s->dirty_pages;
+        total += rate->dirty_rate;
+
+        *tail = g_new0(RAMBlockDirtyRateList, 1);
+        (*tail)->value = rate;
+        tail = &(*tail)->next;
+    }
+
+    info->has_dirty_rate = true;
+    info->dirty_rate = total;
+    info->has_ramblocks = true;
+    return info;
+}
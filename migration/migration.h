@@ -255,6 +255,7 @@ bool migrate_zero_blocks(void);
 bool migrate_dirty_bitmaps(void);
 
 bool migrate_auto_converge(void);
+bool migrate_per_vcpu_throttle(void);
 bool migrate_use_multifd(void);
 bool migrate_pause_before_switchover(void);
 int migrate_multifd_channels(void);
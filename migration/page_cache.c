@@ -1,6 +1,7 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is base on a hash of the page address, which selects a set of
+ * a few ways the page may be stored in
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -31,12 +32,25 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/*
+ * The cache is N-way set associative: an address hashes to a set and may
+ * live in any of its ways.  Each item keeps a small saturating hit counter;
+ * on eviction the stale way with the fewest hits is chosen and the others
+ * in the set have their counter decayed, CLOCK style, so that pages which
+ * are hit once and never again don't stay resident forever.
+ */
+#define CACHE_WAYS 4
+#define CACHE_MAX_HITS 3
+
 typedef struct CacheItem CacheItem;
 
+/* 32 bytes, so that two items share a cache line and a set spans two */
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
     uint8_t *it_data;
+    uint32_t it_hits;
+    uint32_t it_pad;
 };
 
 struct PageCache {
@@ -44,6 +58,8 @@ struct PageCache {
     size_t page_size;
     size_t max_num_items;
     size_t num_items;
+    size_t num_ways;
+    size_t num_sets;
 };
 
 PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
@@ -66,7 +82,7 @@ PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
     }
 
     /* We prefer not to abort if there is no memory */
-    cache = g_try_malloc(sizeof(*cache));
+    cache = g_try_malloc0(sizeof(*cache));
     if (!cache) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "cache size",
                    "Failed to allocate cache");
@@ -75,12 +91,15 @@ PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
     cache->page_size = page_size;
     cache->num_items = 0;
     cache->max_num_items = num_pages;
+    cache->num_ways = MIN(num_pages, CACHE_WAYS);
+    cache->num_sets = num_pages / cache->num_ways;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %zu (%zu sets of %zu ways)\n",
+            cache->max_num_items, cache->num_sets, cache->num_ways);
 
     /* We prefer not to abort if there is no memory */
-    cache->page_cache = g_try_malloc((cache->max_num_items) *
-                                     sizeof(*cache->page_cache));
+    cache->page_cache = qemu_try_memalign(64, (cache->max_num_items) *
+                                          sizeof(*cache->page_cache));
     if (!cache->page_cache) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "cache size",
                    "Failed to allocate page cache");
@@ -92,6 +111,7 @@ PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
         cache->page_cache[i].it_addr = -1;
+        cache->page_cache[i].it_hits = 0;
     }
 
     return cache;
@@ -108,33 +128,41 @@ void cache_fini(PageCache *cache)
         g_free(cache->page_cache[i].it_data);
     }
 
-    g_free(cache->page_cache);
+    qemu_vfree(cache->page_cache);
     cache->page_cache = NULL;
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
-    g_assert(cache->max_num_items);
-    return (address / cache->page_size) & (cache->max_num_items - 1);
-}
-
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
-{
-    size_t pos;
+    size_t set;
 
     g_assert(cache);
     g_assert(cache->page_cache);
+    g_assert(cache->num_sets);
+
+    set = (address / cache->page_size) & (cache->num_sets - 1);
+    return &cache->page_cache[set * cache->num_ways];
+}
 
-    pos = cache_get_cache_pos(cache, addr);
+static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+{
+    CacheItem *set = cache_get_set(cache, addr);
+    size_t i;
 
-    return &cache->page_cache[pos];
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
 bool cache_is_cached(const PageCache *cache, uint64_t addr,
@@ -144,14 +172,61 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
 
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_addr == addr) {
+    if (it) {
         /* update the it_age when the cache hit */
         it->it_age = current_age;
+        if (it->it_hits < CACHE_MAX_HITS) {
+            it->it_hits++;
+        }
         return true;
     }
     return false;
 }
 
+/*
+ * Pick the way to (re)use for @addr: the way already holding it, an empty
+ * way, or the least frequently hit way that has outlived
+ * CACHED_PAGE_LIFETIME.  Returns NULL if every way is still fresh.
+ */
+static CacheItem *cache_get_victim(PageCache *cache, uint64_t addr,
+                                   uint64_t current_age)
+{
+    CacheItem *set = cache_get_set(cache, addr);
+    CacheItem *victim = NULL;
+    size_t i;
+
+    for (i = 0; i < cache->num_ways; i++) {
+        CacheItem *it = &set[i];
+
+        if (it->it_addr == addr || !it->it_data) {
+            return it;
+        }
+    }
+
+    for (i = 0; i < cache->num_ways; i++) {
+        CacheItem *it = &set[i];
+
+        if (it->it_age + CACHED_PAGE_LIFETIME > current_age) {
+            /* the cache page is fresh, don't replace it */
+            continue;
+        }
+        if (!victim || it->it_hits < victim->it_hits ||
+            (it->it_hits == victim->it_hits && it->it_age < victim->it_age)) {
+            victim = it;
+        }
+    }
+
+    if (victim) {
+        /* give the survivors one less chance next time around */
+        for (i = 0; i < cache->num_ways; i++) {
+            if (&set[i] != victim && set[i].it_hits) {
+                set[i].it_hits--;
+            }
+        }
+    }
+    return victim;
+}
+
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age)
 {
@@ -159,13 +234,11 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
     CacheItem *it;
 
     /* actual update of entry */
-    it = cache_get_by_addr(cache, addr);
-
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
+    it = cache_get_victim(cache, addr, current_age);
+    if (!it) {
         return -1;
     }
+
     /* allocate page */
     if (!it->it_data) {
         it->it_data = g_try_malloc(cache->page_size);
@@ -178,6 +251,9 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
 
     memcpy(it->it_data, pdata, cache->page_size);
 
+    if (it->it_addr != addr) {
+        it->it_hits = 0;
+    }
     it->it_age = current_age;
     it->it_addr = addr;
 
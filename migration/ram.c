@@ -301,6 +301,15 @@ struct RAMState {
     uint64_t num_dirty_pages_period;
     /* xbzrle misses since the beginning of the period */
     uint64_t xbzrle_cache_miss_prev;
+    /* xbzrle hits since the beginning of the period */
+    uint64_t xbzrle_cache_hit_prev;
+    /* per-vcpu dirty page counts at the beginning of the period,
+     * indexed by cpu_index */
+    uint64_t *vcpu_dirty_pages_prev;
+    /* pages dirtied by each vcpu during the last period */
+    uint64_t *vcpu_dirty_pages_period;
+    /* per-vcpu pages dirtied per second during the last period */
+    uint64_t *vcpu_dirty_pages_rate;
 
     /* compression statistics since the beginning of the period */
     /* amount of count that no free thread to compress data */
@@ -334,6 +343,35 @@ uint64_t ram_bytes_remaining(void)
                        0;
 }
 
+void ram_fill_vcpu_dirty_info(MigrationInfo *info)
+{
+    uint64List *rates = NULL, **rate = &rates;
+    uint32List *pcts = NULL, **pct = &pcts;
+    CPUState *cpu;
+
+    if (!ram_state) {
+        return;
+    }
+
+    CPU_FOREACH(cpu) {
+        if (cpu->cpu_index >= max_cpus) {
+            continue;
+        }
+        *rate = g_new0(uint64List, 1);
+        (*rate)->value = ram_state->vcpu_dirty_pages_rate[cpu->cpu_index];
+        rate = &(*rate)->next;
+
+        *pct = g_new0(uint32List, 1);
+        (*pct)->value = cpu_throttle_get_vcpu_percentage(cpu);
+        pct = &(*pct)->next;
+    }
+
+    info->has_vcpu_dirty_pages_rate = true;
+    info->vcpu_dirty_pages_rate = rates;
+    info->has_vcpu_throttle_percentage = true;
+    info->vcpu_throttle_percentage = pcts;
+}
+
 MigrationStats ram_counters;
 
 /* used by the search for pages to send */
@@ -1413,6 +1451,99 @@ static void mig_throttle_guest_down(void)
     }
 }
 
+/**
+ * mig_throttle_vcpus_down: throttle down the vcpus that dirty the most
+ *
+ * Returns false if there is no per-vcpu dirty information to base the
+ * decision on, in which case the caller should throttle the whole guest.
+ *
+ * The memory the guest may dirty in a period and still converge, half of
+ * what was transferred, is split evenly between the vcpus; only the vcpus
+ * that dirtied more than their share are throttled, or throttled further.
+ *
+ * @rs: current RAM state
+ * @bytes_xfer_period: bytes transferred during the last period
+ */
+static bool mig_throttle_vcpus_down(RAMState *rs, uint64_t bytes_xfer_period)
+{
+    MigrationState *s = migrate_get_current();
+    uint64_t pct_initial = s->parameters.cpu_throttle_initial;
+    uint64_t pct_icrement = s->parameters.cpu_throttle_increment;
+    int pct_max = s->parameters.max_cpu_throttle;
+    uint64_t total = 0, share;
+    int nr_vcpus = 0;
+    CPUState *cpu;
+
+    if (!tcg_enabled()) {
+        return false;
+    }
+
+    CPU_FOREACH(cpu) {
+        if (cpu->cpu_index < max_cpus) {
+            total += rs->vcpu_dirty_pages_period[cpu->cpu_index];
+        }
+        nr_vcpus++;
+    }
+
+    /* dirtied through DMA or not accounted at all */
+    if (!total || !nr_vcpus) {
+        return false;
+    }
+
+    share = bytes_xfer_period / 2 / TARGET_PAGE_SIZE / nr_vcpus;
+
+    CPU_FOREACH(cpu) {
+        uint64_t dirty;
+        int pct;
+
+        if (cpu->cpu_index >= max_cpus) {
+            continue;
+        }
+        dirty = rs->vcpu_dirty_pages_period[cpu->cpu_index];
+        if (dirty <= share) {
+            continue;
+        }
+
+        pct = cpu_throttle_get_vcpu_percentage(cpu);
+        if (!pct) {
+            pct = pct_initial;
+        } else {
+            pct = MIN(pct + pct_icrement, pct_max);
+        }
+        trace_migration_throttle_vcpu(cpu->cpu_index, dirty, share, pct);
+        cpu_throttle_set_vcpu(cpu, pct);
+    }
+
+    return true;
+}
+
+/**
+ * migration_update_vcpu_dirty_rates: sample the per-vcpu dirty counters
+ *
+ * @rs: current RAM state
+ * @end_time: end of the period, in ms
+ */
+static void migration_update_vcpu_dirty_rates(RAMState *rs, int64_t end_time)
+{
+    int64_t period = end_time - rs->time_last_bitmap_sync;
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        int idx = cpu->cpu_index;
+        uint64_t dirty_pages;
+
+        if (idx >= max_cpus) {
+            continue;
+        }
+        dirty_pages = stat64_get(&cpu->dirty_pages);
+        rs->vcpu_dirty_pages_period[idx] = dirty_pages -
+                                           rs->vcpu_dirty_pages_prev[idx];
+        rs->vcpu_dirty_pages_rate[idx] = rs->vcpu_dirty_pages_period[idx] *
+                                         1000 / period;
+        rs->vcpu_dirty_pages_prev[idx] = dirty_pages;
+    }
+}
+
 /**
  * xbzrle_cache_zero_page: insert a zero page in the XBZRLE cache
  *
@@ -1476,6 +1607,7 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
         return -1;
     }
 
+    xbzrle_counters.cache_hit++;
     prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
 
     /* save current buffer into memory */
@@ -1518,6 +1650,62 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
     return 1;
 }
 
+/*
+ * During the iterative phase, the periodic sync only marks every chunk of
+ * 1 << RAM_SYNC_CHUNK_SHIFT target pages as pending and counts, outside
+ * the iothread lock, the dirty pages it holds.  Each chunk is then synced
+ * into the migration bitmap from the send loop, just before the first page
+ * of the chunk is sent, so the BQL is not held for a walk of the whole
+ * dirty log and pages dirtied again in the meantime are sent only once.
+ */
+#define RAM_SYNC_CHUNK_SHIFT 18
+
+static ram_addr_t ram_sync_chunk_start(unsigned long chunk)
+{
+    return (ram_addr_t)chunk << (RAM_SYNC_CHUNK_SHIFT + TARGET_PAGE_BITS);
+}
+
+static ram_addr_t ram_sync_chunk_length(RAMBlock *rb, unsigned long chunk)
+{
+    return MIN((ram_addr_t)1 << (RAM_SYNC_CHUNK_SHIFT + TARGET_PAGE_BITS),
+               rb->used_length - ram_sync_chunk_start(chunk));
+}
+
+/**
+ * migration_bitmap_sync_chunk: sync a pending chunk of the dirty log
+ *
+ * Returns true if the chunk was still pending, in which case pages
+ * dirtied since the last sync may have been added to the migration bitmap.
+ *
+ * @rs: current RAM state
+ * @rb: RAMBlock the chunk belongs to
+ * @chunk: index of the chunk within @rb
+ */
+static bool migration_bitmap_sync_chunk(RAMState *rs, RAMBlock *rb,
+                                        unsigned long chunk)
+{
+    uint64_t new_dirty_pages;
+
+    if (!rb->sync_bmap || !test_bit(chunk, rb->sync_bmap)) {
+        return false;
+    }
+
+    qemu_mutex_lock(&rs->bitmap_mutex);
+    clear_bit(chunk, rb->sync_bmap);
+    new_dirty_pages =
+        cpu_physical_memory_sync_dirty_bitmap(rb, ram_sync_chunk_start(chunk),
+                                              ram_sync_chunk_length(rb, chunk),
+                                              &rs->num_dirty_pages_period);
+    /* part of them have been accounted for when the chunk was counted */
+    rs->migration_dirty_pages += new_dirty_pages;
+    rs->migration_dirty_pages -= rb->sync_pending[chunk];
+    rb->sync_pending[chunk] = 0;
+    qemu_mutex_unlock(&rs->bitmap_mutex);
+
+    trace_migration_bitmap_sync_chunk(rb->idstr, chunk, new_dirty_pages);
+    return true;
+}
+
 /**
  * migration_bitmap_find_dirty: find the next dirty page from start
  *
@@ -1534,8 +1722,9 @@ unsigned long migration_bitmap_find_dirty(RAMState *rs, RAMBlock *rb,
                                           unsigned long start)
 {
     unsigned long size = rb->used_length >> TARGET_PAGE_BITS;
+    unsigned long nr_chunks = DIV_ROUND_UP(size, 1UL << RAM_SYNC_CHUNK_SHIFT);
     unsigned long *bitmap = rb->bmap;
-    unsigned long next;
+    unsigned long next, chunk;
 
     if (!qemu_ram_is_migratable(rb)) {
         return size;
@@ -1543,8 +1732,24 @@ unsigned long migration_bitmap_find_dirty(RAMState *rs, RAMBlock *rb,
 
     if (rs->ram_bulk_stage && start > 0) {
         next = start + 1;
+        if (next < size) {
+            migration_bitmap_sync_chunk(rs, rb, next >> RAM_SYNC_CHUNK_SHIFT);
+        }
     } else {
-        next = find_next_bit(bitmap, size, start);
+        for (;;) {
+            next = find_next_bit(bitmap, size, start);
+            if (!rb->sync_bmap) {
+                break;
+            }
+            /* a pending chunk up to next may hold dirty pages before it */
+            chunk = find_next_bit(rb->sync_bmap, nr_chunks,
+                                  start >> RAM_SYNC_CHUNK_SHIFT);
+            if (chunk >= nr_chunks ||
+                chunk > (next >> RAM_SYNC_CHUNK_SHIFT)) {
+                break;
+            }
+            migration_bitmap_sync_chunk(rs, rb, chunk);
+        }
     }
 
     return next;
@@ -1572,6 +1777,75 @@ static void migration_bitmap_sync_range(RAMState *rs, RAMBlock *rb,
                                               &rs->num_dirty_pages_period);
 }
 
+/*
+ * Drop the pending chunks of @rb, before its whole dirty log is synced.
+ * Called with bitmap_mutex held.
+ */
+static void migration_bitmap_drop_pending(RAMState *rs, RAMBlock *rb)
+{
+    unsigned long nr_chunks = DIV_ROUND_UP(rb->max_length >> TARGET_PAGE_BITS,
+                                           1UL << RAM_SYNC_CHUNK_SHIFT);
+    unsigned long chunk;
+
+    for (chunk = find_first_bit(rb->sync_bmap, nr_chunks); chunk < nr_chunks;
+         chunk = find_next_bit(rb->sync_bmap, nr_chunks, chunk + 1)) {
+        rs->migration_dirty_pages -= rb->sync_pending[chunk];
+        rb->sync_pending[chunk] = 0;
+    }
+    bitmap_zero(rb->sync_bmap, nr_chunks);
+}
+
+/*
+ * Account for the dirty pages held by the pending chunks, so that the
+ * convergence decision is based on the whole dirty log.  Runs without
+ * the iothread lock; bitmap_mutex is only held for one chunk at a time.
+ */
+static void migration_bitmap_count_pending(RAMState *rs)
+{
+    RAMBlock *rb;
+    unsigned long chunk;
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH_MIGRATABLE(rb) {
+        unsigned long pages = rb->used_length >> TARGET_PAGE_BITS;
+        unsigned long nr_chunks = DIV_ROUND_UP(pages,
+                                               1UL << RAM_SYNC_CHUNK_SHIFT);
+
+        if (!rb->sync_bmap) {
+            continue;
+        }
+        for (chunk = 0; chunk < nr_chunks; chunk++) {
+            ram_addr_t start = ram_sync_chunk_start(chunk);
+            ram_addr_t length = ram_sync_chunk_length(rb, chunk);
+            uint64_t dirty_pages;
+
+            qemu_mutex_lock(&rs->bitmap_mutex);
+            if (!test_bit(chunk, rb->sync_bmap)) {
+                /* already synced by the send loop */
+            } else if (!cpu_physical_memory_dirty_bitmap_aligned(rb, start,
+                                                                 length)) {
+                /* can't be counted word by word, sync it right away */
+                qemu_mutex_unlock(&rs->bitmap_mutex);
+                migration_bitmap_sync_chunk(rs, rb, chunk);
+                continue;
+            } else {
+                /*
+                 * The log only grows until the chunk is synced, and its
+                 * part of bmap does not change before then either.
+                 */
+                dirty_pages = cpu_physical_memory_count_dirty_bitmap(rb, start,
+                                                                     length);
+                rs->migration_dirty_pages += dirty_pages -
+                                             rb->sync_pending[chunk];
+                rb->sync_pending[chunk] = dirty_pages;
+            }
+            qemu_mutex_unlock(&rs->bitmap_mutex);
+        }
+    }
+    ram_counters.remaining = ram_bytes_remaining();
+    rcu_read_unlock();
+}
+
 /**
  * ram_pagesize_summary: calculate all the pagesizes of a VM
  *
@@ -1607,9 +1881,16 @@ static void migration_update_rates(RAMState *rs, int64_t end_time)
     }
 
     if (migrate_use_xbzrle()) {
-        xbzrle_counters.cache_miss_rate = (double)(xbzrle_counters.cache_miss -
-            rs->xbzrle_cache_miss_prev) / page_count;
+        uint64_t misses = xbzrle_counters.cache_miss -
+                          rs->xbzrle_cache_miss_prev;
+        uint64_t hits = xbzrle_counters.cache_hit - rs->xbzrle_cache_hit_prev;
+
+        xbzrle_counters.cache_miss_rate = (double)misses / page_count;
         rs->xbzrle_cache_miss_prev = xbzrle_counters.cache_miss;
+        if (hits + misses) {
+            xbzrle_counters.cache_hit_rate = (double)hits / (hits + misses);
+        }
+        rs->xbzrle_cache_hit_prev = xbzrle_counters.cache_hit;
     }
 
     if (migrate_use_compression()) {
@@ -1633,7 +1914,15 @@ static void migration_update_rates(RAMState *rs, int64_t end_time)
     }
 }
 
-static void migration_bitmap_sync(RAMState *rs)
+/**
+ * migration_bitmap_do_sync: sync the dirty log into the migration bitmap
+ *
+ * @rs: current RAM state
+ * @defer: only mark the chunks as pending, and leave it to the send loop
+ *         to sync them; see RAM_SYNC_CHUNK_SHIFT.  The caller must then
+ *         call migration_bitmap_count_pending without the iothread lock.
+ */
+static void migration_bitmap_do_sync(RAMState *rs, bool defer)
 {
     RAMBlock *block;
     int64_t end_time;
@@ -1651,6 +1940,15 @@ static void migration_bitmap_sync(RAMState *rs)
     qemu_mutex_lock(&rs->bitmap_mutex);
     rcu_read_lock();
     RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        if (defer && block->sync_bmap) {
+            bitmap_set(block->sync_bmap, 0,
+                       DIV_ROUND_UP(block->used_length >> TARGET_PAGE_BITS,
+                                    1UL << RAM_SYNC_CHUNK_SHIFT));
+            continue;
+        }
+        if (block->sync_bmap) {
+            migration_bitmap_drop_pending(rs, block);
+        }
         migration_bitmap_sync_range(rs, block, 0, block->used_length);
     }
     ram_counters.remaining = ram_bytes_remaining();
@@ -1665,6 +1963,10 @@ static void migration_bitmap_sync(RAMState *rs)
     if (end_time > rs->time_last_bitmap_sync + 1000) {
         bytes_xfer_now = ram_counters.transferred;
 
+        if (migrate_per_vcpu_throttle()) {
+            migration_update_vcpu_dirty_rates(rs, end_time);
+        }
+
         /* During block migration the auto-converge logic incorrectly detects
          * that ram migration makes no progress. Avoid this by disabling the
          * throttling logic during the bulk phase of block migration. */
@@ -1680,7 +1982,11 @@ static void migration_bitmap_sync(RAMState *rs)
                 (++rs->dirty_rate_high_cnt >= 2)) {
                     trace_migration_throttle();
                     rs->dirty_rate_high_cnt = 0;
-                    mig_throttle_guest_down();
+                    if (!migrate_per_vcpu_throttle() ||
+                        !mig_throttle_vcpus_down(rs, bytes_xfer_now -
+                                                     rs->bytes_xfer_prev)) {
+                        mig_throttle_guest_down();
+                    }
             }
         }
 
@@ -1698,6 +2004,11 @@ static void migration_bitmap_sync(RAMState *rs)
     }
 }
 
+static void migration_bitmap_sync(RAMState *rs)
+{
+    migration_bitmap_do_sync(rs, false);
+}
+
 /**
  * save_zero_page_to_file: send the zero page to the file
  *
@@ -2124,6 +2435,8 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
             unsigned long page;
 
             page = offset >> TARGET_PAGE_BITS;
+            migration_bitmap_sync_chunk(rs, block,
+                                        page >> RAM_SYNC_CHUNK_SHIFT);
             dirty = test_bit(page, block->bmap);
             if (!dirty) {
                 trace_get_queued_page_not_dirty(block->idstr, (uint64_t)offset,
@@ -2502,6 +2815,9 @@ static void ram_state_cleanup(RAMState **rsp)
         migration_page_queue_free(*rsp);
         qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
         qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
+        g_free((*rsp)->vcpu_dirty_pages_prev);
+        g_free((*rsp)->vcpu_dirty_pages_period);
+        g_free((*rsp)->vcpu_dirty_pages_rate);
         g_free(*rsp);
         *rsp = NULL;
     }
@@ -2538,6 +2854,10 @@ static void ram_save_cleanup(void *opaque)
         block->bmap = NULL;
         g_free(block->unsentmap);
         block->unsentmap = NULL;
+        g_free(block->sync_bmap);
+        block->sync_bmap = NULL;
+        g_free(block->sync_pending);
+        block->sync_pending = NULL;
     }
 
     xbzrle_cleanup();
@@ -3019,6 +3339,8 @@ err_out:
 
 static int ram_state_init(RAMState **rsp)
 {
+    CPUState *cpu;
+
     *rsp = g_try_new0(RAMState, 1);
 
     if (!*rsp) {
@@ -3036,6 +3358,16 @@ static int ram_state_init(RAMState **rsp)
      */
     (*rsp)->migration_dirty_pages = ram_bytes_total() >> TARGET_PAGE_BITS;
 
+    (*rsp)->vcpu_dirty_pages_prev = g_new0(uint64_t, max_cpus);
+    (*rsp)->vcpu_dirty_pages_period = g_new0(uint64_t, max_cpus);
+    (*rsp)->vcpu_dirty_pages_rate = g_new0(uint64_t, max_cpus);
+    CPU_FOREACH(cpu) {
+        if (cpu->cpu_index < max_cpus) {
+            (*rsp)->vcpu_dirty_pages_prev[cpu->cpu_index] =
+                stat64_get(&cpu->dirty_pages);
+        }
+    }
+
     ram_state_reset(*rsp);
 
     return 0;
@@ -3052,6 +3384,11 @@ static void ram_list_init_bitmaps(void)
             pages = block->max_length >> TARGET_PAGE_BITS;
             block->bmap = bitmap_new(pages);
             bitmap_set(block->bmap, 0, pages);
+            block->sync_bmap = bitmap_new(DIV_ROUND_UP(pages,
+                                          1UL << RAM_SYNC_CHUNK_SHIFT));
+            block->sync_pending = g_new0(uint32_t,
+                                         DIV_ROUND_UP(pages,
+                                                 1UL << RAM_SYNC_CHUNK_SHIFT));
             if (migrate_postcopy_ram()) {
                 block->unsentmap = bitmap_new(pages);
                 bitmap_set(block->unsentmap, 0, pages);
@@ -3347,9 +3684,10 @@ static void ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
         remaining_size < max_size) {
         qemu_mutex_lock_iothread();
         rcu_read_lock();
-        migration_bitmap_sync(rs);
+        migration_bitmap_do_sync(rs, true);
         rcu_read_unlock();
         qemu_mutex_unlock_iothread();
+        migration_bitmap_count_pending(rs);
         remaining_size = rs->migration_dirty_pages * TARGET_PAGE_SIZE;
     }
 
@@ -41,6 +41,7 @@ extern CompressionStats compression_counters;
 int xbzrle_cache_resize(int64_t new_size, Error **errp);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_total(void);
+void ram_fill_vcpu_dirty_info(MigrationInfo *info);
 
 int multifd_save_setup(void);
 int multifd_save_cleanup(Error **errp);
@@ -103,13 +103,9 @@ static int compare_chr_send(CompareState *s,
                             uint32_t size,
                             uint32_t vnet_hdr_len);
 
-static gint seq_sorter(Packet *a, Packet *b, gpointer data)
+static inline bool after(uint32_t seq1, uint32_t seq2)
 {
-    struct tcphdr *atcp, *btcp;
-
-    atcp = (struct tcphdr *)(a->transport_header);
-    btcp = (struct tcphdr *)(b->transport_header);
-    return ntohl(atcp->th_seq) - ntohl(btcp->th_seq);
+    return (int32_t)(seq1 - seq2) > 0;
 }
 
 static void fill_pkt_tcp_info(void *data, uint32_t *max_ack)
@@ -129,6 +125,28 @@ static void fill_pkt_tcp_info(void *data, uint32_t *max_ack)
     pkt->flags = tcphd->th_flags;
 }
 
+/*
+ * Keep the queue sorted by sequence number.  Segments almost always
+ * arrive in order, so look for the insertion point starting from the
+ * tail: that makes the common case O(1) instead of a walk of the whole
+ * queue.  Packets with the same sequence number, such as a run of pure
+ * ACKs, keep their arrival order and are appended in O(1) as well.
+ */
+static void colo_insert_tcp_packet(GQueue *queue, Packet *pkt)
+{
+    GList *link = queue->tail;
+
+    while (link && after(((Packet *)link->data)->tcp_seq, pkt->tcp_seq)) {
+        link = link->prev;
+    }
+
+    if (link) {
+        g_queue_insert_after(queue, link, pkt);
+    } else {
+        g_queue_push_head(queue, pkt);
+    }
+}
+
 /*
  * Return 1 on success, if return 0 means the
  * packet will be dropped
@@ -138,10 +156,7 @@ static int colo_insert_packet(GQueue *queue, Packet *pkt, uint32_t *max_ack)
     if (g_queue_get_length(queue) <= MAX_QUEUE_SIZE) {
         if (pkt->ip->ip_p == IPPROTO_TCP) {
             fill_pkt_tcp_info(pkt, max_ack);
-            g_queue_insert_sorted(queue,
-                                  pkt,
-                                  (GCompareDataFunc)seq_sorter,
-                                  NULL);
+            colo_insert_tcp_packet(queue, pkt);
         } else {
             g_queue_push_tail(queue, pkt);
         }
@@ -202,11 +217,6 @@ static int packet_enqueue(CompareState *s, int mode, Connection **con)
     return 0;
 }
 
-static inline bool after(uint32_t seq1, uint32_t seq2)
-{
-        return (int32_t)(seq1 - seq2) > 0;
-}
-
 static void colo_release_primary_pkt(CompareState *s, Packet *pkt)
 {
     int ret;
@@ -261,14 +271,6 @@ static bool colo_mark_tcp_pkt(Packet *ppkt, Packet *spkt,
 {
     *mark = 0;
 
-    if (ppkt->tcp_seq == spkt->tcp_seq && ppkt->seq_end == spkt->seq_end) {
-        if (colo_compare_packet_payload(ppkt, spkt,
-                                        ppkt->header_size, spkt->header_size,
-                                        ppkt->payload_size)) {
-            *mark = COLO_COMPARE_FREE_SECONDARY | COLO_COMPARE_FREE_PRIMARY;
-            return true;
-        }
-    }
     if (ppkt->tcp_seq == spkt->tcp_seq && ppkt->seq_end == spkt->seq_end) {
         if (colo_compare_packet_payload(ppkt, spkt,
                                         ppkt->header_size, spkt->header_size,
@@ -180,6 +180,12 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
     tap_read_poll(s, true);
 }
 
+/*
+ * The tap character device returns one frame per read() and, unlike a
+ * socket, has no recvmmsg(), so a batch is this loop of reads.  Peers
+ * such as virtio-net defer their used ring update and guest notification
+ * to a bottom half, so the frames read here share one notification.
+ */
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
@@ -1910,6 +1910,18 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
 #endif
+#ifdef CONFIG_AF_XDP
+    "-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off]\n"
+    "         [,queues=n][,start-queue=m][,busy-poll-budget=b]\n"
+    "                attach to the existing network interface 'name' with AF_XDP socket\n"
+    "                use 'mode=MODE' to specify an XDP program attach mode\n"
+    "                use 'force-copy=on|off' to force XDP copy mode even if device\n"
+    "                supports zero-copy (default: off)\n"
+    "                use 'queues=n' to specify how many queues of a multiqueue interface\n"
+    "                should be used, starting from 'start-queue=m' (default: 1 and 0)\n"
+    "                use 'busy-poll-budget=b' to busy poll the host queues, handling\n"
+    "                up to b frames per poll (default: 0, disabled)\n"
+#endif
 #ifdef CONFIG_POSIX
     "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
     "                configure a vhost-user network, backed by a chardev 'dev'\n"
@@ -1930,6 +1942,9 @@ DEF("nic", HAS_ARG, QEMU_OPTION_nic,
 #ifdef CONFIG_NETMAP
     "netmap|"
 #endif
+#ifdef CONFIG_AF_XDP
+    "af-xdp|"
+#endif
 #ifdef CONFIG_POSIX
     "vhost-user|"
 #endif
@@ -2348,6 +2363,28 @@ vde_switch -F -sock /tmp/myswitch
 qemu-system-i386 linux.img -nic vde,sock=/tmp/myswitch
 @end example
 
+@item -netdev af-xdp,id=@var{id},ifname=@var{name}[,mode=native|skb][,force-copy=on|off][,queues=@var{n}][,start-queue=@var{m}][,busy-poll-budget=@var{b}]
+Configure an AF_XDP backend that exchanges frames with queues @var{m} to
+@var{m}+@var{n}-1 of the host network interface @var{name}, which may be a
+physical NIC or one end of a veth pair.  Frames bypass the host network stack.
+If @option{mode} is not given, the native (driver) XDP mode is tried first and
+the generic skb mode is used as a fallback.  The interface must be configured
+so that the selected queues only receive traffic meant for the guest, for
+example with @code{ethtool -L} and flow steering rules.  With
+@option{busy-poll-budget} set to a non-zero value, each read from a socket
+busy polls the host queue for up to @var{b} frames instead of waiting for its
+interrupt; this works best together with the @code{napi_defer_hard_irqs} and
+@code{gro_flush_timeout} settings of the interface.  This option is only
+available if QEMU has been compiled with AF_XDP support enabled.
+
+Example:
+@example
+# use two queues of eth0, combined with a two-queue virtio-net device
+qemu-system-x86_64 linux.img \
+        -netdev af-xdp,id=n0,ifname=eth0,queues=2 \
+        -device virtio-net-pci,netdev=n0,mq=on,vectors=6
+@end example
+
 @item -netdev vhost-user,chardev=@var{id}[,vhostforce=on|off][,queues=n]
 
 Establish a vhost-user netdev, backed by a chardev @var{id}. The chardev should
@@ -3825,12 +3862,13 @@ ETEXI
 
 DEF("trace", HAS_ARG, QEMU_OPTION_trace,
     "-trace [[enable=]<pattern>][,events=<file>][,file=<file>]\n"
+    "       [,flight-recorder=on|off]\n"
     "                specify tracing options\n",
     QEMU_ARCH_ALL)
 STEXI
 HXCOMM This line is not accurate, as some sub-options are backend-specific but
 HXCOMM HX does not support conditional compilation of text.
-@item -trace [[enable=]@var{pattern}][,events=@var{file}][,file=@var{file}]
+@item -trace [[enable=]@var{pattern}][,events=@var{file}][,file=@var{file}][,flight-recorder=on|off]
 @findex -trace
 @include qemu-option-trace.texi
 ETEXI
@@ -69,9 +69,27 @@ def get_jmpbuf_regs(jmpbuf):
         'r15': jmpbuf[JB_R15],
         'rip': glibc_ptr_demangle(jmpbuf[JB_PC], pointer_guard) }
 
-def bt_jmpbuf(jmpbuf):
-    '''Backtrace a jmpbuf'''
-    regs = get_jmpbuf_regs(jmpbuf)
+def get_asm_regs(sp):
+    '''Fetch the registers saved by the asm coroutine backend'''
+    frame = sp.cast(gdb.lookup_type('uint64_t').pointer())
+    arch = gdb.selected_frame().architecture().name()
+    if arch.startswith('aarch64'):
+        # x19-x28, x29 (fp), x30 (lr), then d8-d15: 20 words
+        regs = dict(('x%d' % (19 + i), frame[i]) for i in range(12))
+        regs['pc'] = frame[11]
+        regs['sp'] = gdb.parse_and_eval('(uint64_t)%s + 160' % sp)
+        return regs
+    return {'r15': frame[0],
+        'r14': frame[1],
+        'r13': frame[2],
+        'r12': frame[3],
+        'rbx': frame[4],
+        'rbp': frame[5],
+        'rip': frame[6],
+        'rsp': gdb.parse_and_eval('(uint64_t)%s + 56' % sp) }
+
+def bt_regs(regs):
+    '''Backtrace from a set of saved registers'''
     old = dict()
 
     for i in regs:
@@ -85,10 +103,26 @@ def bt_jmpbuf(jmpbuf):
     for i in regs:
         gdb.execute('set $%s = %s' % (i, old[i]))
 
+def bt_jmpbuf(jmpbuf):
+    '''Backtrace a jmpbuf'''
+    bt_regs(get_jmpbuf_regs(jmpbuf))
+
 def coroutine_to_jmpbuf(co):
     coroutine_pointer = co.cast(gdb.lookup_type('CoroutineUContext').pointer())
     return coroutine_pointer['env']['__jmpbuf']
 
+def get_coroutine_regs(co):
+    '''Fetch the saved registers of a coroutine for either backend'''
+    try:
+        asm_type = gdb.lookup_type('CoroutineAsm')
+    except gdb.error:
+        return get_jmpbuf_regs(coroutine_to_jmpbuf(co))
+    return get_asm_regs(co.cast(asm_type.pointer())['sp'])
+
+def bt_coroutine(co):
+    '''Backtrace a coroutine'''
+    bt_regs(get_coroutine_regs(co))
+
 
 class CoroutineCommand(gdb.Command):
     '''Display coroutine backtrace'''
@@ -102,18 +136,18 @@ class CoroutineCommand(gdb.Command):
             gdb.write('usage: qemu coroutine <coroutine-pointer>\n')
             return
 
-        bt_jmpbuf(coroutine_to_jmpbuf(gdb.parse_and_eval(argv[0])))
+        bt_coroutine(gdb.parse_and_eval(argv[0]))
 
 class CoroutineSPFunction(gdb.Function):
     def __init__(self):
         gdb.Function.__init__(self, 'qemu_coroutine_sp')
 
     def invoke(self, addr):
-        return get_jmpbuf_regs(coroutine_to_jmpbuf(addr))['rsp'].cast(VOID_PTR)
+        return get_coroutine_regs(addr)['rsp'].cast(VOID_PTR)
 
 class CoroutinePCFunction(gdb.Function):
     def __init__(self):
         gdb.Function.__init__(self, 'qemu_coroutine_pc')
 
     def invoke(self, addr):
-        return get_jmpbuf_regs(coroutine_to_jmpbuf(addr))['rip'].cast(VOID_PTR)
+        return get_coroutine_regs(addr)['rip'].cast(VOID_PTR)
@@ -113,6 +113,7 @@ diddit:
 		/* Update *_queued */
 		so->so_queued++;
 		so->so_nqueued++;
+		so_poll_update(so);
 		/*
 		 * Check if the interactive session should be downgraded to
 		 * the batchq.  A session is downgraded if it has queued 6
@@ -216,6 +217,9 @@ void if_start(Slirp *slirp)
             /* If there's no more queued, reset nqueued */
             ifm->ifq_so->so_nqueued = 0;
         }
+        if (ifm->ifq_so) {
+            so_poll_update(ifm->ifq_so);
+        }
 
         m_free(ifm);
     }
@@ -95,7 +95,9 @@ static int icmp_send(struct socket *so, struct mbuf *m, int hlen)
     addr.sin_family = AF_INET;
     addr.sin_addr = so->so_faddr;
 
+    so->so_poll_proto = IPPROTO_ICMP;
     insque(so, &so->slirp->icmp);
+    so_poll_update(so);
 
     if (sendto(so->s, m->m_data + hlen, m->m_len - hlen, 0,
                (struct sockaddr *)&addr, sizeof(addr)) == -1) {
@@ -110,6 +112,7 @@ static int icmp_send(struct socket *so, struct mbuf *m, int hlen)
 
 void icmp_detach(struct socket *so)
 {
+    so_poll_remove(so);
     closesocket(so->s);
     sofree(so);
 }
@@ -181,6 +184,7 @@ icmp_input(struct mbuf *m, int hlen)
       so->so_iptos = ip->ip_tos;
       so->so_type = IPPROTO_ICMP;
       so->so_state = SS_ISFCONNECTED;
+      so_poll_update(so);
 
       /* Send the packet */
       addr = so->fhost.ss;
@@ -92,6 +92,7 @@ sbappend(struct socket *so, struct mbuf *m)
 		sbappendsb(&so->so_rcv, m);
 		m_free(m);
 		(void)sosendoob(so);
+		so_poll_update(so);
 		return;
 	}
 
@@ -121,6 +122,7 @@ sbappend(struct socket *so, struct mbuf *m)
 	} /* else */
 	/* Whatever happened, we free the mbuf */
 	m_free(m);
+	so_poll_update(so);
 }
 
 /*
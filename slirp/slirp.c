@@ -34,6 +34,9 @@
 #ifndef _WIN32
 #include <net/if.h>
 #endif
+#ifdef CONFIG_EPOLL_CREATE1
+#include <sys/epoll.h>
+#endif
 
 /* host loopback address */
 struct in_addr loopback_addr;
@@ -294,6 +297,10 @@ Slirp *slirp_init(int restricted, bool in_enabled, struct in_addr vnetwork,
 
     slirp->grand = g_rand_new();
     slirp->restricted = restricted;
+#ifdef CONFIG_EPOLL_CREATE1
+    slirp->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    slirp->epollfd_idx = -1;
+#endif
 
     slirp->in_enabled = in_enabled;
     slirp->in6_enabled = in6_enabled;
@@ -346,6 +353,11 @@ void slirp_cleanup(Slirp *slirp)
     m_cleanup(slirp);
 
     g_rand_free(slirp->grand);
+#ifdef CONFIG_EPOLL_CREATE1
+    if (slirp->epollfd != -1) {
+        close(slirp->epollfd);
+    }
+#endif
 
     g_free(slirp->vdnssearch);
     g_free(slirp->tftp_prefix);
@@ -383,184 +395,449 @@ static void slirp_update_timeout(uint32_t *timeout)
     *timeout = t;
 }
 
+/*
+ * Events a socket has to be polled for, as GPollFD event bits.
+ */
+static int slirp_socket_events(struct socket *so)
+{
+    int events = 0;
+
+    if (so->s == -1) {
+        return 0;
+    }
+
+    switch (so->so_poll_proto) {
+    case IPPROTO_TCP:
+        /*
+         * NOFDREF can include still connecting to local-host,
+         * newly socreated() sockets etc. Don't want to select these.
+         */
+        if (so->so_state & SS_NOFDREF) {
+            return 0;
+        }
+
+        /*
+         * Set for reading sockets which are accepting
+         */
+        if (so->so_state & SS_FACCEPTCONN) {
+            return G_IO_IN | G_IO_HUP | G_IO_ERR;
+        }
+
+        /*
+         * Set for writing sockets which are connecting
+         */
+        if (so->so_state & SS_ISFCONNECTING) {
+            return G_IO_OUT | G_IO_ERR;
+        }
+
+        /*
+         * Set for writing if we are connected, can send more, and
+         * we have something to send
+         */
+        if (CONN_CANFSEND(so) && so->so_rcv.sb_cc) {
+            events |= G_IO_OUT | G_IO_ERR;
+        }
+
+        /*
+         * Set for reading (and urgent data) if we are connected, can
+         * receive more, and we have room for it XXX /2 ?
+         */
+        if (CONN_CANFRCV(so) &&
+            (so->so_snd.sb_cc < (so->so_snd.sb_datalen/2))) {
+            events |= G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_PRI;
+        }
+        break;
+
+    case IPPROTO_UDP:
+        /*
+         * When UDP packets are received from over the
+         * link, they're sendto()'d straight away, so
+         * no need for setting for writing
+         * Limit the number of packets queued by this session
+         * to 4.  Note that even though we try and limit this
+         * to 4 packets, the session could have more queued
+         * if the packets needed to be fragmented
+         * (XXX <= 4 ?)
+         */
+        if ((so->so_state & SS_ISFCONNECTED) && so->so_queued <= 4) {
+            events = G_IO_IN | G_IO_HUP | G_IO_ERR;
+        }
+        break;
+
+    case IPPROTO_ICMP:
+        if (so->so_state & SS_ISFCONNECTED) {
+            events = G_IO_IN | G_IO_HUP | G_IO_ERR;
+        }
+        break;
+    }
+
+    return events;
+}
+
+#ifdef CONFIG_EPOLL_CREATE1
+static uint32_t slirp_epoll_events(int events)
+{
+    return (events & G_IO_IN ? EPOLLIN : 0) |
+           (events & G_IO_OUT ? EPOLLOUT : 0) |
+           (events & G_IO_PRI ? EPOLLPRI : 0) |
+           (events & G_IO_HUP ? EPOLLHUP : 0) |
+           (events & G_IO_ERR ? EPOLLERR : 0);
+}
+
+static int slirp_epoll_revents(uint32_t events)
+{
+    return (events & EPOLLIN ? G_IO_IN : 0) |
+           (events & EPOLLOUT ? G_IO_OUT : 0) |
+           (events & EPOLLPRI ? G_IO_PRI : 0) |
+           (events & EPOLLHUP ? G_IO_HUP : 0) |
+           (events & EPOLLERR ? G_IO_ERR : 0);
+}
+#endif
+
+/*
+ * Bring the epoll registration of a socket in line with its state.  Must
+ * be called whenever something slirp_socket_events() looks at changes.
+ * Without an epoll instance, the sockets are walked by
+ * slirp_pollfds_fill() instead and there is nothing to do.
+ */
+void so_poll_update(struct socket *so)
+{
+#ifdef CONFIG_EPOLL_CREATE1
+    Slirp *slirp = so->slirp;
+    struct epoll_event ev;
+    int events;
+
+    if (slirp->epollfd == -1) {
+        return;
+    }
+
+    if (so->so_poll_fd != so->s) {
+        so_poll_remove(so);
+    }
+
+    events = slirp_socket_events(so);
+    if (so->so_poll_fd != -1 && events == so->so_poll_events) {
+        return;
+    }
+
+    ev.events = slirp_epoll_events(events);
+    ev.data.ptr = so;
+    if (so->so_poll_fd == -1) {
+        if (!events ||
+            epoll_ctl(slirp->epollfd, EPOLL_CTL_ADD, so->s, &ev) < 0) {
+            return;
+        }
+        so->so_poll_fd = so->s;
+    } else if (epoll_ctl(slirp->epollfd, EPOLL_CTL_MOD, so->s, &ev) < 0) {
+        return;
+    }
+    so->so_poll_events = events;
+#endif
+}
+
+/*
+ * Drop the epoll registration of a socket.  Must be called before its
+ * descriptor is closed, as the number may be reused right away.
+ */
+void so_poll_remove(struct socket *so)
+{
+#ifdef CONFIG_EPOLL_CREATE1
+    if (so->so_poll_fd != -1) {
+        epoll_ctl(so->slirp->epollfd, EPOLL_CTL_DEL, so->so_poll_fd, NULL);
+        so->so_poll_fd = -1;
+        so->so_poll_events = 0;
+    }
+#endif
+}
+
+/*
+ * Expire idle UDP and ICMP sockets.  Called with the slow timers.
+ */
+static void slirp_expire_sockets(struct socket *head,
+                                 void (*detach)(struct socket *))
+{
+    struct socket *so, *so_next;
+
+    for (so = head->so_next; so != head; so = so_next) {
+        so_next = so->so_next;
+
+        if (so->so_expire && so->so_expire <= curtime) {
+            detach(so);
+        }
+    }
+}
+
+static void slirp_pollfds_add(GArray *pollfds, struct socket *head)
+{
+    struct socket *so;
+
+    for (so = head->so_next; so != head; so = so->so_next) {
+        int events = slirp_socket_events(so);
+
+        so->pollfds_idx = -1;
+        if (events) {
+            GPollFD pfd = {
+                .fd = so->s,
+                .events = events,
+            };
+            so->pollfds_idx = pollfds->len;
+            g_array_append_val(pollfds, pfd);
+        }
+    }
+}
+
 void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout)
 {
     Slirp *slirp;
-    struct socket *so, *so_next;
 
     if (QTAILQ_EMPTY(&slirp_instances)) {
         return;
     }
 
-    /*
-     * First, TCP sockets
-     */
-
     QTAILQ_FOREACH(slirp, &slirp_instances, entry) {
         /*
          * *_slowtimo needs calling if there are IP fragments
-         * in the fragment queue, or there are TCP connections active
+         * in the fragment queue, TCP connections active, or
+         * UDP and ICMP sockets that may expire
          */
         slirp->do_slowtimo = ((slirp->tcb.so_next != &slirp->tcb) ||
-                (&slirp->ipq.ip_link != slirp->ipq.ip_link.next));
+                (&slirp->ipq.ip_link != slirp->ipq.ip_link.next) ||
+                (slirp->udb.so_next != &slirp->udb) ||
+                (slirp->icmp.so_next != &slirp->icmp));
 
-        for (so = slirp->tcb.so_next; so != &slirp->tcb;
-                so = so_next) {
-            int events = 0;
+#ifdef CONFIG_EPOLL_CREATE1
+        /*
+         * The epoll instance tracks what every socket waits for, so
+         * only its descriptor goes to the main loop.
+         */
+        if (slirp->epollfd != -1) {
+            GPollFD pfd = {
+                .fd = slirp->epollfd,
+                .events = G_IO_IN,
+            };
+            slirp->epollfd_idx = pollfds->len;
+            g_array_append_val(pollfds, pfd);
+            continue;
+        }
+#endif
 
-            so_next = so->so_next;
+        slirp_pollfds_add(pollfds, &slirp->tcb);
+        slirp_pollfds_add(pollfds, &slirp->udb);
+        slirp_pollfds_add(pollfds, &slirp->icmp);
+    }
+    slirp_update_timeout(timeout);
+}
 
-            so->pollfds_idx = -1;
+static void slirp_tcp_poll(struct socket *so, int revents)
+{
+    int ret;
 
-            /*
-             * See if we need a tcp_fasttimo
-             */
-            if (slirp->time_fasttimo == 0 &&
-                so->so_tcpcb->t_flags & TF_DELACK) {
-                slirp->time_fasttimo = curtime; /* Flag when want a fasttimo */
-            }
+    if (so->so_state & SS_NOFDREF || so->s == -1) {
+        return;
+    }
 
-            /*
-             * NOFDREF can include still connecting to local-host,
-             * newly socreated() sockets etc. Don't want to select these.
-             */
-            if (so->so_state & SS_NOFDREF || so->s == -1) {
-                continue;
-            }
+    /*
+     * Check for URG data
+     * This will soread as well, so no need to
+     * test for G_IO_IN below if this succeeds
+     */
+    if (revents & G_IO_PRI) {
+        ret = sorecvoob(so);
+        if (ret < 0) {
+            /* Socket error might have resulted in the socket being
+             * removed, do not try to do anything more with it. */
+            return;
+        }
+    }
+    /*
+     * Check sockets for reading
+     */
+    else if (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) {
+        /*
+         * Check for incoming connections
+         */
+        if (so->so_state & SS_FACCEPTCONN) {
+            tcp_connect(so);
+            return;
+        } /* else */
+        ret = soread(so);
 
-            /*
-             * Set for reading sockets which are accepting
-             */
-            if (so->so_state & SS_FACCEPTCONN) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = G_IO_IN | G_IO_HUP | G_IO_ERR,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
-                continue;
-            }
+        /* Output it if we read something */
+        if (ret > 0) {
+            tcp_output(sototcpcb(so));
+        }
+        if (ret < 0) {
+            /* Socket error might have resulted in the socket being
+             * removed, do not try to do anything more with it. */
+            return;
+        }
+    }
 
-            /*
-             * Set for writing sockets which are connecting
-             */
-            if (so->so_state & SS_ISFCONNECTING) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = G_IO_OUT | G_IO_ERR,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
-                continue;
+    /*
+     * Check sockets for writing
+     */
+    if (!(so->so_state & SS_NOFDREF) &&
+            (revents & (G_IO_OUT | G_IO_ERR))) {
+        /*
+         * Check for non-blocking, still-connecting sockets
+         */
+        if (so->so_state & SS_ISFCONNECTING) {
+            /* Connected */
+            so->so_state &= ~SS_ISFCONNECTING;
+
+            ret = send(so->s, (const void *) &ret, 0, 0);
+            if (ret < 0) {
+                /* XXXXX Must fix, zero bytes is a NOP */
+                if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                    errno == EINPROGRESS || errno == ENOTCONN) {
+                    so_poll_update(so);
+                    return;
+                }
+
+                /* else failed */
+                so->so_state &= SS_PERSISTENT_MASK;
+                so->so_state |= SS_NOFDREF;
             }
+            /* else so->so_state &= ~SS_ISFCONNECTING; */
+            so_poll_update(so);
 
             /*
-             * Set for writing if we are connected, can send more, and
-             * we have something to send
+             * Continue tcp_input
              */
-            if (CONN_CANFSEND(so) && so->so_rcv.sb_cc) {
-                events |= G_IO_OUT | G_IO_ERR;
+            tcp_input((struct mbuf *)NULL, sizeof(struct ip), so,
+                      so->so_ffamily);
+            /* continue; */
+        } else {
+            ret = sowrite(so);
+            if (ret > 0) {
+                /* Call tcp_output in case we need to send a window
+                 * update to the guest, otherwise it will be stuck
+                 * until it sends a window probe. */
+                tcp_output(sototcpcb(so));
             }
+        }
+    }
 
-            /*
-             * Set for reading (and urgent data) if we are connected, can
-             * receive more, and we have room for it XXX /2 ?
-             */
-            if (CONN_CANFRCV(so) &&
-                (so->so_snd.sb_cc < (so->so_snd.sb_datalen/2))) {
-                events |= G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_PRI;
+    /*
+     * Probe a still-connecting, non-blocking socket
+     * to check if it's still alive
+     */
+#ifdef PROBE_CONN
+    if (so->so_state & SS_ISFCONNECTING) {
+        ret = qemu_recv(so->s, &ret, 0, 0);
+
+        if (ret < 0) {
+            /* XXX */
+            if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                errno == EINPROGRESS || errno == ENOTCONN) {
+                return; /* Still connecting, continue */
             }
 
-            if (events) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = events,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
+            /* else failed */
+            so->so_state &= SS_PERSISTENT_MASK;
+            so->so_state |= SS_NOFDREF;
+
+            /* tcp_input will take care of it */
+        } else {
+            ret = send(so->s, &ret, 0, 0);
+            if (ret < 0) {
+                /* XXX */
+                if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                    errno == EINPROGRESS || errno == ENOTCONN) {
+                    return;
+                }
+                /* else failed */
+                so->so_state &= SS_PERSISTENT_MASK;
+                so->so_state |= SS_NOFDREF;
+            } else {
+                so->so_state &= ~SS_ISFCONNECTING;
             }
-        }
 
-        /*
-         * UDP sockets
-         */
-        for (so = slirp->udb.so_next; so != &slirp->udb;
-                so = so_next) {
-            so_next = so->so_next;
+        }
+        so_poll_update(so);
+        tcp_input((struct mbuf *)NULL, sizeof(struct ip), so,
+                  so->so_ffamily);
+    } /* SS_ISFCONNECTING */
+#endif
+}
 
-            so->pollfds_idx = -1;
+/*
+ * Service one socket that has events pending.
+ * The socket may have been freed when this returns.
+ */
+static void slirp_socket_poll(struct socket *so, int revents)
+{
+    switch (so->so_poll_proto) {
+    case IPPROTO_TCP:
+        slirp_tcp_poll(so, revents);
+        break;
 
-            /*
-             * See if it's timed out
-             */
-            if (so->so_expire) {
-                if (so->so_expire <= curtime) {
-                    udp_detach(so);
-                    continue;
-                } else {
-                    slirp->do_slowtimo = true; /* Let socket expire */
-                }
-            }
+    /*
+     * Incoming packets are sent straight away, they're not buffered.
+     * Incoming UDP data isn't buffered either.
+     */
+    case IPPROTO_UDP:
+        if (so->s != -1 &&
+            (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
+            sorecvfrom(so);
+        }
+        break;
 
-            /*
-             * When UDP packets are received from over the
-             * link, they're sendto()'d straight away, so
-             * no need for setting for writing
-             * Limit the number of packets queued by this session
-             * to 4.  Note that even though we try and limit this
-             * to 4 packets, the session could have more queued
-             * if the packets needed to be fragmented
-             * (XXX <= 4 ?)
-             */
-            if ((so->so_state & SS_ISFCONNECTED) && so->so_queued <= 4) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = G_IO_IN | G_IO_HUP | G_IO_ERR,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
-            }
+    /*
+     * Check incoming ICMP relies.
+     */
+    case IPPROTO_ICMP:
+        if (so->s != -1 &&
+            (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
+            icmp_receive(so);
         }
+        break;
+    }
+}
 
-        /*
-         * ICMP sockets
-         */
-        for (so = slirp->icmp.so_next; so != &slirp->icmp;
-                so = so_next) {
-            so_next = so->so_next;
+static void slirp_pollfds_check(GArray *pollfds, struct socket *head)
+{
+    struct socket *so, *so_next;
 
-            so->pollfds_idx = -1;
+    for (so = head->so_next; so != head; so = so_next) {
+        int revents = 0;
 
-            /*
-             * See if it's timed out
-             */
-            if (so->so_expire) {
-                if (so->so_expire <= curtime) {
-                    icmp_detach(so);
-                    continue;
-                } else {
-                    slirp->do_slowtimo = true; /* Let socket expire */
-                }
-            }
+        so_next = so->so_next;
 
-            if (so->so_state & SS_ISFCONNECTED) {
-                GPollFD pfd = {
-                    .fd = so->s,
-                    .events = G_IO_IN | G_IO_HUP | G_IO_ERR,
-                };
-                so->pollfds_idx = pollfds->len;
-                g_array_append_val(pollfds, pfd);
-            }
+        if (so->pollfds_idx != -1) {
+            revents = g_array_index(pollfds, GPollFD,
+                                    so->pollfds_idx).revents;
         }
+
+        slirp_socket_poll(so, revents);
     }
-    slirp_update_timeout(timeout);
 }
 
+#ifdef CONFIG_EPOLL_CREATE1
+#define SLIRP_EPOLL_BATCH 64
+
+/*
+ * Service the sockets the epoll instance reports as ready, and only
+ * those.
+ */
+static void slirp_epoll_check(Slirp *slirp)
+{
+    struct epoll_event events[SLIRP_EPOLL_BATCH];
+    int i, n;
+
+    do {
+        n = epoll_wait(slirp->epollfd, events, SLIRP_EPOLL_BATCH, 0);
+        for (i = 0; i < n; i++) {
+            slirp_socket_poll(events[i].data.ptr,
+                              slirp_epoll_revents(events[i].events));
+        }
+    } while (n == SLIRP_EPOLL_BATCH);
+}
+#endif
+
 void slirp_pollfds_poll(GArray *pollfds, int select_error)
 {
     Slirp *slirp;
-    struct socket *so, *so_next;
-    int ret;
 
     if (QTAILQ_EMPTY(&slirp_instances)) {
         return;
@@ -581,6 +858,8 @@ void slirp_pollfds_poll(GArray *pollfds, int select_error)
             ((curtime - slirp->last_slowtimo) >= TIMEOUT_SLOW)) {
             ip_slowtimo(slirp);
             tcp_slowtimo(slirp);
+            slirp_expire_sockets(&slirp->udb, udp_detach);
+            slirp_expire_sockets(&slirp->icmp, icmp_detach);
             slirp->last_slowtimo = curtime;
         }
 
@@ -588,190 +867,21 @@ void slirp_pollfds_poll(GArray *pollfds, int select_error)
          * Check sockets
          */
         if (!select_error) {
-            /*
-             * Check TCP sockets
-             */
-            for (so = slirp->tcb.so_next; so != &slirp->tcb;
-                    so = so_next) {
-                int revents;
-
-                so_next = so->so_next;
-
-                revents = 0;
-                if (so->pollfds_idx != -1) {
-                    revents = g_array_index(pollfds, GPollFD,
-                                            so->pollfds_idx).revents;
-                }
-
-                if (so->so_state & SS_NOFDREF || so->s == -1) {
-                    continue;
-                }
-
-                /*
-                 * Check for URG data
-                 * This will soread as well, so no need to
-                 * test for G_IO_IN below if this succeeds
-                 */
-                if (revents & G_IO_PRI) {
-                    ret = sorecvoob(so);
-                    if (ret < 0) {
-                        /* Socket error might have resulted in the socket being
-                         * removed, do not try to do anything more with it. */
-                        continue;
-                    }
-                }
-                /*
-                 * Check sockets for reading
-                 */
-                else if (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) {
-                    /*
-                     * Check for incoming connections
-                     */
-                    if (so->so_state & SS_FACCEPTCONN) {
-                        tcp_connect(so);
-                        continue;
-                    } /* else */
-                    ret = soread(so);
-
-                    /* Output it if we read something */
-                    if (ret > 0) {
-                        tcp_output(sototcpcb(so));
-                    }
-                    if (ret < 0) {
-                        /* Socket error might have resulted in the socket being
-                         * removed, do not try to do anything more with it. */
-                        continue;
-                    }
-                }
-
-                /*
-                 * Check sockets for writing
-                 */
-                if (!(so->so_state & SS_NOFDREF) &&
-                        (revents & (G_IO_OUT | G_IO_ERR))) {
-                    /*
-                     * Check for non-blocking, still-connecting sockets
-                     */
-                    if (so->so_state & SS_ISFCONNECTING) {
-                        /* Connected */
-                        so->so_state &= ~SS_ISFCONNECTING;
-
-                        ret = send(so->s, (const void *) &ret, 0, 0);
-                        if (ret < 0) {
-                            /* XXXXX Must fix, zero bytes is a NOP */
-                            if (errno == EAGAIN || errno == EWOULDBLOCK ||
-                                errno == EINPROGRESS || errno == ENOTCONN) {
-                                continue;
-                            }
-
-                            /* else failed */
-                            so->so_state &= SS_PERSISTENT_MASK;
-                            so->so_state |= SS_NOFDREF;
-                        }
-                        /* else so->so_state &= ~SS_ISFCONNECTING; */
-
-                        /*
-                         * Continue tcp_input
-                         */
-                        tcp_input((struct mbuf *)NULL, sizeof(struct ip), so,
-                                  so->so_ffamily);
-                        /* continue; */
-                    } else {
-                        ret = sowrite(so);
-                        if (ret > 0) {
-                            /* Call tcp_output in case we need to send a window
-                             * update to the guest, otherwise it will be stuck
-                             * until it sends a window probe. */
-                            tcp_output(sototcpcb(so));
-                        }
-                    }
-                }
-
-                /*
-                 * Probe a still-connecting, non-blocking socket
-                 * to check if it's still alive
-                 */
-#ifdef PROBE_CONN
-                if (so->so_state & SS_ISFCONNECTING) {
-                    ret = qemu_recv(so->s, &ret, 0, 0);
-
-                    if (ret < 0) {
-                        /* XXX */
-                        if (errno == EAGAIN || errno == EWOULDBLOCK ||
-                            errno == EINPROGRESS || errno == ENOTCONN) {
-                            continue; /* Still connecting, continue */
-                        }
-
-                        /* else failed */
-                        so->so_state &= SS_PERSISTENT_MASK;
-                        so->so_state |= SS_NOFDREF;
-
-                        /* tcp_input will take care of it */
-                    } else {
-                        ret = send(so->s, &ret, 0, 0);
-                        if (ret < 0) {
-                            /* XXX */
-                            if (errno == EAGAIN || errno == EWOULDBLOCK ||
-                                errno == EINPROGRESS || errno == ENOTCONN) {
-                                continue;
-                            }
-                            /* else failed */
-                            so->so_state &= SS_PERSISTENT_MASK;
-                            so->so_state |= SS_NOFDREF;
-                        } else {
-                            so->so_state &= ~SS_ISFCONNECTING;
-                        }
-
-                    }
-                    tcp_input((struct mbuf *)NULL, sizeof(struct ip), so,
-                              so->so_ffamily);
-                } /* SS_ISFCONNECTING */
-#endif
-            }
-
-            /*
-             * Now UDP sockets.
-             * Incoming packets are sent straight away, they're not buffered.
-             * Incoming UDP data isn't buffered either.
-             */
-            for (so = slirp->udb.so_next; so != &slirp->udb;
-                    so = so_next) {
-                int revents;
-
-                so_next = so->so_next;
-
-                revents = 0;
-                if (so->pollfds_idx != -1) {
-                    revents = g_array_index(pollfds, GPollFD,
-                            so->pollfds_idx).revents;
-                }
-
-                if (so->s != -1 &&
-                    (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
-                    sorecvfrom(so);
-                }
-            }
-
-            /*
-             * Check incoming ICMP relies.
-             */
-            for (so = slirp->icmp.so_next; so != &slirp->icmp;
-                    so = so_next) {
-                    int revents;
-
-                    so_next = so->so_next;
-
-                    revents = 0;
-                    if (so->pollfds_idx != -1) {
-                        revents = g_array_index(pollfds, GPollFD,
-                                                so->pollfds_idx).revents;
-                    }
-
-                    if (so->s != -1 &&
-                        (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
-                    icmp_receive(so);
+#ifdef CONFIG_EPOLL_CREATE1
+            if (slirp->epollfd != -1) {
+                if (slirp->epollfd_idx != -1 &&
+                    g_array_index(pollfds, GPollFD,
+                                  slirp->epollfd_idx).revents) {
+                    slirp_epoll_check(slirp);
                 }
+                slirp->epollfd_idx = -1;
+                if_start(slirp);
+                continue;
             }
+#endif
+            slirp_pollfds_check(pollfds, &slirp->tcb);
+            slirp_pollfds_check(pollfds, &slirp->udb);
+            slirp_pollfds_check(pollfds, &slirp->icmp);
         }
 
         if_start(slirp);
@@ -1036,7 +1146,8 @@ int slirp_remove_hostfwd(Slirp *slirp, int is_udp, struct in_addr host_addr,
             getsockname(so->s, (struct sockaddr *)&addr, &addr_len) == 0 &&
             addr.sin_addr.s_addr == host_addr.s_addr &&
             addr.sin_port == port) {
-            close(so->s);
+            so_poll_remove(so);
+            closesocket(so->s);
             sofree(so);
             return 0;
         }
@@ -154,6 +154,10 @@ struct Slirp {
     u_int time_fasttimo;
     u_int last_slowtimo;
     bool do_slowtimo;
+#ifdef CONFIG_EPOLL_CREATE1
+    int epollfd;            /* sockets to poll, or -1 to walk them all */
+    int epollfd_idx;        /* GPollFD GArray index of epollfd */
+#endif
 
     bool in_enabled, in6_enabled;
 
@@ -55,6 +55,7 @@ socreate(Slirp *slirp)
     so->s = -1;
     so->slirp = slirp;
     so->pollfds_idx = -1;
+    so->so_poll_fd = -1;
   }
   return(so);
 }
@@ -88,6 +89,7 @@ sofree(struct socket *so)
 {
   Slirp *slirp = so->slirp;
 
+  so_poll_remove(so);
   soqfree(so, &slirp->if_fastq);
   soqfree(so, &slirp->if_batchq);
 
@@ -250,6 +252,7 @@ soread(struct socket *so)
 	sb->sb_wptr += nn;
 	if (sb->sb_wptr >= (sb->sb_data + sb->sb_datalen))
 		sb->sb_wptr -= sb->sb_datalen;
+	so_poll_update(so);
 	return nn;
 }
 
@@ -391,6 +394,7 @@ sosendoob(struct socket *so)
 	sb->sb_rptr += n;
 	if (sb->sb_rptr >= (sb->sb_data + sb->sb_datalen))
 		sb->sb_rptr -= sb->sb_datalen;
+	so_poll_update(so);
 
 	return n;
 }
@@ -488,6 +492,7 @@ sowrite(struct socket *so)
 	 */
 	if ((so->so_state & SS_FWDRAIN) && sb->sb_cc == 0)
 		sofcantsendmore(so);
+	so_poll_update(so);
 
 	return nn;
 
@@ -684,6 +689,7 @@ sosendto(struct socket *so, struct mbuf *m)
 		so->so_expire = curtime + SO_EXPIRE;
 	so->so_state &= SS_PERSISTENT_MASK;
 	so->so_state |= SS_ISFCONNECTED; /* So that it gets select()ed */
+	so_poll_update(so);
 	return 0;
 }
 
@@ -717,6 +723,7 @@ tcp_listen(Slirp *slirp, uint32_t haddr, u_int hport, uint32_t laddr,
 		free(so);
 		return NULL;
 	}
+	so->so_poll_proto = IPPROTO_TCP;
 	insque(so, &slirp->tcb);
 
 	/*
@@ -766,6 +773,7 @@ tcp_listen(Slirp *slirp, uint32_t haddr, u_int hport, uint32_t laddr,
 	   so->so_faddr = addr.sin_addr;
 
 	so->s = s;
+	so_poll_update(so);
 	return so;
 }
 
@@ -781,6 +789,7 @@ soisfconnecting(struct socket *so)
 	so->so_state &= ~(SS_NOFDREF|SS_ISFCONNECTED|SS_FCANTRCVMORE|
 			  SS_FCANTSENDMORE|SS_FWDRAIN);
 	so->so_state |= SS_ISFCONNECTING; /* Clobber other states */
+	so_poll_update(so);
 }
 
 void
@@ -788,6 +797,7 @@ soisfconnected(struct socket *so)
 {
 	so->so_state &= ~(SS_ISFCONNECTING|SS_FWDRAIN|SS_NOFDREF);
 	so->so_state |= SS_ISFCONNECTED; /* Clobber other states */
+	so_poll_update(so);
 }
 
 static void
@@ -803,6 +813,7 @@ sofcantrcvmore(struct socket *so)
 	} else {
 	   so->so_state |= SS_FCANTRCVMORE;
 	}
+	so_poll_update(so);
 }
 
 static void
@@ -818,6 +829,7 @@ sofcantsendmore(struct socket *so)
 	} else {
 	   so->so_state |= SS_FCANTSENDMORE;
 	}
+	so_poll_update(so);
 }
 
 /*
@@ -27,6 +27,9 @@ struct socket {
   int s;                           /* The actual socket */
 
   int pollfds_idx;                 /* GPollFD GArray index */
+  int so_poll_fd;                  /* fd registered with the epoll instance */
+  int so_poll_events;              /* GPollFD events it is registered for */
+  uint8_t so_poll_proto;           /* IPPROTO_* of the list the socket is on */
 
   Slirp *slirp;			   /* managing slirp instance */
 
@@ -154,6 +157,8 @@ int soreadbuf(struct socket *so, const char *buf, int size);
 void sotranslate_out(struct socket *, struct sockaddr_storage *);
 void sotranslate_in(struct socket *, struct sockaddr_storage *);
 void sotranslate_accept(struct socket *);
+void so_poll_update(struct socket *so);
+void so_poll_remove(struct socket *so);
 
 
 #endif /* SLIRP_SOCKET_H */
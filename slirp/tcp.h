@@ -38,8 +38,12 @@ typedef	uint32_t tcp_seq;
 #define      PR_SLOWHZ       2               /* 2 slow timeouts per second (approx) */
 #define      PR_FASTHZ       5               /* 5 fast timeouts per second (not important) */
 
-#define TCP_SNDSPACE 8192
-#define TCP_RCVSPACE 8192
+/*
+ * Socket buffer sizes.  Without window scaling the guest never has more
+ * than TCP_MAXWIN bytes in flight, so a full window is the useful limit.
+ */
+#define TCP_SNDSPACE (64 * 1024)
+#define TCP_RCVSPACE (64 * 1024)
 
 /*
  * TCP header.
@@ -60,6 +60,20 @@
  * Set DELACK for segments received in order, but ack immediately
  * when segments are out of order (so fast retransmit can work).
  */
+/*
+ * Delay the ACK of a connection; tcp_fasttimo() sends it unless a segment
+ * going the other way carries it first.
+ */
+static inline void tcp_delack(struct tcpcb *tp)
+{
+    Slirp *slirp = tp->t_socket->slirp;
+
+    tp->t_flags |= TF_DELACK;
+    if (slirp->time_fasttimo == 0) {
+        slirp->time_fasttimo = curtime; /* Flag when want a fasttimo */
+    }
+}
+
 #ifdef TCP_ACK_HACK
 #define TCP_REASS(tp, ti, m, so, flags) {\
        if ((ti)->ti_seq == (tp)->rcv_nxt && \
@@ -68,7 +82,7 @@
                if (ti->ti_flags & TH_PUSH) \
                        tp->t_flags |= TF_ACKNOW; \
                else \
-                       tp->t_flags |= TF_DELACK; \
+                       tcp_delack(tp); \
                (tp)->rcv_nxt += (ti)->ti_len; \
                flags = (ti)->ti_flags & TH_FIN; \
                if (so->so_emu) { \
@@ -85,7 +99,7 @@
 	if ((ti)->ti_seq == (tp)->rcv_nxt && \
         tcpfrag_list_empty(tp) && \
 	    (tp)->t_state == TCPS_ESTABLISHED) { \
-		tp->t_flags |= TF_DELACK; \
+		tcp_delack(tp); \
 		(tp)->rcv_nxt += (ti)->ti_len; \
 		flags = (ti)->ti_flags & TH_FIN; \
 		if (so->so_emu) { \
@@ -529,6 +543,7 @@ findso:
 					tcp_xmit_timer(tp, tp->t_rtt);
 				acked = ti->ti_ack - tp->snd_una;
 				sbdrop(&so->so_snd, acked);
+				so_poll_update(so);
 				tp->snd_una = ti->ti_ack;
 				m_free(m);
 
@@ -1001,6 +1016,7 @@ trimthenstep6:
 		  } else if (ret == 2) {
 		    so->so_state &= SS_PERSISTENT_MASK;
 		    so->so_state |= SS_NOFDREF; /* CTL_CMD */
+		    so_poll_update(so);
 		  } else {
 		    needoutput = 1;
 		    tp->t_state = TCPS_FIN_WAIT_1;
@@ -1149,6 +1165,7 @@ trimthenstep6:
 			tp->snd_wnd -= acked;
 			ourfinisacked = 0;
 		}
+		so_poll_update(so);
 		tp->snd_una = ti->ti_ack;
 		if (SEQ_LT(tp->snd_nxt, tp->snd_una))
 			tp->snd_nxt = tp->snd_una;
@@ -337,6 +337,7 @@ tcp_close(struct tcpcb *tp)
 	/* clobber input socket cache if we're closing the cached connection */
 	if (so == slirp->tcp_last_so)
 		slirp->tcp_last_so = &slirp->tcb;
+	so_poll_remove(so);
 	closesocket(so->s);
 	sbfree(&so->so_rcv);
 	sbfree(&so->so_snd);
@@ -501,6 +502,7 @@ void tcp_connect(struct socket *inso)
     /* Close the accept() socket, set right state */
     if (inso->so_state & SS_FACCEPTONCE) {
         /* If we only accept once, close the accept() socket */
+        so_poll_remove(so);
         closesocket(so->s);
 
         /* Don't select it yet, even though we have an FD */
@@ -532,6 +534,7 @@ tcp_attach(struct socket *so)
 	if ((so->so_tcpcb = tcp_newtcpcb(so)) == NULL)
 	   return -1;
 
+	so->so_poll_proto = IPPROTO_TCP;
 	insque(so, &so->slirp->tcb);
 
 	return 0;
@@ -668,6 +671,7 @@ tcp_emu(struct socket *so, struct mbuf *m)
                                                          "%d,%d\r\n", n1, n2);
 				so_rcv->sb_rptr = so_rcv->sb_data;
 				so_rcv->sb_wptr = so_rcv->sb_data + so_rcv->sb_cc;
+				so_poll_update(so);
 			}
 			m_free(m);
 			return 0;
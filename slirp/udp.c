@@ -288,6 +288,7 @@ udp_attach(struct socket *so, unsigned short af)
   so->s = qemu_socket(af, SOCK_DGRAM, 0);
   if (so->s != -1) {
     so->so_expire = curtime + SO_EXPIRE;
+    so->so_poll_proto = IPPROTO_UDP;
     insque(so, &so->slirp->udb);
   }
   return(so->s);
@@ -296,6 +297,7 @@ udp_attach(struct socket *so, unsigned short af)
 void
 udp_detach(struct socket *so)
 {
+	so_poll_remove(so);
 	closesocket(so->s);
 	sofree(so);
 }
@@ -340,6 +342,7 @@ udp_listen(Slirp *slirp, uint32_t haddr, u_int hport, uint32_t laddr,
             return NULL;
         }
 	so->so_expire = curtime + SO_EXPIRE;
+	so->so_poll_proto = IPPROTO_UDP;
 	insque(so, &slirp->udb);
 
 	addr.sin_family = AF_INET;
@@ -363,6 +366,7 @@ udp_listen(Slirp *slirp, uint32_t haddr, u_int hport, uint32_t laddr,
 
 	so->so_state &= SS_PERSISTENT_MASK;
 	so->so_state |= SS_ISFCONNECTED | flags;
+	so_poll_update(so);
 
 	return so;
 }
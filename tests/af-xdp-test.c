@@ -0,0 +1,114 @@
+/*
+ * QTest testcase for the AF_XDP network backend
+ *
+ * Setting up AF_XDP sockets needs CAP_NET_ADMIN and an interface to bind
+ * to, so the tests that do so only run if QTEST_AF_XDP_IFNAME names one,
+ * for example one end of a veth pair:
+ *
+ *   ip link add qtest-xdp0 numtxqueues 2 numrxqueues 2 type veth \
+ *       peer name qtest-xdp1 numtxqueues 2 numrxqueues 2
+ *   ip link set qtest-xdp0 up; ip link set qtest-xdp1 up
+ *   QTEST_AF_XDP_IFNAME=qtest-xdp0 tests/af-xdp-test
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "qapi/qmp/qdict.h"
+
+static QDict *netdev_add(const char *ifname, int queues, int budget)
+{
+    return qmp("{'execute': 'netdev_add',"
+               " 'arguments': {"
+               "   'type': 'af-xdp',"
+               "   'id': 'qtest-xdp',"
+               "   'ifname': %s,"
+               "   'mode': 'skb',"
+               "   'queues': %d,"
+               "   'busy-poll-budget': %d"
+               "}}", ifname, queues, budget);
+}
+
+static void netdev_add_error(const char *ifname, int queues, int budget)
+{
+    QDict *response;
+
+    response = netdev_add(ifname, queues, budget);
+    g_assert(response);
+    g_assert(qdict_haskey(response, "error"));
+    qobject_unref(response);
+}
+
+static void netdev_add_del(const char *ifname, int queues, int budget)
+{
+    QDict *response;
+
+    response = netdev_add(ifname, queues, budget);
+    g_assert(response);
+    g_assert(!qdict_haskey(response, "error"));
+    qobject_unref(response);
+
+    response = qmp("{'execute': 'netdev_del',"
+                   " 'arguments': {"
+                   "   'id': 'qtest-xdp'"
+                   "}}");
+    g_assert(response);
+    g_assert(!qdict_haskey(response, "error"));
+    qobject_unref(response);
+}
+
+/* an interface that does not exist is refused */
+static void test_bad_ifname(void)
+{
+    netdev_add_error("qtest-no-such-if", 1, 0);
+}
+
+/* out of range options are refused before any socket is set up */
+static void test_bad_options(void)
+{
+    netdev_add_error("lo", 0, 0);
+    netdev_add_error("lo", 1025, 0);
+    netdev_add_error("lo", 1, -1);
+}
+
+/*
+ * Adding the netdev again only works if deleting it removed the XDP
+ * program, which must wait until the last of its queues goes away.
+ */
+static void test_add_del(void)
+{
+    const char *ifname = getenv("QTEST_AF_XDP_IFNAME");
+
+    netdev_add_del(ifname, 1, 0);
+    netdev_add_del(ifname, 1, 0);
+    netdev_add_del(ifname, 2, 0);
+    netdev_add_del(ifname, 2, 0);
+}
+
+static void test_busy_poll(void)
+{
+    const char *ifname = getenv("QTEST_AF_XDP_IFNAME");
+
+    netdev_add_del(ifname, 2, 64);
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+    qtest_add_func("/netdev/af-xdp/bad_ifname", test_bad_ifname);
+    qtest_add_func("/netdev/af-xdp/bad_options", test_bad_options);
+    if (getenv("QTEST_AF_XDP_IFNAME")) {
+        qtest_add_func("/netdev/af-xdp/add_del", test_add_del);
+        qtest_add_func("/netdev/af-xdp/busy_poll", test_busy_poll);
+    }
+
+    qtest_start("-machine none");
+    ret = g_test_run();
+    qtest_end();
+
+    return ret;
+}
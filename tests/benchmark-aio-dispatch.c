@@ -0,0 +1,79 @@
+/*
+ * AioContext fd dispatch speed benchmark
+ *
+ * Registers a growing number of idle event notifiers in an AioContext
+ * and measures how many wakeups per second aio_poll() can serve when a
+ * single one of them is ready.  Dispatch cost should not depend on the
+ * number of idle handlers.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "block/aio.h"
+#include "qapi/error.h"
+#include "qemu/main-loop.h"
+
+static AioContext *ctx;
+static uint64_t dispatched;
+
+static void ready_cb(EventNotifier *e)
+{
+    event_notifier_test_and_clear(e);
+    dispatched++;
+}
+
+static void test_dispatch_speed(const void *opaque)
+{
+    size_t n_handlers = (size_t)opaque;
+    EventNotifier *notifiers = g_new(EventNotifier, n_handlers);
+    uint64_t iterations = 0;
+    size_t i;
+
+    for (i = 0; i < n_handlers; i++) {
+        g_assert(event_notifier_init(&notifiers[i], false) == 0);
+        aio_set_event_notifier(ctx, &notifiers[i], false, ready_cb, NULL);
+    }
+    while (aio_poll(ctx, false)) {
+        /* nothing */
+    }
+
+    dispatched = 0;
+    g_test_timer_start();
+    do {
+        event_notifier_set(&notifiers[iterations % n_handlers]);
+        aio_poll(ctx, true);
+        iterations++;
+    } while (g_test_timer_elapsed() < 2.0);
+    g_assert_cmpint(dispatched, ==, iterations);
+
+    g_print("%zu handlers: %" PRIu64 " wakeups in %.2f secs: "
+            "%.0f wakeups/sec\n", n_handlers, iterations,
+            g_test_timer_last(), iterations / g_test_timer_last());
+
+    for (i = 0; i < n_handlers; i++) {
+        aio_set_event_notifier(ctx, &notifiers[i], false, NULL, NULL);
+        event_notifier_cleanup(&notifiers[i]);
+    }
+    g_free(notifiers);
+}
+
+int main(int argc, char **argv)
+{
+    size_t i;
+    char name[64];
+
+    qemu_init_main_loop(&error_fatal);
+    ctx = aio_context_new(&error_fatal);
+
+    g_test_init(&argc, &argv, NULL);
+
+    /* Above 64 handlers the AioContext switches from ppoll to epoll */
+    for (i = 4; i <= 512; i *= 2) {
+        snprintf(name, sizeof(name), "/aio/dispatch/speed-%zu", i);
+        g_test_add_data_func(name, (void *)i, test_dispatch_speed);
+    }
+
+    return g_test_run();
+}
@@ -0,0 +1,87 @@
+/*
+ * QEMUTimer churn benchmark
+ *
+ * Arms a growing number of timers in an AioContext, then repeatedly
+ * re-arms a random one of them and queries the next deadline, the way
+ * device models and the event loop do.  The cost of each operation
+ * should grow at most logarithmically with the number of armed timers.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "block/aio.h"
+#include "qapi/error.h"
+#include "qemu/main-loop.h"
+
+/* Deadlines are spread over the next ten seconds with 1 us granularity */
+#define TIMER_SPREAD_US (10 * 1000 * 1000)
+
+static AioContext *ctx;
+
+static void timer_cb(void *opaque)
+{
+    g_assert_not_reached();
+}
+
+static int64_t random_deadline(int64_t now)
+{
+    return now + NANOSECONDS_PER_SECOND +
+           (int64_t)g_random_int_range(0, TIMER_SPREAD_US) * SCALE_US;
+}
+
+static void test_timer_churn(const void *opaque)
+{
+    size_t n_timers = (size_t)opaque;
+    QEMUTimer **timers = g_new(QEMUTimer *, n_timers);
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    uint64_t iterations = 0;
+    size_t i;
+
+    for (i = 0; i < n_timers; i++) {
+        timers[i] = aio_timer_new(ctx, QEMU_CLOCK_REALTIME, SCALE_NS,
+                                  timer_cb, NULL);
+        timer_mod_ns(timers[i], random_deadline(now));
+    }
+
+    g_test_timer_start();
+    do {
+        QEMUTimer *ts = timers[g_random_int_range(0, n_timers)];
+
+        if (iterations & 1) {
+            timer_del(ts);
+        }
+        timer_mod_ns(ts, random_deadline(now));
+        g_assert_cmpint(timerlistgroup_deadline_ns(&ctx->tlg), >, 0);
+        iterations++;
+    } while (g_test_timer_elapsed() < 2.0);
+
+    g_print("%zu timers: %" PRIu64 " updates in %.2f secs: "
+            "%.0f updates/sec\n", n_timers, iterations,
+            g_test_timer_last(), iterations / g_test_timer_last());
+
+    for (i = 0; i < n_timers; i++) {
+        timer_del(timers[i]);
+        timer_free(timers[i]);
+    }
+    g_free(timers);
+}
+
+int main(int argc, char **argv)
+{
+    size_t i;
+    char name[64];
+
+    qemu_init_main_loop(&error_fatal);
+    ctx = aio_context_new(&error_fatal);
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 16; i <= 16384; i *= 4) {
+        snprintf(name, sizeof(name), "/timer/churn/speed-%zu", i);
+        g_test_add_data_func(name, (void *)i, test_timer_churn);
+    }
+
+    return g_test_run();
+}
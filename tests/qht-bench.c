@@ -9,8 +9,22 @@
 #include "qemu/atomic.h"
 #include "qemu/qht.h"
 #include "qemu/rcu.h"
+#include "qemu/timer.h"
 #include "exec/tb-hash-xx.h"
 
+/*
+ * Latency histogram: values below 2^LAT_SUB_BITS ns get a bucket each; above
+ * that, every power of two is split into 2^LAT_SUB_BITS buckets, which keeps
+ * the relative error of the reported percentiles under 1/2^LAT_SUB_BITS.
+ */
+#define LAT_SUB_BITS 4
+#define LAT_N_BUCKETS (64 << LAT_SUB_BITS)
+
+struct lat_hist {
+    uint64_t count[LAT_N_BUCKETS];
+    uint64_t max;
+};
+
 struct thread_stats {
     size_t rd;
     size_t not_rd;
@@ -20,6 +34,7 @@ struct thread_stats {
     size_t not_rm;
     size_t rz;
     size_t not_rz;
+    struct lat_hist in_lat;
 };
 
 struct thread_info {
@@ -65,6 +80,7 @@ static bool test_start;
 static bool test_stop;
 
 static struct thread_info *rw_info;
+static struct lat_hist populate_lat;
 
 static const char commands_string[] =
     " -d = duration, in seconds\n"
@@ -119,6 +135,92 @@ static uint64_t xorshift64star(uint64_t x)
     return x * UINT64_C(2685821657736338717);
 }
 
+static unsigned int lat_to_bucket(uint64_t ns)
+{
+    int shift;
+
+    if (ns < (1 << LAT_SUB_BITS)) {
+        return ns;
+    }
+    shift = 63 - clz64(ns) - LAT_SUB_BITS;
+    return ((shift + 1) << LAT_SUB_BITS) |
+           ((ns >> shift) & ((1 << LAT_SUB_BITS) - 1));
+}
+
+/* lower bound of the latencies counted in bucket @i */
+static uint64_t lat_from_bucket(unsigned int i)
+{
+    int shift;
+
+    if (i < (1 << LAT_SUB_BITS)) {
+        return i;
+    }
+    shift = (i >> LAT_SUB_BITS) - 1;
+    return (uint64_t)((1 << LAT_SUB_BITS) |
+                      (i & ((1 << LAT_SUB_BITS) - 1))) << shift;
+}
+
+static void lat_record(struct lat_hist *lat, uint64_t ns)
+{
+    lat->count[lat_to_bucket(ns)]++;
+    if (ns > lat->max) {
+        lat->max = ns;
+    }
+}
+
+static void lat_add(struct lat_hist *to, const struct lat_hist *from)
+{
+    int i;
+
+    for (i = 0; i < LAT_N_BUCKETS; i++) {
+        to->count[i] += from->count[i];
+    }
+    to->max = MAX(to->max, from->max);
+}
+
+static uint64_t lat_percentile(const struct lat_hist *lat, double pct)
+{
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t rank;
+    int i;
+
+    for (i = 0; i < LAT_N_BUCKETS; i++) {
+        total += lat->count[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    rank = MAX(1, total * pct / 100.0);
+    for (i = 0; i < LAT_N_BUCKETS; i++) {
+        sum += lat->count[i];
+        if (sum >= rank) {
+            return MIN(lat_from_bucket(i), lat->max);
+        }
+    }
+    return lat->max;
+}
+
+static void pr_lat(const char *name, const struct lat_hist *lat)
+{
+    printf(" %-19s p50 %" PRIu64 " ns, p99 %" PRIu64 " ns, max %" PRIu64
+           " ns\n", name, lat_percentile(lat, 50.0),
+           lat_percentile(lat, 99.0), lat->max);
+}
+
+/* insert @p, recording how long it took if it succeeds */
+static bool timed_insert(struct lat_hist *lat, long *p, uint32_t hash)
+{
+    int64_t t0 = get_clock();
+    bool ret;
+
+    ret = qht_insert(&ht, p, hash, NULL);
+    if (ret) {
+        lat_record(lat, get_clock() - t0);
+    }
+    return ret;
+}
+
 static void do_rz(struct thread_info *info)
 {
     struct thread_stats *stats = &info->stats;
@@ -163,7 +265,7 @@ static void do_rw(struct thread_info *info)
             bool written = false;
 
             if (qht_lookup(&ht, p, hash) == NULL) {
-                written = qht_insert(&ht, p, hash, NULL);
+                written = timed_insert(&stats->in_lat, p, hash);
             }
             if (written) {
                 stats->in++;
@@ -322,13 +424,14 @@ static void htable_init(void)
             r = xorshift64star(r);
             p = &keys[r & (init_range - 1)];
             hash = h(*p);
-            if (qht_insert(&ht, p, hash, NULL)) {
+            if (timed_insert(&populate_lat, p, hash)) {
                 break;
             }
             retries++;
         }
     }
     fprintf(stderr, " populated after %zu retries\n", retries);
+    pr_lat("Populate latency:", &populate_lat);
 }
 
 static void add_stats(struct thread_stats *s, struct thread_info *info, int n)
@@ -349,6 +452,8 @@ static void add_stats(struct thread_stats *s, struct thread_info *info, int n)
 
         s->rz += stats->rz;
         s->not_rz += stats->not_rz;
+
+        lat_add(&s->in_lat, &stats->in_lat);
     }
 }
 
@@ -375,6 +480,7 @@ static void pr_stats(void)
            (double)s.in / 1e6,
            (double)s.in / (s.in + s.not_in) * 100,
            (double)(s.in + s.not_in) / 1e6);
+    pr_lat("Insert latency:", &s.in_lat);
     printf(" Removed:           %.2f M (%.2f%% of %.2fM)\n",
            (double)s.rm / 1e6,
            (double)s.rm / (s.rm + s.not_rm) * 100,
@@ -383,6 +383,45 @@ static void test_flush_event_notifier(void)
     event_notifier_cleanup(&data.e);
 }
 
+static EventNotifierTestData remove_data[2];
+
+/* Both notifiers are ready at once; whichever runs first removes the other */
+static void remove_other_cb(EventNotifier *e)
+{
+    EventNotifierTestData *data = container_of(e, EventNotifierTestData, e);
+    EventNotifierTestData *other = &remove_data[data == &remove_data[0]];
+
+    event_ready_cb(e);
+    set_event_notifier(ctx, &other->e, NULL);
+}
+
+static void test_remove_ready_event_notifier(void)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        remove_data[i] = (EventNotifierTestData) { .n = 0, .active = 1 };
+        event_notifier_init(&remove_data[i].e, false);
+        set_event_notifier(ctx, &remove_data[i].e, remove_other_cb);
+    }
+    while (aio_poll(ctx, false));
+
+    event_notifier_set(&remove_data[0].e);
+    event_notifier_set(&remove_data[1].e);
+    g_assert(aio_poll(ctx, false));
+    g_assert_cmpint(remove_data[0].n + remove_data[1].n, ==, 1);
+
+    for (i = 0; i < 2; i++) {
+        set_event_notifier(ctx, &remove_data[i].e, NULL);
+    }
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(remove_data[0].n + remove_data[1].n, ==, 1);
+
+    for (i = 0; i < 2; i++) {
+        event_notifier_cleanup(&remove_data[i].e);
+    }
+}
+
 static void test_aio_external_client(void)
 {
     int i, j;
@@ -898,6 +937,7 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait",              test_wait_event_notifier);
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
+    g_test_add_func("/aio/event/remove-ready",      test_remove_ready_event_notifier);
     g_test_add_func("/aio/external-client",         test_aio_external_client);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
 
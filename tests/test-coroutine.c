@@ -264,6 +264,58 @@ static void test_co_mutex_lockable(void)
     g_assert(QEMU_MAKE_LOCKABLE(null_pointer) == NULL);
 }
 
+static CoQueue profile_queue;
+
+static void coroutine_fn queue_wait_fn(void *opaque)
+{
+    CoMutex *m = opaque;
+
+    qemu_co_mutex_lock(m);
+    qemu_co_queue_wait(&profile_queue, m);
+    qemu_co_mutex_unlock(m);
+    done++;
+}
+
+static void coroutine_fn queue_wake_fn(void *opaque)
+{
+    qemu_co_queue_restart_all(&profile_queue);
+}
+
+static void test_co_mutex_profile(void)
+{
+    CoMutex m;
+    FILE *f = tmpfile();
+    char buf[4096];
+    size_t len;
+
+    g_assert(f);
+    qemu_co_mutex_init(&m);
+    qemu_co_queue_init(&profile_queue);
+    qsp_enable();
+    do_test_co_mutex(mutex_fn, &m);
+    do_test_co_mutex(lockable_fn, QEMU_MAKE_LOCKABLE(&m));
+
+    /* the waiter takes the mutex again once the waker terminates */
+    done = 0;
+    qemu_coroutine_enter(qemu_coroutine_create(queue_wait_fn, &m));
+    qemu_coroutine_enter(qemu_coroutine_create(queue_wake_fn, NULL));
+    g_assert_cmpint(done, ==, 1);
+    qsp_disable();
+
+    qsp_report(f, fprintf, 10, QSP_SORT_BY_TOTAL_WAIT_TIME, false);
+    rewind(f);
+    len = fread(buf, 1, sizeof(buf) - 1, f);
+    buf[len] = '\0';
+    fclose(f);
+
+    /* waits are accounted to the call sites in this file */
+    g_assert(strstr(buf, "co_mutex"));
+    g_assert(strstr(buf, "co_queue"));
+    g_assert(strstr(buf, "test-coroutine.c:"));
+    /* lockable and relocking acquisitions are not profiled on their own */
+    g_assert(!strstr(buf, "coroutine.h"));
+}
+
 /*
  * Check that creation, enter, and return work
  */
@@ -430,6 +482,47 @@ static void perf_yield(void)
         maxcycles, duration);
 }
 
+/*
+ * Switch benchmark: enter a set of coroutines round-robin, the way the
+ * block layer interleaves requests, so that each switch lands on a stack
+ * other than the one that was just left.
+ */
+
+static void perf_switch(void)
+{
+    enum { N_COROUTINES = 64 };
+    Coroutine *coroutines[N_COROUTINES];
+    unsigned int counters[N_COROUTINES];
+    unsigned int i, maxcycles;
+    unsigned long switches = 0;
+    double duration;
+
+    maxcycles = 1000000;
+    for (i = 0; i < N_COROUTINES; i++) {
+        counters[i] = maxcycles;
+        coroutines[i] = qemu_coroutine_create(yield_loop, &counters[i]);
+    }
+
+    g_test_timer_start();
+    while (counters[N_COROUTINES - 1] > 0) {
+        for (i = 0; i < N_COROUTINES; i++) {
+            qemu_coroutine_enter(coroutines[i]);
+        }
+        switches += 2 * N_COROUTINES;
+    }
+    duration = g_test_timer_elapsed();
+
+    /* Let the coroutines terminate */
+    for (i = 0; i < N_COROUTINES; i++) {
+        qemu_coroutine_enter(coroutines[i]);
+    }
+
+    g_test_message("Switch %lu times between %u coroutines: %f s, "
+                   "%luns per switch",
+                   switches, N_COROUTINES, duration,
+                   (unsigned long)(1000000000.0 * duration / switches));
+}
+
 static __attribute__((noinline)) void dummy(unsigned *i)
 {
     (*i)--;
@@ -503,10 +596,12 @@ int main(int argc, char **argv)
     g_test_add_func("/basic/order", test_order);
     g_test_add_func("/locking/co-mutex", test_co_mutex);
     g_test_add_func("/locking/co-mutex/lockable", test_co_mutex_lockable);
+    g_test_add_func("/locking/co-mutex/profile", test_co_mutex_profile);
     if (g_test_perf()) {
         g_test_add_func("/perf/lifecycle", perf_lifecycle);
         g_test_add_func("/perf/nesting", perf_nesting);
         g_test_add_func("/perf/yield", perf_yield);
+        g_test_add_func("/perf/switch", perf_switch);
         g_test_add_func("/perf/function-call", perf_baseline);
         g_test_add_func("/perf/cost", perf_cost);
     }
@@ -937,6 +937,46 @@ static void test_hbitmap_iter_and_reset(TestHBitmapData *data,
     check_hbitmap_iter_next(&hbi);
 }
 
+/* Ranges that start, end or cover the groups of L2 * 8 bits that make up a
+ * single chunk of the last level, including a partial chunk at the end.
+ */
+static void test_hbitmap_chunks(TestHBitmapData *data, const void *unused)
+{
+    hbitmap_test_init(data, L2 * 28, 0);
+    hbitmap_test_set(data, 0, L2 * 28);
+    hbitmap_test_reset(data, L2 * 3, L1 * 3 + 5);
+    hbitmap_test_reset(data, L2 * 8, L2 * 8);
+    hbitmap_test_set(data, L2 * 9 + 7, L1);
+    hbitmap_test_reset(data, L2 * 16 - 1, L2 * 8 + 1);
+    hbitmap_test_set(data, L2 * 20, L2 * 8);
+    hbitmap_test_reset(data, 1, L2 * 28 - 2);
+    hbitmap_test_set(data, L2 * 8, L2 * 16);
+    hbitmap_test_reset_all(data);
+}
+
+static void test_hbitmap_merge(TestHBitmapData *data, const void *unused)
+{
+    HBitmap *b;
+
+    hbitmap_test_init(data, L2 * 28, 0);
+    hbitmap_test_set(data, L2 * 4, L1);
+    hbitmap_test_set(data, L2 * 16, L2 * 8);
+
+    b = hbitmap_alloc(L2 * 28, 0);
+    hbitmap_set(b, 0, L2 * 8);
+    hbitmap_set(b, L2 * 8 + 3, L1);
+    hbitmap_set(b, L2 * 17, 5);
+    hbitmap_set(b, L2 * 27, L2);
+    g_assert(hbitmap_merge(data->hb, b));
+    hbitmap_free(b);
+
+    bitmap_set(data->bits, 0, L2 * 8);
+    bitmap_set(data->bits, L2 * 8 + 3, L1);
+    bitmap_set(data->bits, L2 * 27, L2);
+    hbitmap_test_check(data, 0);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, L2 * 17 + L1);
+}
+
 static void test_hbitmap_next_zero_check(TestHBitmapData *data, int64_t start)
 {
     int64_t ret1 = hbitmap_next_zero(data->hb, start);
@@ -1012,6 +1052,8 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/reset/general", test_hbitmap_reset);
     hbitmap_test_add("/hbitmap/reset/all", test_hbitmap_reset_all);
     hbitmap_test_add("/hbitmap/granularity", test_hbitmap_granularity);
+    hbitmap_test_add("/hbitmap/chunks", test_hbitmap_chunks);
+    hbitmap_test_add("/hbitmap/merge", test_hbitmap_merge);
 
     hbitmap_test_add("/hbitmap/truncate/nop", test_hbitmap_truncate_nop);
     hbitmap_test_add("/hbitmap/truncate/grow/negligible",
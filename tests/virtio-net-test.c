@@ -52,17 +52,17 @@ static QVirtioPCIDevice *virtio_net_pci_init(QPCIBus *bus, int slot)
     return dev;
 }
 
-static QOSState *pci_test_start(int socket)
+static QOSState *pci_test_start(int socket, const char *opts)
 {
     QOSState *qs;
     const char *arch = qtest_get_arch();
     const char *cmd = "-netdev socket,fd=%d,id=hs0 -device "
-                      "virtio-net-pci,netdev=hs0";
+                      "virtio-net-pci,netdev=hs0%s";
 
     if (strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0) {
-        qs = qtest_pc_boot(cmd, socket);
+        qs = qtest_pc_boot(cmd, socket, opts);
     } else if (strcmp(arch, "ppc64") == 0) {
-        qs = qtest_spapr_boot(cmd, socket);
+        qs = qtest_spapr_boot(cmd, socket, opts);
     } else {
         g_printerr("virtio-net tests are only available on x86 or ppc64\n");
         exit(EXIT_FAILURE);
@@ -208,7 +208,151 @@ static void stop_cont_test(QVirtioDevice *dev,
     rx_stop_cont_test(dev, alloc, rvq, socket);
 }
 
-static void pci_basic(gconstpointer data)
+#define RSC_MSS 100
+
+static uint32_t rsc_csum_add(uint32_t sum, const uint8_t *p, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        sum += (i & 1) ? p[i] : p[i] << 8;
+    }
+    return sum;
+}
+
+static uint16_t rsc_csum_finish(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+/* Build an IPv4 TCP segment carrying @payload bytes, with an ACK only */
+static size_t rsc_build_frame(uint8_t *buf, uint32_t seq, size_t payload,
+                              bool corrupt)
+{
+    static const uint8_t eth[14] = {
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x56,     /* dst */
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x57,     /* src */
+        0x08, 0x00,
+    };
+    uint8_t *ip = buf + sizeof(eth);
+    uint8_t *tcp = ip + 20;
+    size_t l4_len = 20 + payload;
+    uint32_t sum;
+
+    memcpy(buf, eth, sizeof(eth));
+
+    memset(ip, 0, 20);
+    ip[0] = 0x45;
+    stw_be_p(ip + 2, 20 + l4_len);
+    stw_be_p(ip + 6, 0x4000);                   /* DF */
+    ip[8] = 64;                                 /* TTL */
+    ip[9] = 6;                                  /* TCP */
+    stl_be_p(ip + 12, 0x0a000001);
+    stl_be_p(ip + 16, 0x0a000002);
+    stw_be_p(ip + 10, rsc_csum_finish(rsc_csum_add(0, ip, 20)));
+
+    memset(tcp, 0, 20);
+    stw_be_p(tcp, 1234);
+    stw_be_p(tcp + 2, 5678);
+    stl_be_p(tcp + 4, seq);
+    stl_be_p(tcp + 8, 1);
+    stw_be_p(tcp + 12, (5 << 12) | 0x10);       /* ACK */
+    stw_be_p(tcp + 14, 1000);
+    memset(tcp + 20, 'a' + (seq & 15), payload);
+
+    sum = rsc_csum_add(0, ip + 12, 8) + 6 + l4_len;
+    stw_be_p(tcp + 16, rsc_csum_finish(rsc_csum_add(sum, tcp, l4_len)));
+
+    if (corrupt) {
+        tcp[20] ^= 0xff;
+    }
+    return sizeof(eth) + 20 + l4_len;
+}
+
+static void rsc_send_frame(int socket, uint8_t *buf, size_t size)
+{
+    uint32_t len = htonl(size);
+    struct iovec iov[] = {
+        {
+            .iov_base = &len,
+            .iov_len = sizeof(len),
+        }, {
+            .iov_base = buf,
+            .iov_len = size,
+        },
+    };
+    int ret;
+
+    ret = iov_send(socket, iov, 2, 0, sizeof(len) + size);
+    g_assert_cmpint(ret, ==, sizeof(len) + size);
+}
+
+/*
+ * Send a full and a short segment of one flow.  They are merged into one
+ * GSO packet only if both checksums are correct.
+ */
+static void rsc_test(QVirtioDevice *dev, QGuestAllocator *alloc,
+                     QVirtQueue *vq, int socket, bool corrupt)
+{
+    uint64_t req_addr[2];
+    uint32_t free_head[2];
+    uint8_t frame[2][256];
+    size_t size[2];
+    uint32_t len;
+    uint8_t hdr[2];
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        req_addr[i] = guest_alloc(alloc, 2048);
+        free_head[i] = qvirtqueue_add(vq, req_addr[i], 2048, true, false);
+    }
+    qvirtqueue_kick(dev, vq, free_head[0]);
+
+    size[0] = rsc_build_frame(frame[0], 1000, RSC_MSS, false);
+    size[1] = rsc_build_frame(frame[1], 1000 + RSC_MSS, RSC_MSS / 2,
+                              corrupt);
+    rsc_send_frame(socket, frame[0], size[0]);
+    rsc_send_frame(socket, frame[1], size[1]);
+
+    qvirtio_wait_used_elem(dev, vq, free_head[0], &len,
+                           QVIRTIO_NET_TIMEOUT_US);
+    memread(req_addr[0], hdr, sizeof(hdr));
+    if (corrupt) {
+        g_assert_cmpint(len, ==, VNET_HDR_SIZE + size[0]);
+        g_assert_cmpint(hdr[1], ==, VIRTIO_NET_HDR_GSO_NONE);
+
+        qvirtio_wait_used_elem(dev, vq, free_head[1], &len,
+                               QVIRTIO_NET_TIMEOUT_US);
+        g_assert_cmpint(len, ==, VNET_HDR_SIZE + size[1]);
+    } else {
+        g_assert_cmpint(len, ==, VNET_HDR_SIZE + size[0] + RSC_MSS / 2);
+        g_assert_cmpint(hdr[0], ==, VIRTIO_NET_HDR_F_NEEDS_CSUM);
+        g_assert_cmpint(hdr[1], ==, VIRTIO_NET_HDR_GSO_TCPV4);
+    }
+
+    for (i = 0; i < 2; i++) {
+        guest_free(alloc, req_addr[i]);
+    }
+}
+
+static void rsc_merge_test(QVirtioDevice *dev,
+                           QGuestAllocator *alloc, QVirtQueue *rvq,
+                           QVirtQueue *tvq, int socket)
+{
+    rsc_test(dev, alloc, rvq, socket, false);
+}
+
+static void rsc_bad_csum_test(QVirtioDevice *dev,
+                              QGuestAllocator *alloc, QVirtQueue *rvq,
+                              QVirtQueue *tvq, int socket)
+{
+    rsc_test(dev, alloc, rvq, socket, true);
+}
+
+static void pci_run(gconstpointer data, const char *opts)
 {
     QVirtioPCIDevice *dev;
     QOSState *qs;
@@ -223,7 +367,7 @@ static void pci_basic(gconstpointer data)
     ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sv);
     g_assert_cmpint(ret, !=, -1);
 
-    qs = pci_test_start(sv[1]);
+    qs = pci_test_start(sv[1], opts);
     dev = virtio_net_pci_init(qs->pcibus, PCI_SLOT);
 
     rx = (QVirtQueuePCI *)qvirtqueue_setup(&dev->vdev, qs->alloc, 0);
@@ -241,6 +385,16 @@ static void pci_basic(gconstpointer data)
     g_free(dev);
     qtest_shutdown(qs);
 }
+
+static void pci_basic(gconstpointer data)
+{
+    pci_run(data, "");
+}
+
+static void pci_rsc(gconstpointer data)
+{
+    pci_run(data, ",rsc=on");
+}
 #endif
 
 static void hotplug(void)
@@ -266,6 +420,9 @@ int main(int argc, char **argv)
     qtest_add_data_func("/virtio/net/pci/basic", send_recv_test, pci_basic);
     qtest_add_data_func("/virtio/net/pci/rx_stop_cont",
                         stop_cont_test, pci_basic);
+    qtest_add_data_func("/virtio/net/pci/rsc/merge", rsc_merge_test, pci_rsc);
+    qtest_add_data_func("/virtio/net/pci/rsc/bad_csum",
+                        rsc_bad_csum_test, pci_rsc);
 #endif
     qtest_add_func("/virtio/net/pci/hotplug", hotplug);
 
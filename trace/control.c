@@ -55,6 +55,9 @@ QemuOptsList qemu_trace_opts = {
         },{
             .name = "file",
             .type = QEMU_OPT_STRING,
+        },{
+            .name = "flight-recorder",
+            .type = QEMU_OPT_BOOL,
         },
         { /* end of list */ }
     },
@@ -322,6 +325,15 @@ char *trace_opt_parse(const char *optarg)
     }
     trace_init_events(qemu_opt_get(opts, "events"));
     trace_file = g_strdup(qemu_opt_get(opts, "file"));
+    if (qemu_opt_get_bool(opts, "flight-recorder", false)) {
+#ifdef CONFIG_TRACE_SIMPLE
+        st_set_flight_recorder(true);
+#else
+        fprintf(stderr, "error: -trace flight-recorder=on: "
+                "option not supported by the selected tracing backends\n");
+        exit(1);
+#endif
+    }
     qemu_opts_del(opts);
 
     return trace_file;
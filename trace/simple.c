@@ -13,6 +13,7 @@
 #include <pthread.h>
 #endif
 #include "qemu/timer.h"
+#include "qemu/queue.h"
 #include "trace/control.h"
 #include "trace/simple.h"
 #include "qemu/error-report.h"
@@ -29,9 +30,6 @@
 /** Records were dropped event ID */
 #define DROPPED_EVENT_ID (~(uint64_t)0 - 1)
 
-/** Trace record is valid */
-#define TRACE_RECORD_VALID ((uint64_t)1 << 63)
-
 /*
  * Trace records are written out by a dedicated thread.  The thread waits for
  * records to become available, writes them out, and then waits again.
@@ -43,21 +41,28 @@ static GCond trace_empty_cond;
 static bool trace_available;
 static bool trace_writeout_enabled;
 
+/*
+ * Each thread that emits trace events gets its own ring buffer, so that
+ * recording an event touches no shared cacheline.  The owner thread is the
+ * only writer of the records and of the head index, the writeout thread is
+ * the only reader.  Indices run freely and are masked on access.
+ *
+ * In flight recorder mode the owner thread overwrites its oldest records
+ * instead of dropping new ones, and only moves the tail index itself.  The
+ * writeout thread then only reads the buffers when asked to flush, and
+ * checks the tail index after copying a record to detect that the record
+ * was overwritten in the meantime.
+ */
 enum {
-    TRACE_BUF_LEN = 4096 * 64,
+    TRACE_BUF_LEN = 4096 * 16,
     TRACE_BUF_FLUSH_THRESHOLD = TRACE_BUF_LEN / 4,
 };
 
-uint8_t trace_buf[TRACE_BUF_LEN];
-static volatile gint trace_idx;
-static unsigned int writeout_idx;
-static volatile gint dropped_events;
-static uint32_t trace_pid;
-static FILE *trace_fp;
-static char *trace_file_name;
-
-#define TRACE_RECORD_TYPE_MAPPING 0
-#define TRACE_RECORD_TYPE_EVENT   1
+enum {
+    TRACE_BUF_ACTIVE,   /* in use by a running thread */
+    TRACE_BUF_EXITED,   /* the owner exited, records may still be pending */
+    TRACE_BUF_FREE,     /* may be reused by a new thread */
+};
 
 /* * Trace buffer entry */
 typedef struct {
@@ -68,62 +73,267 @@ typedef struct {
     uint64_t arguments[];
 } TraceRecord;
 
+/* The data keeps the fields written by each side on separate cachelines */
+typedef struct TraceBuffer {
+    /* Written by the owner thread */
+    unsigned int head;
+    int dropped;
+
+    uint8_t data[TRACE_BUF_LEN];
+
+    /* Written by the writeout thread, or the owner in flight recorder mode */
+    unsigned int tail;
+    int state;
+
+    /* Only accessed by the writeout thread */
+    unsigned int read;
+    unsigned int end;
+    TraceRecord *next;
+    size_t next_size;
+    bool has_next;
+
+    QSLIST_ENTRY(TraceBuffer) link;
+} TraceBuffer;
+
+/* Buffers are never freed, only reused once their owner thread has exited */
+static QSLIST_HEAD(, TraceBuffer) trace_buffers;
+static __thread TraceBuffer *thread_buf;
+static __thread bool thread_buf_busy;
+
+static void trace_buffer_exit(gpointer opaque);
+static GPrivate trace_buffer_key = G_PRIVATE_INIT(trace_buffer_exit);
+
+static bool flight_recorder;
+static int dropped_events;
+static uint32_t trace_pid;
+static FILE *trace_fp;
+static char *trace_file_name;
+
+#define TRACE_RECORD_TYPE_MAPPING 0
+#define TRACE_RECORD_TYPE_EVENT   1
+
 typedef struct {
     uint64_t header_event_id; /* HEADER_EVENT_ID */
     uint64_t header_magic;    /* HEADER_MAGIC    */
     uint64_t header_version;  /* HEADER_VERSION  */
 } TraceLogHeader;
 
+/*
+ * Records are timestamped with the host's cycle counter where it runs at a
+ * constant rate, which is much cheaper than clock_gettime().  The writeout
+ * thread converts the timestamps to nanoseconds by interpolating between
+ * (ticks, get_clock()) snapshots.  Each pass takes one at its start, once
+ * the records that it writes have been fixed, so those records all fall
+ * between the previous pass's snapshot and its own, and the conversion
+ * stays continuous from one pass to the next.
+ */
+#if defined(__x86_64__) || defined(__i386__) || defined(_ARCH_PPC)
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size);
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size);
+#ifdef CONFIG_CPUID_H
+#include "qemu/cpuid.h"
+#endif
 
-static void clear_buffer_range(unsigned int idx, size_t len)
+/* False if the cycle counter may change rate or stop, see trace_clock_init */
+static bool trace_clock_use_ticks;
+/* Snapshot taken by the previous writeout pass */
+static int64_t trace_clock_prev_ticks;
+static int64_t trace_clock_prev_ns;
+/* Snapshot taken by the current writeout pass */
+static int64_t trace_clock_cur_ticks;
+static int64_t trace_clock_cur_ns;
+static double trace_clock_ns_per_tick;
+
+static inline int64_t trace_clock(void)
 {
-    uint32_t num = 0;
-    while (num < len) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = 0;
-        num++;
+    if (likely(trace_clock_use_ticks)) {
+        return cpu_get_host_ticks();
+    }
+    return get_clock();
+}
+
+static bool trace_clock_ticks_constant(void)
+{
+#if defined(CONFIG_CPUID_H)
+    int a, b, c, d;
+
+    /* constant_tsc and nonstop_tsc */
+    if (__get_cpuid_max(0x80000000, NULL) >= 0x80000007) {
+        __cpuid(0x80000007, a, b, c, d);
+        return d & bit_INVTSC;
+    }
+    return false;
+#elif defined(_ARCH_PPC)
+    /* the timebase runs at a fixed frequency */
+    return true;
+#else
+    return false;
+#endif
+}
+
+static void trace_clock_init(void)
+{
+    trace_clock_use_ticks = trace_clock_ticks_constant();
+    if (trace_clock_use_ticks) {
+        trace_clock_cur_ns = get_clock();
+        trace_clock_cur_ticks = cpu_get_host_ticks();
     }
 }
+
+/*
+ * Take the current pass's snapshot.  Called at the start of a writeout
+ * pass, once the records that it writes have been fixed, so that none is
+ * newer than the snapshot.
+ */
+static void trace_clock_calibrate(void)
+{
+    int64_t ticks, ns;
+
+    if (!trace_clock_use_ticks) {
+        return;
+    }
+
+    ns = get_clock();
+    ticks = cpu_get_host_ticks();
+    trace_clock_prev_ticks = trace_clock_cur_ticks;
+    trace_clock_prev_ns = trace_clock_cur_ns;
+    if (ticks > trace_clock_prev_ticks && ns > trace_clock_prev_ns) {
+        trace_clock_ns_per_tick =
+            (double)(ns - trace_clock_prev_ns) /
+            (ticks - trace_clock_prev_ticks);
+        trace_clock_cur_ticks = ticks;
+        trace_clock_cur_ns = ns;
+    }
+}
+
+static uint64_t trace_clock_to_ns(int64_t ticks)
+{
+    if (!trace_clock_use_ticks) {
+        return ticks;
+    }
+    return trace_clock_prev_ns +
+        (int64_t)((ticks - trace_clock_prev_ticks) * trace_clock_ns_per_tick);
+}
+#else
+static inline int64_t trace_clock(void)
+{
+    return get_clock();
+}
+
+static void trace_clock_init(void)
+{
+}
+
+static void trace_clock_calibrate(void)
+{
+}
+
+static uint64_t trace_clock_to_ns(int64_t ticks)
+{
+    return ticks;
+}
+#endif
+
+static void read_from_buffer(TraceBuffer *tbuf, unsigned int idx,
+                             void *dataptr, size_t size)
+{
+    unsigned int off = idx & (TRACE_BUF_LEN - 1);
+    size_t first = MIN(size, TRACE_BUF_LEN - off);
+
+    memcpy(dataptr, &tbuf->data[off], first);
+    memcpy((uint8_t *)dataptr + first, tbuf->data, size - first);
+}
+
+static unsigned int write_to_buffer(TraceBuffer *tbuf, unsigned int idx,
+                                    const void *dataptr, size_t size)
+{
+    unsigned int off = idx & (TRACE_BUF_LEN - 1);
+    size_t first = MIN(size, TRACE_BUF_LEN - off);
+
+    memcpy(&tbuf->data[off], dataptr, first);
+    memcpy(tbuf->data, (const uint8_t *)dataptr + first, size - first);
+    return idx + size; /* most callers wants to know where to write next */
+}
+
 /**
- * Read a trace record from the trace buffer
+ * Copy the next record of a trace buffer to tbuf->next
  *
- * @idx         Trace buffer index
- * @record      Trace record to fill
+ * @tbuf        Trace buffer
  *
- * Returns false if the record is not valid.
+ * Returns false if all records up to tbuf->end have been written out.
  */
-static bool get_trace_record(unsigned int idx, TraceRecord **recordptr)
+static bool trace_buffer_peek(TraceBuffer *tbuf)
 {
-    uint64_t event_flag = 0;
     TraceRecord record;
-    /* read the event flag to see if its a valid record */
-    read_from_buffer(idx, &record, sizeof(event_flag));
+    unsigned int pos;
 
-    if (!(record.event & TRACE_RECORD_VALID)) {
-        return false;
+    for (;;) {
+        pos = flight_recorder ? tbuf->read : tbuf->tail;
+        if (flight_recorder) {
+            /* Skip what was overwritten since the last flush */
+            unsigned int tail = atomic_read(&tbuf->tail);
+
+            if ((int)(tail - pos) > 0) {
+                pos = tbuf->read = tail;
+            }
+        }
+        if ((int)(tbuf->end - pos) <= 0) {
+            tbuf->has_next = false;
+            return false;
+        }
+
+        read_from_buffer(tbuf, pos, &record, sizeof(record));
+        if (record.length >= sizeof(record) &&
+            record.length <= TRACE_BUF_LEN &&
+            record.length > tbuf->next_size) {
+            /* don't use g_realloc, can deadlock when traced */
+            TraceRecord *next = realloc(tbuf->next, record.length);
+
+            if (next) {
+                tbuf->next = next;
+                tbuf->next_size = record.length;
+            }
+        }
+        if (record.length >= sizeof(record) &&
+            record.length <= tbuf->next_size) {
+            read_from_buffer(tbuf, pos, tbuf->next, record.length);
+        }
+
+        if (!flight_recorder) {
+            break;
+        }
+        /* Retry if the owner reclaimed the record while we copied it */
+        smp_rmb();
+        if ((int)(atomic_read(&tbuf->tail) - pos) <= 0) {
+            break;
+        }
     }
 
-    smp_rmb(); /* read memory barrier before accessing record */
-    /* read the record header to know record length */
-    read_from_buffer(idx, &record, sizeof(TraceRecord));
-    *recordptr = malloc(record.length); /* don't use g_malloc, can deadlock when traced */
-    /* make a copy of record to avoid being overwritten */
-    read_from_buffer(idx, *recordptr, record.length);
-    smp_rmb(); /* memory barrier before clearing valid flag */
-    (*recordptr)->event &= ~TRACE_RECORD_VALID;
-    /* clear the trace buffer range for consumed record otherwise any byte
-     * with its MSB set may be considered as a valid event id when the writer
-     * thread crosses this range of buffer again.
-     */
-    clear_buffer_range(idx, record.length);
+    if (record.length < sizeof(record) || record.length > tbuf->next_size) {
+        /* Out of memory, or the buffer is corrupted; drop its contents */
+        atomic_inc(&dropped_events);
+        tbuf->read = tbuf->end;
+        if (!flight_recorder) {
+            atomic_store_release(&tbuf->tail, tbuf->end);
+        }
+        tbuf->has_next = false;
+        return false;
+    }
+    tbuf->has_next = true;
     return true;
 }
 
+/* Drop the record copied by trace_buffer_peek() and fetch the next one */
+static void trace_buffer_consume(TraceBuffer *tbuf)
+{
+    if (flight_recorder) {
+        tbuf->read += tbuf->next->length;
+    } else {
+        /* Let the owner reuse the space only once it has been read */
+        atomic_store_release(&tbuf->tail, tbuf->tail + tbuf->next->length);
+    }
+    trace_buffer_peek(tbuf);
+}
+
 /**
  * Kick writeout thread
  *
@@ -153,128 +363,214 @@ static void wait_for_trace_records_available(void)
     g_mutex_unlock(&trace_lock);
 }
 
-static gpointer writeout_thread(gpointer opaque)
+/*
+ * Write out the records that are in the per-thread buffers at this point,
+ * merged by timestamp.  Records of a single thread are already in order.
+ */
+static void writeout_records(void)
 {
-    TraceRecord *recordptr;
+    TraceBuffer *tbuf, *first, *min;
     union {
         TraceRecord rec;
         uint8_t bytes[sizeof(TraceRecord) + sizeof(uint64_t)];
     } dropped;
-    unsigned int idx = 0;
     int dropped_count;
     size_t unused __attribute__ ((unused));
     uint64_t type = TRACE_RECORD_TYPE_EVENT;
 
-    for (;;) {
-        wait_for_trace_records_available();
+    /* Buffers added after this point are picked up by the next pass */
+    first = atomic_rcu_read(&trace_buffers.slh_first);
+    dropped_count = atomic_xchg(&dropped_events, 0);
+    for (tbuf = first; tbuf; tbuf = QSLIST_NEXT(tbuf, link)) {
+        dropped_count += atomic_xchg(&tbuf->dropped, 0);
+        tbuf->end = atomic_load_acquire(&tbuf->head);
+        trace_buffer_peek(tbuf);
+    }
+
+    trace_clock_calibrate();
 
-        if (g_atomic_int_get(&dropped_events)) {
-            dropped.rec.event = DROPPED_EVENT_ID,
-            dropped.rec.timestamp_ns = get_clock();
-            dropped.rec.length = sizeof(TraceRecord) + sizeof(uint64_t),
-            dropped.rec.pid = trace_pid;
-            do {
-                dropped_count = g_atomic_int_get(&dropped_events);
-            } while (!g_atomic_int_compare_and_exchange(&dropped_events,
-                                                        dropped_count, 0));
-            dropped.rec.arguments[0] = dropped_count;
-            unused = fwrite(&type, sizeof(type), 1, trace_fp);
-            unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
+    if (dropped_count) {
+        dropped.rec.event = DROPPED_EVENT_ID,
+        dropped.rec.timestamp_ns = get_clock();
+        dropped.rec.length = sizeof(TraceRecord) + sizeof(uint64_t),
+        dropped.rec.pid = trace_pid;
+        dropped.rec.arguments[0] = dropped_count;
+        unused = fwrite(&type, sizeof(type), 1, trace_fp);
+        unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
+    }
+
+    for (;;) {
+        min = NULL;
+        for (tbuf = first; tbuf; tbuf = QSLIST_NEXT(tbuf, link)) {
+            if (tbuf->has_next &&
+                (!min || (int64_t)(tbuf->next->timestamp_ns -
+                                   min->next->timestamp_ns) < 0)) {
+                min = tbuf;
+            }
         }
+        if (!min) {
+            break;
+        }
+
+        tbuf = min;
+        tbuf->next->timestamp_ns = trace_clock_to_ns(tbuf->next->timestamp_ns);
+        unused = fwrite(&type, sizeof(type), 1, trace_fp);
+        unused = fwrite(tbuf->next, tbuf->next->length, 1, trace_fp);
+        trace_buffer_consume(tbuf);
+    }
 
-        while (get_trace_record(idx, &recordptr)) {
-            unused = fwrite(&type, sizeof(type), 1, trace_fp);
-            unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
-            writeout_idx += recordptr->length;
-            free(recordptr); /* don't use g_free, can deadlock when traced */
-            idx = writeout_idx % TRACE_BUF_LEN;
+    /* Buffers of exited threads can be reused once they are empty */
+    for (tbuf = first; tbuf; tbuf = QSLIST_NEXT(tbuf, link)) {
+        if (atomic_read(&tbuf->state) == TRACE_BUF_EXITED &&
+            !tbuf->has_next && tbuf->end == atomic_read(&tbuf->head)) {
+            atomic_cmpxchg(&tbuf->state, TRACE_BUF_EXITED, TRACE_BUF_FREE);
         }
+    }
+}
 
+static gpointer writeout_thread(gpointer opaque)
+{
+    for (;;) {
+        wait_for_trace_records_available();
+        writeout_records();
         fflush(trace_fp);
     }
     return NULL;
 }
 
+/* Called by glib when a thread that emitted trace events exits */
+static void trace_buffer_exit(gpointer opaque)
+{
+    TraceBuffer *tbuf = opaque;
+
+    thread_buf = NULL;
+    atomic_mb_set(&tbuf->state, TRACE_BUF_EXITED);
+}
+
+/* Returns the trace buffer of the calling thread, or NULL on failure */
+static TraceBuffer *trace_buffer_get(void)
+{
+    TraceBuffer *tbuf = thread_buf;
+
+    if (likely(tbuf)) {
+        return tbuf;
+    }
+
+    for (tbuf = atomic_rcu_read(&trace_buffers.slh_first); tbuf;
+         tbuf = atomic_rcu_read(&tbuf->link.sle_next)) {
+        /* In flight recorder mode, old records may be lost anyway */
+        if (atomic_cmpxchg(&tbuf->state, TRACE_BUF_FREE,
+                           TRACE_BUF_ACTIVE) == TRACE_BUF_FREE ||
+            (flight_recorder &&
+             atomic_cmpxchg(&tbuf->state, TRACE_BUF_EXITED,
+                            TRACE_BUF_ACTIVE) == TRACE_BUF_EXITED)) {
+            break;
+        }
+    }
+
+    if (!tbuf) {
+        /* don't use g_malloc, can deadlock when traced */
+        tbuf = calloc(1, sizeof(*tbuf));
+        if (!tbuf) {
+            return NULL;
+        }
+        tbuf->state = TRACE_BUF_ACTIVE;
+        QSLIST_INSERT_HEAD_ATOMIC(&trace_buffers, tbuf, link);
+    }
+
+    thread_buf = tbuf;
+    g_private_set(&trace_buffer_key, tbuf);
+    return tbuf;
+}
+
+/* Make room for @need bytes by discarding the oldest records */
+static void trace_buffer_discard(TraceBuffer *tbuf, unsigned int need)
+{
+    unsigned int tail = tbuf->tail;
+    unsigned int limit = tbuf->head + need - TRACE_BUF_LEN;
+    TraceRecord record;
+
+    while ((int)(limit - tail) > 0) {
+        read_from_buffer(tbuf, tail, &record, sizeof(record));
+        tail += record.length;
+    }
+    atomic_set(&tbuf->tail, tail);
+    smp_wmb(); /* the writeout thread must see the tail before new data */
+}
+
 void trace_record_write_u64(TraceBufferRecord *rec, uint64_t val)
 {
-    rec->rec_off = write_to_buffer(rec->rec_off, &val, sizeof(uint64_t));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off,
+                                   &val, sizeof(uint64_t));
 }
 
 void trace_record_write_str(TraceBufferRecord *rec, const char *s, uint32_t slen)
 {
     /* Write string length first */
-    rec->rec_off = write_to_buffer(rec->rec_off, &slen, sizeof(slen));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off,
+                                   &slen, sizeof(slen));
     /* Write actual string now */
-    rec->rec_off = write_to_buffer(rec->rec_off, (void*)s, slen);
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off, s, slen);
 }
 
 int trace_record_start(TraceBufferRecord *rec, uint32_t event, size_t datasize)
 {
-    unsigned int idx, rec_off, old_idx, new_idx;
+    TraceBuffer *tbuf;
+    TraceRecord record;
     uint32_t rec_len = sizeof(TraceRecord) + datasize;
-    uint64_t event_u64 = event;
-    uint64_t timestamp_ns = get_clock();
+    int64_t timestamp = trace_clock();
 
-    do {
-        old_idx = g_atomic_int_get(&trace_idx);
-        smp_rmb();
-        new_idx = old_idx + rec_len;
+    /* A signal handler may interrupt a thread in the middle of a record */
+    if (unlikely(thread_buf_busy || rec_len > TRACE_BUF_LEN)) {
+        atomic_inc(&dropped_events);
+        return -ENOSPC;
+    }
+    thread_buf_busy = true;
 
-        if (new_idx - writeout_idx > TRACE_BUF_LEN) {
+    tbuf = trace_buffer_get();
+    if (unlikely(!tbuf)) {
+        atomic_inc(&dropped_events);
+        thread_buf_busy = false;
+        return -ENOSPC;
+    }
+
+    if (tbuf->head + rec_len - atomic_load_acquire(&tbuf->tail) >
+        TRACE_BUF_LEN) {
+        if (!flight_recorder) {
             /* Trace Buffer Full, Event dropped ! */
-            g_atomic_int_inc(&dropped_events);
+            atomic_inc(&tbuf->dropped);
+            thread_buf_busy = false;
             return -ENOSPC;
         }
-    } while (!g_atomic_int_compare_and_exchange(&trace_idx, old_idx, new_idx));
-
-    idx = old_idx % TRACE_BUF_LEN;
+        trace_buffer_discard(tbuf, rec_len);
+    }
 
-    rec_off = idx;
-    rec_off = write_to_buffer(rec_off, &event_u64, sizeof(event_u64));
-    rec_off = write_to_buffer(rec_off, &timestamp_ns, sizeof(timestamp_ns));
-    rec_off = write_to_buffer(rec_off, &rec_len, sizeof(rec_len));
-    rec_off = write_to_buffer(rec_off, &trace_pid, sizeof(trace_pid));
+    record.event = event;
+    record.timestamp_ns = timestamp;
+    record.length = rec_len;
+    record.pid = trace_pid;
 
-    rec->tbuf_idx = idx;
-    rec->rec_off  = (idx + sizeof(TraceRecord)) % TRACE_BUF_LEN;
+    rec->tbuf = tbuf;
+    rec->tbuf_idx = tbuf->head;
+    rec->rec_off = write_to_buffer(tbuf, tbuf->head, &record, sizeof(record));
     return 0;
 }
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
-{
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        data_ptr[x++] = trace_buf[idx++];
-    }
-}
-
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size)
-{
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = data_ptr[x++];
-    }
-    return idx; /* most callers wants to know where to write next */
-}
-
 void trace_record_finish(TraceBufferRecord *rec)
 {
-    TraceRecord record;
-    read_from_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
-    smp_wmb(); /* write barrier before marking as valid */
-    record.event |= TRACE_RECORD_VALID;
-    write_to_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
+    TraceBuffer *tbuf = rec->tbuf;
+    unsigned int tail;
+
+    /* Publish the record to the writeout thread */
+    atomic_store_release(&tbuf->head, rec->rec_off);
+    thread_buf_busy = false;
 
-    if (((unsigned int)g_atomic_int_get(&trace_idx) - writeout_idx)
-        > TRACE_BUF_FLUSH_THRESHOLD) {
+    if (flight_recorder) {
+        return;
+    }
+    tail = atomic_read(&tbuf->tail);
+    if (rec->rec_off - tail > TRACE_BUF_FLUSH_THRESHOLD &&
+        rec->tbuf_idx - tail <= TRACE_BUF_FLUSH_THRESHOLD) {
         flush_trace_file(false);
     }
 }
@@ -374,6 +670,17 @@ void st_flush_trace_buffer(void)
     flush_trace_file(true);
 }
 
+/**
+ * Keep only the most recent records of each thread until the trace buffer
+ * is flushed, instead of writing them out as they come
+ *
+ * Must be called before st_init().
+ */
+void st_set_flight_recorder(bool enable)
+{
+    flight_recorder = enable;
+}
+
 /* Helper function to create a thread with signals blocked.  Use glib's
  * portable threads since QEMU abstractions cannot be used due to reentrancy in
  * the tracer.  Also note the signal masking on POSIX hosts so that the thread
@@ -403,6 +710,7 @@ bool st_init(void)
     GThread *thread;
 
     trace_pid = getpid();
+    trace_clock_init();
 
     thread = trace_thread_create(writeout_thread);
     if (!thread) {
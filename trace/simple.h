@@ -16,8 +16,10 @@ void st_set_trace_file_enabled(bool enable);
 void st_set_trace_file(const char *file);
 bool st_init(void);
 void st_flush_trace_buffer(void);
+void st_set_flight_recorder(bool enable);
 
 typedef struct {
+    struct TraceBuffer *tbuf;
     unsigned int tbuf_idx;
     unsigned int rec_off;
 } TraceBufferRecord;
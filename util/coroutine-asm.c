@@ -0,0 +1,335 @@
+/*
+ * Host assembly coroutine backend
+ *
+ * Copyright (C) 2006  Anthony Liguori <anthony@codemonkey.ws>
+ * Copyright (C) 2011  Kevin Wolf <kwolf@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/coroutine_int.h"
+
+#ifdef CONFIG_VALGRIND_H
+#include <valgrind/valgrind.h>
+#endif
+
+#if defined(__SANITIZE_ADDRESS__) || __has_feature(address_sanitizer)
+#ifdef CONFIG_ASAN_IFACE_FIBER
+#define CONFIG_ASAN 1
+#include <sanitizer/asan_interface.h>
+#endif
+#endif
+
+/*
+ * Switching coroutines only needs to save the callee-saved registers of
+ * the host ABI on the stack of the coroutine that is left, and restore
+ * them from the stack of the one that is entered.  Unlike sigsetjmp and
+ * siglongjmp this does not touch the signal mask, does not mangle
+ * pointers and does not go through the libc's fortified longjmp checks.
+ *
+ * Each coroutine's saved stack pointer points to a frame laid out as
+ * below; a new coroutine gets a fake frame that "returns" into
+ * qemu_coroutine_asm_start with the trampoline and its argument in
+ * callee-saved registers.
+ */
+typedef struct {
+    Coroutine base;
+    void *sp;
+    void *stack;
+    size_t stack_size;
+
+#ifdef CONFIG_VALGRIND_H
+    unsigned int valgrind_stack_id;
+#endif
+
+} CoroutineAsm;
+
+/*
+ * Save the callee-saved registers on the current stack, store the stack
+ * pointer in *from_sp, switch to to_sp, restore the registers saved
+ * there and return action to whoever called the switch on that stack.
+ */
+int qemu_coroutine_asm_switch(void **from_sp, void *to_sp, int action);
+void qemu_coroutine_asm_start(void);
+
+#if defined(__x86_64__) && defined(__ELF__)
+
+/*
+ * Frame: r15, r14, r13, r12, rbx, rbp, return address.
+ * A new coroutine starts with rbx = argument and r12 = function.
+ */
+enum {
+    ASM_FRAME_R12 = 3,
+    ASM_FRAME_RBX = 4,
+    ASM_FRAME_RBP = 5,
+    ASM_FRAME_PC = 6,
+    ASM_FRAME_WORDS = 7,
+};
+
+asm(".text\n"
+    ".globl qemu_coroutine_asm_switch\n"
+    ".hidden qemu_coroutine_asm_switch\n"
+    ".type qemu_coroutine_asm_switch, @function\n"
+    "qemu_coroutine_asm_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    movl %edx, %eax\n"
+    "    ret\n"
+    ".size qemu_coroutine_asm_switch, .-qemu_coroutine_asm_switch\n"
+    "\n"
+    ".globl qemu_coroutine_asm_start\n"
+    ".hidden qemu_coroutine_asm_start\n"
+    ".type qemu_coroutine_asm_start, @function\n"
+    "qemu_coroutine_asm_start:\n"
+    "    .cfi_startproc\n"
+    "    .cfi_undefined rip\n"
+    "    movq %rbx, %rdi\n"
+    "    call *%r12\n"
+    "    ud2\n"
+    "    .cfi_endproc\n"
+    ".size qemu_coroutine_asm_start, .-qemu_coroutine_asm_start\n");
+
+static void *coroutine_asm_init_frame(uintptr_t *top,
+                                      void (*fn)(void *), void *arg)
+{
+    /* After the final ret the stack must be 16-byte aligned for the call */
+    uintptr_t *frame = top - ASM_FRAME_WORDS;
+
+    memset(frame, 0, ASM_FRAME_WORDS * sizeof(uintptr_t));
+    frame[ASM_FRAME_R12] = (uintptr_t)fn;
+    frame[ASM_FRAME_RBX] = (uintptr_t)arg;
+    frame[ASM_FRAME_RBP] = 0;
+    frame[ASM_FRAME_PC] = (uintptr_t)qemu_coroutine_asm_start;
+    return frame;
+}
+
+#elif defined(__aarch64__) && defined(__ELF__)
+
+/*
+ * Frame: x19-x28, x29 (frame pointer), x30 (link register), d8-d15.
+ * A new coroutine starts with x19 = argument and x20 = function.
+ */
+enum {
+    ASM_FRAME_X19 = 0,
+    ASM_FRAME_X20 = 1,
+    ASM_FRAME_FP = 10,
+    ASM_FRAME_LR = 11,
+    ASM_FRAME_WORDS = 20,
+};
+
+asm(".text\n"
+    ".globl qemu_coroutine_asm_switch\n"
+    ".hidden qemu_coroutine_asm_switch\n"
+    ".type qemu_coroutine_asm_switch, %function\n"
+    "qemu_coroutine_asm_switch:\n"
+    "    sub sp, sp, #160\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mov x3, sp\n"
+    "    str x3, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    add sp, sp, #160\n"
+    "    mov w0, w2\n"
+    "    ret\n"
+    ".size qemu_coroutine_asm_switch, .-qemu_coroutine_asm_switch\n"
+    "\n"
+    ".globl qemu_coroutine_asm_start\n"
+    ".hidden qemu_coroutine_asm_start\n"
+    ".type qemu_coroutine_asm_start, %function\n"
+    "qemu_coroutine_asm_start:\n"
+    "    .cfi_startproc\n"
+    "    .cfi_undefined x30\n"
+    "    mov x0, x19\n"
+    "    blr x20\n"
+    "    brk #0\n"
+    "    .cfi_endproc\n"
+    ".size qemu_coroutine_asm_start, .-qemu_coroutine_asm_start\n");
+
+static void *coroutine_asm_init_frame(uintptr_t *top,
+                                      void (*fn)(void *), void *arg)
+{
+    uintptr_t *frame = top - ASM_FRAME_WORDS;
+
+    memset(frame, 0, ASM_FRAME_WORDS * sizeof(uintptr_t));
+    frame[ASM_FRAME_X19] = (uintptr_t)arg;
+    frame[ASM_FRAME_X20] = (uintptr_t)fn;
+    frame[ASM_FRAME_FP] = 0;
+    frame[ASM_FRAME_LR] = (uintptr_t)qemu_coroutine_asm_start;
+    return frame;
+}
+
+#else
+#error "the asm coroutine backend does not support this host"
+#endif
+
+/**
+ * Per-thread coroutine bookkeeping
+ */
+static __thread CoroutineAsm leader;
+static __thread Coroutine *current;
+
+static void finish_switch_fiber(void *fake_stack_save)
+{
+#ifdef CONFIG_ASAN
+    const void *bottom_old;
+    size_t size_old;
+
+    __sanitizer_finish_switch_fiber(fake_stack_save, &bottom_old, &size_old);
+
+    if (!leader.stack) {
+        leader.stack = (void *)bottom_old;
+        leader.stack_size = size_old;
+    }
+#endif
+}
+
+static void start_switch_fiber(void **fake_stack_save,
+                               const void *bottom, size_t size)
+{
+#ifdef CONFIG_ASAN
+    __sanitizer_start_switch_fiber(fake_stack_save, bottom, size);
+#endif
+}
+
+static void coroutine_trampoline(void *opaque)
+{
+    CoroutineAsm *self = opaque;
+    Coroutine *co = &self->base;
+
+    finish_switch_fiber(NULL);
+
+    while (true) {
+        co->entry(co->entry_arg);
+        qemu_coroutine_switch(co, co->caller, COROUTINE_TERMINATE);
+    }
+}
+
+Coroutine *qemu_coroutine_new(void)
+{
+    CoroutineAsm *co;
+    uintptr_t *top;
+
+    co = g_malloc0(sizeof(*co));
+    co->stack_size = COROUTINE_STACK_SIZE;
+    co->stack = qemu_alloc_stack(&co->stack_size);
+
+#ifdef CONFIG_VALGRIND_H
+    co->valgrind_stack_id =
+        VALGRIND_STACK_REGISTER(co->stack, co->stack + co->stack_size);
+#endif
+
+    /*
+     * Unlike ucontext, nothing needs to run on the new stack until the
+     * coroutine is first entered, so just build the initial frame.
+     */
+    top = QEMU_ALIGN_PTR_DOWN((uintptr_t *)(co->stack + co->stack_size), 16);
+    co->sp = coroutine_asm_init_frame(top, coroutine_trampoline, co);
+
+    return &co->base;
+}
+
+#ifdef CONFIG_VALGRIND_H
+#if defined(CONFIG_PRAGMA_DIAGNOSTIC_AVAILABLE) && !defined(__clang__)
+/* Work around an unused variable in the valgrind.h macro... */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-but-set-variable"
+#endif
+static inline void valgrind_stack_deregister(CoroutineAsm *co)
+{
+    VALGRIND_STACK_DEREGISTER(co->valgrind_stack_id);
+}
+#if defined(CONFIG_PRAGMA_DIAGNOSTIC_AVAILABLE) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+void qemu_coroutine_delete(Coroutine *co_)
+{
+    CoroutineAsm *co = DO_UPCAST(CoroutineAsm, base, co_);
+
+#ifdef CONFIG_VALGRIND_H
+    valgrind_stack_deregister(co);
+#endif
+
+    qemu_free_stack(co->stack, co->stack_size);
+    g_free(co);
+}
+
+/* This function is marked noinline for the same reason as in the ucontext
+ * backend: the switch may return in a different thread, so the address of
+ * the TLS variable "current" must not be cached across it by the caller.
+ */
+CoroutineAction __attribute__((noinline))
+qemu_coroutine_switch(Coroutine *from_, Coroutine *to_,
+                      CoroutineAction action)
+{
+    CoroutineAsm *from = DO_UPCAST(CoroutineAsm, base, from_);
+    CoroutineAsm *to = DO_UPCAST(CoroutineAsm, base, to_);
+    void *fake_stack_save = NULL;
+    int ret;
+
+    current = to_;
+
+    start_switch_fiber(action == COROUTINE_TERMINATE ?
+                       NULL : &fake_stack_save, to->stack, to->stack_size);
+    ret = qemu_coroutine_asm_switch(&from->sp, to->sp, action);
+    finish_switch_fiber(fake_stack_save);
+
+    return ret;
+}
+
+Coroutine *qemu_coroutine_self(void)
+{
+    if (!current) {
+        current = &leader.base;
+    }
+    return current;
+}
+
+bool qemu_in_coroutine(void)
+{
+    return current && current->caller;
+}
@@ -12,6 +12,7 @@
 #include "qemu/osdep.h"
 #include "qemu/hbitmap.h"
 #include "qemu/host-utils.h"
+#include "qemu/cutils.h"
 #include "trace.h"
 #include "crypto/hash.h"
 
@@ -50,8 +51,26 @@
  * extremely sparse, this is also O(m + m/W + m/W^2 + ...), so the amortized
  * cost of advancing from one bit to the next is usually constant (worst case
  * O(logB n) as in the non-amortized complexity).
+ *
+ * The last level, which is as large as all the others together times W,
+ * is not a single array.  It is split in chunks that each cover
+ * HBITMAP_CHUNK_LONGS words, i.e. 8 words of the 2nd-last level.  A chunk
+ * that has no bit set, or (unless it is only partially inside the bitmap)
+ * has every bit set, points to a shared read-only chunk; only the others
+ * are allocated, and they are copied on write.  Memory thus scales with
+ * the number of regions that are partially dirty, and not with the size
+ * of the bitmap: the levels above the last one are W times smaller.
  */
 
+#define HBITMAP_CHUNK_LOG_LONGS    (BITS_PER_LEVEL + 3)
+#define HBITMAP_CHUNK_LONGS        (1UL << HBITMAP_CHUNK_LOG_LONGS)
+#define HBITMAP_CHUNK_BITS         (HBITMAP_CHUNK_LONGS << BITS_PER_LEVEL)
+
+static const unsigned long hb_zero_chunk[HBITMAP_CHUNK_LONGS];
+static const unsigned long hb_ones_chunk[HBITMAP_CHUNK_LONGS] = {
+    [0 ... HBITMAP_CHUNK_LONGS - 1] = ~0UL
+};
+
 struct HBitmap {
     /* Number of total bits in the bottom level.  */
     uint64_t size;
@@ -88,14 +107,149 @@ struct HBitmap {
      * actual bitmap.
      *
      * Note that all bitmaps have the same number of levels.  Even a 1-bit
-     * bitmap will still allocate HBITMAP_LEVELS arrays.
+     * bitmap will still allocate HBITMAP_LEVELS arrays.  The last level is
+     * stored in @chunks instead of @levels.
+     */
+    unsigned long *levels[HBITMAP_LEVELS - 1];
+
+    /* The chunks of the last level.  Each is either hb_zero_chunk,
+     * hb_ones_chunk or an allocated array of hb_chunk_longs() words.
      */
-    unsigned long *levels[HBITMAP_LEVELS];
+    unsigned long **chunks;
+    uint64_t nr_chunks;
 
-    /* The length of each levels[] array. */
+    /* The length in words of each level. */
     uint64_t sizes[HBITMAP_LEVELS];
 };
 
+static inline bool hb_chunk_is_shared(const unsigned long *chunk)
+{
+    return chunk == hb_zero_chunk || chunk == hb_ones_chunk;
+}
+
+/* Number of words of the last level that chunk @c covers */
+static inline size_t hb_chunk_longs(const HBitmap *hb, uint64_t c)
+{
+    return MIN(HBITMAP_CHUNK_LONGS,
+               hb->sizes[HBITMAP_LEVELS - 1] - c * HBITMAP_CHUNK_LONGS);
+}
+
+/* Whether chunk @c may be represented by hb_ones_chunk */
+static inline bool hb_chunk_is_whole(const HBitmap *hb, uint64_t c)
+{
+    return (c + 1) * HBITMAP_CHUNK_BITS <= hb->size;
+}
+
+static inline unsigned long hb_last_word(const HBitmap *hb, uint64_t pos)
+{
+    return hb->chunks[pos >> HBITMAP_CHUNK_LOG_LONGS]
+                     [pos & (HBITMAP_CHUNK_LONGS - 1)];
+}
+
+static inline unsigned long hb_word(const HBitmap *hb, int level, uint64_t pos)
+{
+    if (level == HBITMAP_LEVELS - 1) {
+        return hb_last_word(hb, pos);
+    }
+    return hb->levels[level][pos];
+}
+
+static void hb_set_chunk(HBitmap *hb, uint64_t c, const unsigned long *chunk)
+{
+    if (!hb_chunk_is_shared(hb->chunks[c])) {
+        g_free(hb->chunks[c]);
+    }
+    hb->chunks[c] = (unsigned long *)chunk;
+}
+
+/* Return chunk @c, copying it first if it is shared */
+static unsigned long *hb_chunk_mut(HBitmap *hb, uint64_t c)
+{
+    unsigned long *chunk = hb->chunks[c];
+
+    if (hb_chunk_is_shared(chunk)) {
+        chunk = g_memdup(chunk, hb_chunk_longs(hb, c) * sizeof(unsigned long));
+        hb->chunks[c] = chunk;
+    }
+    return chunk;
+}
+
+/* Replace chunk @c with a shared chunk if its content allows it */
+static void hb_compress_chunk(HBitmap *hb, uint64_t c)
+{
+    unsigned long *chunk = hb->chunks[c];
+    size_t i, n = hb_chunk_longs(hb, c);
+
+    if (hb_chunk_is_shared(chunk)) {
+        return;
+    }
+    if (buffer_is_zero(chunk, n * sizeof(unsigned long))) {
+        hb_set_chunk(hb, c, hb_zero_chunk);
+        return;
+    }
+    if (!hb_chunk_is_whole(hb, c)) {
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        if (chunk[i] != ~0UL) {
+            return;
+        }
+    }
+    hb_set_chunk(hb, c, hb_ones_chunk);
+}
+
+/* Free chunk @c if the 2nd-last level says that it has no bit set */
+static void hb_drop_chunk_if_empty(HBitmap *hb, uint64_t c)
+{
+    const unsigned long *upper = hb->levels[HBITMAP_LEVELS - 2];
+    uint64_t i = c << (HBITMAP_CHUNK_LOG_LONGS - BITS_PER_LEVEL);
+    uint64_t end = MIN(i + (1 << (HBITMAP_CHUNK_LOG_LONGS - BITS_PER_LEVEL)),
+                       hb->sizes[HBITMAP_LEVELS - 2]);
+
+    if (hb_chunk_is_shared(hb->chunks[c])) {
+        return;
+    }
+    for (; i < end; i++) {
+        if (upper[i]) {
+            return;
+        }
+    }
+    hb_set_chunk(hb, c, hb_zero_chunk);
+}
+
+/* Resize the last level from @old_words to @words words */
+static void hb_resize_chunks(HBitmap *hb, uint64_t old_words, uint64_t words)
+{
+    uint64_t old_n = DIV_ROUND_UP(old_words, HBITMAP_CHUNK_LONGS);
+    uint64_t n = DIV_ROUND_UP(words, HBITMAP_CHUNK_LONGS);
+    uint64_t c;
+
+    for (c = n; c < old_n; c++) {
+        hb_set_chunk(hb, c, hb_zero_chunk);
+    }
+    hb->chunks = g_renew(unsigned long *, hb->chunks, n);
+    for (c = old_n; c < n; c++) {
+        hb->chunks[c] = (unsigned long *)hb_zero_chunk;
+    }
+    hb->nr_chunks = n;
+
+    /* An allocated chunk at the end only covers the words in the bitmap */
+    c = MIN(old_n, n) - 1;
+    if (old_n && !hb_chunk_is_shared(hb->chunks[c])) {
+        size_t old_len = MIN(HBITMAP_CHUNK_LONGS,
+                             old_words - c * HBITMAP_CHUNK_LONGS);
+        size_t len = MIN(HBITMAP_CHUNK_LONGS, words - c * HBITMAP_CHUNK_LONGS);
+
+        if (len != old_len) {
+            hb->chunks[c] = g_renew(unsigned long, hb->chunks[c], len);
+            if (len > old_len) {
+                memset(&hb->chunks[c][old_len], 0,
+                       (len - old_len) * sizeof(unsigned long));
+            }
+        }
+    }
+}
+
 /* Advance hbi to the next nonzero word and return it.  hbi->pos
  * is updated.  Returns zero if we reach the end of the bitmap.
  */
@@ -131,7 +285,7 @@ unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
         hbi->cur[i] = cur & (cur - 1);
 
         /* Set up next level for iteration.  */
-        cur = hb->levels[i + 1][pos];
+        cur = hb_word(hb, i + 1, pos);
     }
 
     hbi->pos = pos;
@@ -144,7 +298,7 @@ unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
 int64_t hbitmap_iter_next(HBitmapIter *hbi, bool advance)
 {
     unsigned long cur = hbi->cur[HBITMAP_LEVELS - 1] &
-            hbi->hb->levels[HBITMAP_LEVELS - 1][hbi->pos];
+            hb_last_word(hbi->hb, hbi->pos);
     int64_t item;
 
     if (cur == 0) {
@@ -181,7 +335,7 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
         pos >>= BITS_PER_LEVEL;
 
         /* Drop bits representing items before first.  */
-        hbi->cur[i] = hb->levels[i][pos] & ~((1UL << bit) - 1);
+        hbi->cur[i] = hb_word(hb, i, pos) & ~((1UL << bit) - 1);
 
         /* We have already added level i+1, so the lowest set bit has
          * been processed.  Clear it.
@@ -195,9 +349,8 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
 int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start)
 {
     size_t pos = (start >> hb->granularity) >> BITS_PER_LEVEL;
-    unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
     uint64_t sz = hb->sizes[HBITMAP_LEVELS - 1];
-    unsigned long cur = last_lev[pos];
+    unsigned long cur = hb_last_word(hb, pos);
     unsigned start_bit_offset =
             (start >> hb->granularity) & (BITS_PER_LONG - 1);
     int64_t res;
@@ -208,13 +361,21 @@ int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start)
     if (cur == (unsigned long)-1) {
         do {
             pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
+            if (!(pos & (HBITMAP_CHUNK_LONGS - 1))) {
+                /* Skip chunks that are entirely set */
+                while (pos < sz &&
+                       hb->chunks[pos >> HBITMAP_CHUNK_LOG_LONGS] ==
+                       hb_ones_chunk) {
+                    pos += HBITMAP_CHUNK_LONGS;
+                }
+            }
+        } while (pos < sz && hb_last_word(hb, pos) == (unsigned long)-1);
 
         if (pos >= sz) {
             return -1;
         }
 
-        cur = last_lev[pos];
+        cur = hb_last_word(hb, pos);
     }
 
     res = (pos << BITS_PER_LEVEL) + ctol(cur);
@@ -294,31 +455,71 @@ static inline bool hb_set_elem(unsigned long *elem, uint64_t start, uint64_t las
     return old != *elem;
 }
 
-/* The recursive workhorse (the depth is limited to HBITMAP_LEVELS)...
+/* Set bits start...last of the bitmap stored in @words.
  * Returns true if at least one bit is changed. */
-static bool hb_set_between(HBitmap *hb, int level, uint64_t start,
-                           uint64_t last)
+static bool hb_set_words(unsigned long *words, uint64_t start, uint64_t last)
 {
-    size_t pos = start >> BITS_PER_LEVEL;
+    size_t i = start >> BITS_PER_LEVEL;
     size_t lastpos = last >> BITS_PER_LEVEL;
     bool changed = false;
-    size_t i;
 
-    i = pos;
     if (i < lastpos) {
         uint64_t next = (start | (BITS_PER_LONG - 1)) + 1;
-        changed |= hb_set_elem(&hb->levels[level][i], start, next - 1);
+        changed |= hb_set_elem(&words[i], start, next - 1);
         for (;;) {
             start = next;
             next += BITS_PER_LONG;
             if (++i == lastpos) {
                 break;
             }
-            changed |= (hb->levels[level][i] == 0);
-            hb->levels[level][i] = ~0UL;
+            changed |= (words[i] == 0);
+            words[i] = ~0UL;
         }
     }
-    changed |= hb_set_elem(&hb->levels[level][i], start, last);
+    changed |= hb_set_elem(&words[i], start, last);
+    return changed;
+}
+
+/* Same as hb_set_words, for the chunked last level */
+static bool hb_set_last_level(HBitmap *hb, uint64_t start, uint64_t last)
+{
+    bool changed = false;
+
+    while (start <= last) {
+        uint64_t c = start / HBITMAP_CHUNK_BITS;
+        uint64_t base = c * HBITMAP_CHUNK_BITS;
+        uint64_t chunk_last = MIN(last, base + HBITMAP_CHUNK_BITS - 1);
+
+        if (hb->chunks[c] == hb_ones_chunk) {
+            /* Nothing to do */
+        } else if (start == base &&
+                   chunk_last == base + HBITMAP_CHUNK_BITS - 1) {
+            changed |= hb->chunks[c] == hb_zero_chunk ||
+                       hb_set_words(hb->chunks[c], 0, HBITMAP_CHUNK_BITS - 1);
+            hb_set_chunk(hb, c, hb_ones_chunk);
+        } else {
+            changed |= hb_set_words(hb_chunk_mut(hb, c),
+                                    start - base, chunk_last - base);
+        }
+        start = chunk_last + 1;
+    }
+    return changed;
+}
+
+/* The recursive workhorse (the depth is limited to HBITMAP_LEVELS)...
+ * Returns true if at least one bit is changed. */
+static bool hb_set_between(HBitmap *hb, int level, uint64_t start,
+                           uint64_t last)
+{
+    size_t pos = start >> BITS_PER_LEVEL;
+    size_t lastpos = last >> BITS_PER_LEVEL;
+    bool changed;
+
+    if (level == HBITMAP_LEVELS - 1) {
+        changed = hb_set_last_level(hb, start, last);
+    } else {
+        changed = hb_set_words(hb->levels[level], start, last);
+    }
 
     /* If there was any change in this layer, we may have to update
      * the one above.
@@ -368,55 +569,92 @@ static inline bool hb_reset_elem(unsigned long *elem, uint64_t start, uint64_t l
     return blanked;
 }
 
-/* The recursive workhorse (the depth is limited to HBITMAP_LEVELS)...
- * Returns true if at least one bit is changed. */
-static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
-                             uint64_t last)
+/* Reset bits start...last of the bitmap stored in @words.
+ * Returns true if at least one word became zero. */
+static bool hb_reset_words(unsigned long *words, uint64_t start,
+                           uint64_t last)
 {
-    size_t pos = start >> BITS_PER_LEVEL;
+    size_t i = start >> BITS_PER_LEVEL;
     size_t lastpos = last >> BITS_PER_LEVEL;
     bool changed = false;
-    size_t i;
 
-    i = pos;
     if (i < lastpos) {
         uint64_t next = (start | (BITS_PER_LONG - 1)) + 1;
 
-        /* Here we need a more complex test than when setting bits.  Even if
-         * something was changed, we must not blank bits in the upper level
-         * unless the lower-level word became entirely zero.  So, remove pos
-         * from the upper-level range if bits remain set.
-         */
-        if (hb_reset_elem(&hb->levels[level][i], start, next - 1)) {
-            changed = true;
-        } else {
-            pos++;
-        }
-
+        changed |= hb_reset_elem(&words[i], start, next - 1);
         for (;;) {
             start = next;
             next += BITS_PER_LONG;
             if (++i == lastpos) {
                 break;
             }
-            changed |= (hb->levels[level][i] != 0);
-            hb->levels[level][i] = 0UL;
+            changed |= (words[i] != 0);
+            words[i] = 0UL;
         }
     }
+    changed |= hb_reset_elem(&words[i], start, last);
+    return changed;
+}
 
-    /* Same as above, this time for lastpos.  */
-    if (hb_reset_elem(&hb->levels[level][i], start, last)) {
-        changed = true;
+/* Same as hb_reset_words, for the chunked last level */
+static bool hb_reset_last_level(HBitmap *hb, uint64_t start, uint64_t last)
+{
+    bool changed = false;
+
+    while (start <= last) {
+        uint64_t c = start / HBITMAP_CHUNK_BITS;
+        uint64_t base = c * HBITMAP_CHUNK_BITS;
+        uint64_t chunk_last = MIN(last, base + HBITMAP_CHUNK_BITS - 1);
+
+        if (hb->chunks[c] == hb_zero_chunk) {
+            /* Nothing to do */
+        } else if (start == base &&
+                   chunk_last == base + HBITMAP_CHUNK_BITS - 1) {
+            changed |= hb->chunks[c] == hb_ones_chunk ||
+                       hb_reset_words(hb->chunks[c], 0,
+                                      HBITMAP_CHUNK_BITS - 1);
+            hb_set_chunk(hb, c, hb_zero_chunk);
+        } else {
+            changed |= hb_reset_words(hb_chunk_mut(hb, c),
+                                      start - base, chunk_last - base);
+        }
+        start = chunk_last + 1;
+    }
+    return changed;
+}
+
+/* The recursive workhorse (the depth is limited to HBITMAP_LEVELS)...
+ * Returns true if at least one bit is changed. */
+static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
+                             uint64_t last)
+{
+    size_t pos = start >> BITS_PER_LEVEL;
+    size_t lastpos = last >> BITS_PER_LEVEL;
+    bool changed;
+
+    if (level == HBITMAP_LEVELS - 1) {
+        changed = hb_reset_last_level(hb, start, last);
     } else {
-        lastpos--;
+        changed = hb_reset_words(hb->levels[level], start, last);
     }
 
+    /* Even if something was changed, we must not blank bits in the upper
+     * level unless the lower-level word became entirely zero.  So, remove
+     * pos and lastpos from the upper-level range if bits remain set.
+     */
     if (level > 0 && changed) {
-        hb_reset_between(hb, level - 1, pos, lastpos);
+        if (hb_word(hb, level, pos)) {
+            pos++;
+        }
+        if (pos <= lastpos && hb_word(hb, level, lastpos)) {
+            lastpos--;
+        }
+        if (pos <= lastpos) {
+            hb_reset_between(hb, level - 1, pos, lastpos);
+        }
     }
 
     return changed;
-
 }
 
 void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
@@ -433,18 +671,26 @@ void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
     assert(last < hb->size);
 
     hb->count -= hb_count_between(hb, first, last);
-    if (hb_reset_between(hb, HBITMAP_LEVELS - 1, first, last) &&
-        hb->meta) {
-        hbitmap_set(hb->meta, start, count);
+    if (hb_reset_between(hb, HBITMAP_LEVELS - 1, first, last)) {
+        /* Chunks in the middle of the range were already dropped */
+        hb_drop_chunk_if_empty(hb, first / HBITMAP_CHUNK_BITS);
+        hb_drop_chunk_if_empty(hb, last / HBITMAP_CHUNK_BITS);
+        if (hb->meta) {
+            hbitmap_set(hb->meta, start, count);
+        }
     }
 }
 
 void hbitmap_reset_all(HBitmap *hb)
 {
     unsigned int i;
+    uint64_t c;
 
     /* Same as hbitmap_alloc() except for memset() instead of malloc() */
-    for (i = HBITMAP_LEVELS; --i >= 1; ) {
+    for (c = 0; c < hb->nr_chunks; c++) {
+        hb_set_chunk(hb, c, hb_zero_chunk);
+    }
+    for (i = HBITMAP_LEVELS - 1; --i >= 1; ) {
         memset(hb->levels[i], 0, hb->sizes[i] * sizeof(unsigned long));
     }
 
@@ -477,7 +723,7 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     unsigned long bit = 1UL << (pos & (BITS_PER_LONG - 1));
     assert(pos < hb->size);
 
-    return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
+    return (hb_last_word(hb, pos >> BITS_PER_LEVEL) & bit) != 0;
 }
 
 uint64_t hbitmap_serialization_align(const HBitmap *hb)
@@ -494,7 +740,7 @@ uint64_t hbitmap_serialization_align(const HBitmap *hb)
  */
 static void serialization_chunk(const HBitmap *hb,
                                 uint64_t start, uint64_t count,
-                                unsigned long **first_el, uint64_t *el_count)
+                                uint64_t *first_el, uint64_t *el_count)
 {
     uint64_t last = start + count - 1;
     uint64_t gran = hbitmap_serialization_align(hb);
@@ -508,7 +754,7 @@ static void serialization_chunk(const HBitmap *hb,
     start = (start >> hb->granularity) >> BITS_PER_LEVEL;
     last = (last >> hb->granularity) >> BITS_PER_LEVEL;
 
-    *first_el = &hb->levels[HBITMAP_LEVELS - 1][start];
+    *first_el = start;
     *el_count = last - start + 1;
 }
 
@@ -516,12 +762,12 @@ uint64_t hbitmap_serialization_size(const HBitmap *hb,
                                     uint64_t start, uint64_t count)
 {
     uint64_t el_count;
-    unsigned long *cur;
+    uint64_t pos;
 
     if (!count) {
         return 0;
     }
-    serialization_chunk(hb, start, count, &cur, &el_count);
+    serialization_chunk(hb, start, count, &pos, &el_count);
 
     return el_count * sizeof(unsigned long);
 }
@@ -530,21 +776,22 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
                             uint64_t start, uint64_t count)
 {
     uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t pos, end;
 
     if (!count) {
         return;
     }
-    serialization_chunk(hb, start, count, &cur, &el_count);
-    end = cur + el_count;
+    serialization_chunk(hb, start, count, &pos, &el_count);
+    end = pos + el_count;
 
-    while (cur != end) {
+    while (pos != end) {
+        unsigned long cur = hb_last_word(hb, pos);
         unsigned long el =
-            (BITS_PER_LONG == 32 ? cpu_to_le32(*cur) : cpu_to_le64(*cur));
+            (BITS_PER_LONG == 32 ? cpu_to_le32(cur) : cpu_to_le64(cur));
 
         memcpy(buf, &el, sizeof(el));
         buf += sizeof(el);
-        cur++;
+        pos++;
     }
 }
 
@@ -553,15 +800,19 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
                               bool finish)
 {
     uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t pos, end;
 
     if (!count) {
         return;
     }
-    serialization_chunk(hb, start, count, &cur, &el_count);
-    end = cur + el_count;
+    serialization_chunk(hb, start, count, &pos, &el_count);
+    end = pos + el_count;
+
+    while (pos != end) {
+        unsigned long *cur =
+            &hb_chunk_mut(hb, pos >> HBITMAP_CHUNK_LOG_LONGS)
+                [pos & (HBITMAP_CHUNK_LONGS - 1)];
 
-    while (cur != end) {
         memcpy(cur, buf, sizeof(*cur));
 
         if (BITS_PER_LONG == 32) {
@@ -571,25 +822,47 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
         }
 
         buf += sizeof(unsigned long);
-        cur++;
+        pos++;
     }
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
 }
 
+/* Fill el_count words of the last level, starting at pos, with @fill */
+static void hb_fill_words(HBitmap *hb, uint64_t pos, uint64_t el_count,
+                          unsigned long fill)
+{
+    const unsigned long *shared = fill ? hb_ones_chunk : hb_zero_chunk;
+    uint64_t end = pos + el_count;
+
+    while (pos < end) {
+        uint64_t c = pos >> HBITMAP_CHUNK_LOG_LONGS;
+        uint64_t base = c << HBITMAP_CHUNK_LOG_LONGS;
+        uint64_t n = MIN(end, base + HBITMAP_CHUNK_LONGS) - pos;
+
+        if (n == HBITMAP_CHUNK_LONGS && (!fill || hb_chunk_is_whole(hb, c))) {
+            hb_set_chunk(hb, c, shared);
+        } else if (hb->chunks[c] != shared) {
+            memset(&hb_chunk_mut(hb, c)[pos - base], fill ? 0xff : 0,
+                   n * sizeof(unsigned long));
+        }
+        pos += n;
+    }
+}
+
 void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
                                 bool finish)
 {
     uint64_t el_count;
-    unsigned long *first;
+    uint64_t first;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0, el_count * sizeof(unsigned long));
+    hb_fill_words(hb, first, el_count, 0);
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -599,14 +872,14 @@ void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
                               bool finish)
 {
     uint64_t el_count;
-    unsigned long *first;
+    uint64_t first;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0xff, el_count * sizeof(unsigned long));
+    hb_fill_words(hb, first, el_count, ~0UL);
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -615,8 +888,14 @@ void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
 void hbitmap_deserialize_finish(HBitmap *bitmap)
 {
     int64_t i, size, prev_size;
+    uint64_t c;
     int lev;
 
+    /* share the chunks that deserialization filled with zeroes or ones */
+    for (c = 0; c < bitmap->nr_chunks; c++) {
+        hb_compress_chunk(bitmap, c);
+    }
+
     /* restore levels starting from penultimate to zero level, assuming
      * that the last level is ok */
     size = MAX((bitmap->size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
@@ -626,7 +905,7 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
         memset(bitmap->levels[lev], 0, size * sizeof(unsigned long));
 
         for (i = 0; i < prev_size; ++i) {
-            if (bitmap->levels[lev + 1][i]) {
+            if (hb_word(bitmap, lev + 1, i)) {
                 bitmap->levels[lev][i >> BITS_PER_LEVEL] |=
                     1UL << (i & (BITS_PER_LONG - 1));
             }
@@ -640,8 +919,14 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
 void hbitmap_free(HBitmap *hb)
 {
     unsigned i;
+    uint64_t c;
+
     assert(!hb->meta);
-    for (i = HBITMAP_LEVELS; i-- > 0; ) {
+    for (c = 0; c < hb->nr_chunks; c++) {
+        hb_set_chunk(hb, c, hb_zero_chunk);
+    }
+    g_free(hb->chunks);
+    for (i = HBITMAP_LEVELS - 1; i-- > 0; ) {
         g_free(hb->levels[i]);
     }
     g_free(hb);
@@ -661,7 +946,11 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
         hb->sizes[i] = size;
-        hb->levels[i] = g_new0(unsigned long, size);
+        if (i == HBITMAP_LEVELS - 1) {
+            hb_resize_chunks(hb, 0, size);
+        } else {
+            hb->levels[i] = g_new0(unsigned long, size);
+        }
     }
 
     /* We necessarily have free bits in level 0 due to the definition
@@ -712,6 +1001,10 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
         }
         old = hb->sizes[i];
         hb->sizes[i] = size;
+        if (i == HBITMAP_LEVELS - 1) {
+            hb_resize_chunks(hb, old, size);
+            continue;
+        }
         hb->levels[i] = g_realloc(hb->levels[i], size * sizeof(unsigned long));
         if (!shrink) {
             memset(&hb->levels[i][old], 0x00,
@@ -734,7 +1027,7 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
 bool hbitmap_merge(HBitmap *a, const HBitmap *b)
 {
     int i;
-    uint64_t j;
+    uint64_t j, c;
 
     if ((a->size != b->size) || (a->granularity != b->granularity)) {
         return false;
@@ -744,15 +1037,32 @@ bool hbitmap_merge(HBitmap *a, const HBitmap *b)
         return true;
     }
 
-    /* This merge is O(size), as BITS_PER_LONG and HBITMAP_LEVELS are constant.
-     * It may be possible to improve running times for sparsely populated maps
-     * by using hbitmap_iter_next, but this is suboptimal for dense maps.
+    /* Only the chunks of the last level that are partially set in B need
+     * to be merged word by word; the upper levels are small.
      */
-    for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
+    for (c = 0; c < a->nr_chunks; c++) {
+        const unsigned long *src = b->chunks[c];
+        unsigned long *dst;
+        size_t n;
+
+        if (src == hb_zero_chunk || a->chunks[c] == hb_ones_chunk) {
+            continue;
+        }
+        if (src == hb_ones_chunk) {
+            hb_set_chunk(a, c, hb_ones_chunk);
+            continue;
+        }
+        dst = hb_chunk_mut(a, c);
+        for (n = hb_chunk_longs(a, c); n-- > 0; ) {
+            dst[n] |= src[n];
+        }
+    }
+    for (i = HBITMAP_LEVELS - 2; i >= 0; i--) {
         for (j = 0; j < a->sizes[i]; j++) {
             a->levels[i][j] |= b->levels[i][j];
         }
     }
+    a->count = hb_count_between(a, 0, a->size - 1);
 
     return true;
 }
@@ -775,10 +1085,18 @@ void hbitmap_free_meta(HBitmap *hb)
 
 char *hbitmap_sha256(const HBitmap *bitmap, Error **errp)
 {
-    size_t size = bitmap->sizes[HBITMAP_LEVELS - 1] * sizeof(unsigned long);
-    char *data = (char *)bitmap->levels[HBITMAP_LEVELS - 1];
+    struct iovec *iov = g_new(struct iovec, bitmap->nr_chunks);
     char *hash = NULL;
-    qcrypto_hash_digest(QCRYPTO_HASH_ALG_SHA256, data, size, &hash, errp);
+    uint64_t c;
+
+    /* Same digest as if the last level were a single array */
+    for (c = 0; c < bitmap->nr_chunks; c++) {
+        iov[c].iov_base = bitmap->chunks[c];
+        iov[c].iov_len = hb_chunk_longs(bitmap, c) * sizeof(unsigned long);
+    }
+    qcrypto_hash_digestv(QCRYPTO_HASH_ALG_SHA256, iov, bitmap->nr_chunks,
+                         &hash, errp);
+    g_free(iov);
 
     return hash;
 }
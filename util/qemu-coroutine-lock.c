@@ -40,7 +40,8 @@ void qemu_co_queue_init(CoQueue *queue)
     QSIMPLEQ_INIT(&queue->entries);
 }
 
-void coroutine_fn qemu_co_queue_wait_impl(CoQueue *queue, QemuLockable *lock)
+void coroutine_fn qemu_co_queue_wait_impl(CoQueue *queue, QemuLockable *lock,
+                                          const char *file, int line)
 {
     Coroutine *self = qemu_coroutine_self();
     QSIMPLEQ_INSERT_TAIL(&queue->entries, self, co_queue_next);
@@ -236,7 +237,8 @@ static void coroutine_fn qemu_co_mutex_lock_slowpath(AioContext *ctx,
     trace_qemu_co_mutex_lock_return(mutex, self);
 }
 
-void coroutine_fn qemu_co_mutex_lock(CoMutex *mutex)
+void coroutine_fn qemu_co_mutex_lock_impl(CoMutex *mutex,
+                                          const char *file, int line)
 {
     AioContext *ctx = qemu_get_current_aio_context();
     Coroutine *self = qemu_coroutine_self();
@@ -338,14 +340,14 @@ void qemu_co_rwlock_init(CoRwlock *lock)
     qemu_co_mutex_init(&lock->mutex);
 }
 
-void qemu_co_rwlock_rdlock(CoRwlock *lock)
+void qemu_co_rwlock_rdlock_impl(CoRwlock *lock, const char *file, int line)
 {
     Coroutine *self = qemu_coroutine_self();
 
-    qemu_co_mutex_lock(&lock->mutex);
+    qemu_co_mutex_lock__raw(&lock->mutex);
     /* For fairness, wait if a writer is in line.  */
     while (lock->pending_writer) {
-        qemu_co_queue_wait(&lock->queue, &lock->mutex);
+        qemu_co_queue_wait__raw(&lock->queue, &lock->mutex);
     }
     lock->reader++;
     qemu_co_mutex_unlock(&lock->mutex);
@@ -365,7 +367,7 @@ void qemu_co_rwlock_unlock(CoRwlock *lock)
     } else {
         self->locks_held--;
 
-        qemu_co_mutex_lock(&lock->mutex);
+        qemu_co_mutex_lock__raw(&lock->mutex);
         lock->reader--;
         assert(lock->reader >= 0);
         /* Wakeup only one waiting writer */
@@ -391,12 +393,12 @@ void qemu_co_rwlock_downgrade(CoRwlock *lock)
     self->locks_held++;
 }
 
-void qemu_co_rwlock_wrlock(CoRwlock *lock)
+void qemu_co_rwlock_wrlock_impl(CoRwlock *lock, const char *file, int line)
 {
-    qemu_co_mutex_lock(&lock->mutex);
+    qemu_co_mutex_lock__raw(&lock->mutex);
     lock->pending_writer++;
     while (lock->reader) {
-        qemu_co_queue_wait(&lock->queue, &lock->mutex);
+        qemu_co_queue_wait__raw(&lock->queue, &lock->mutex);
     }
     lock->pending_writer--;
 
@@ -406,16 +408,16 @@ void qemu_co_rwlock_wrlock(CoRwlock *lock)
      */
 }
 
-void qemu_co_rwlock_upgrade(CoRwlock *lock)
+void qemu_co_rwlock_upgrade_impl(CoRwlock *lock, const char *file, int line)
 {
     Coroutine *self = qemu_coroutine_self();
 
-    qemu_co_mutex_lock(&lock->mutex);
+    qemu_co_mutex_lock__raw(&lock->mutex);
     assert(lock->reader > 0);
     lock->reader--;
     lock->pending_writer++;
     while (lock->reader) {
-        qemu_co_queue_wait(&lock->queue, &lock->mutex);
+        qemu_co_queue_wait__raw(&lock->queue, &lock->mutex);
     }
     lock->pending_writer--;
 
@@ -68,7 +68,16 @@ static QEMUClock qemu_clocks[QEMU_CLOCK_MAX];
 struct QEMUTimerList {
     QEMUClock *clock;
     QemuMutex active_timers_lock;
-    QEMUTimer *active_timers;
+
+    /* Binary min-heap of the pending timers, soonest first.  The array
+     * is only accessed with active_timers_lock taken; nr_active_timers
+     * can be read without it to check for an empty list.
+     */
+    QEMUTimer **active_timers;
+    int nr_active_timers;
+    int active_timers_size;
+    uint64_t heap_seq;
+
     QLIST_ENTRY(QEMUTimerList) list;
     QEMUTimerListNotifyCB *notify_cb;
     void *notify_opaque;
@@ -119,6 +128,7 @@ void timerlist_free(QEMUTimerList *timer_list)
         QLIST_REMOVE(timer_list, list);
     }
     qemu_mutex_destroy(&timer_list->active_timers_lock);
+    g_free(timer_list->active_timers);
     g_free(timer_list);
 }
 
@@ -175,7 +185,7 @@ void qemu_clock_enable(QEMUClockType type, bool enabled)
 
 bool timerlist_has_timers(QEMUTimerList *timer_list)
 {
-    return !!atomic_read(&timer_list->active_timers);
+    return !!atomic_read(&timer_list->nr_active_timers);
 }
 
 bool qemu_clock_has_timers(QEMUClockType type)
@@ -188,16 +198,16 @@ bool timerlist_expired(QEMUTimerList *timer_list)
 {
     int64_t expire_time;
 
-    if (!atomic_read(&timer_list->active_timers)) {
+    if (!atomic_read(&timer_list->nr_active_timers)) {
         return false;
     }
 
     qemu_mutex_lock(&timer_list->active_timers_lock);
-    if (!timer_list->active_timers) {
+    if (!timer_list->nr_active_timers) {
         qemu_mutex_unlock(&timer_list->active_timers_lock);
         return false;
     }
-    expire_time = timer_list->active_timers->expire_time;
+    expire_time = timer_list->active_timers[0]->expire_time;
     qemu_mutex_unlock(&timer_list->active_timers_lock);
 
     return expire_time <= qemu_clock_get_ns(timer_list->clock->type);
@@ -219,7 +229,7 @@ int64_t timerlist_deadline_ns(QEMUTimerList *timer_list)
     int64_t delta;
     int64_t expire_time;
 
-    if (!atomic_read(&timer_list->active_timers)) {
+    if (!atomic_read(&timer_list->nr_active_timers)) {
         return -1;
     }
 
@@ -232,11 +242,11 @@ int64_t timerlist_deadline_ns(QEMUTimerList *timer_list)
      * the caller should notice the change and there is no race condition.
      */
     qemu_mutex_lock(&timer_list->active_timers_lock);
-    if (!timer_list->active_timers) {
+    if (!timer_list->nr_active_timers) {
         qemu_mutex_unlock(&timer_list->active_timers_lock);
         return -1;
     }
-    expire_time = timer_list->active_timers->expire_time;
+    expire_time = timer_list->active_timers[0]->expire_time;
     qemu_mutex_unlock(&timer_list->active_timers_lock);
 
     delta = expire_time - qemu_clock_get_ns(timer_list->clock->type);
@@ -348,6 +358,7 @@ void timer_init_tl(QEMUTimer *ts,
     ts->opaque = opaque;
     ts->scale = scale;
     ts->expire_time = -1;
+    ts->heap_index = -1;
 }
 
 void timer_deinit(QEMUTimer *ts)
@@ -356,43 +367,124 @@ void timer_deinit(QEMUTimer *ts)
     ts->timer_list = NULL;
 }
 
-static void timer_del_locked(QEMUTimerList *timer_list, QEMUTimer *ts)
+static inline bool timer_before(QEMUTimer *a, QEMUTimer *b)
 {
-    QEMUTimer **pt, *t;
+    return a->expire_time < b->expire_time ||
+           (a->expire_time == b->expire_time && a->heap_seq < b->heap_seq);
+}
 
-    ts->expire_time = -1;
-    pt = &timer_list->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            atomic_set(pt, t->next);
+static inline void timer_heap_set(QEMUTimerList *timer_list, int i,
+                                  QEMUTimer *ts)
+{
+    timer_list->active_timers[i] = ts;
+    ts->heap_index = i;
+}
+
+static void timer_heap_sift_up(QEMUTimerList *timer_list, int i)
+{
+    QEMUTimer *ts = timer_list->active_timers[i];
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+
+        if (!timer_before(ts, timer_list->active_timers[parent])) {
             break;
         }
-        pt = &t->next;
+        timer_heap_set(timer_list, i, timer_list->active_timers[parent]);
+        i = parent;
     }
+    timer_heap_set(timer_list, i, ts);
 }
 
-static bool timer_mod_ns_locked(QEMUTimerList *timer_list,
-                                QEMUTimer *ts, int64_t expire_time)
+static void timer_heap_sift_down(QEMUTimerList *timer_list, int i)
 {
-    QEMUTimer **pt, *t;
+    QEMUTimer **heap = timer_list->active_timers;
+    QEMUTimer *ts = heap[i];
+    int n = timer_list->nr_active_timers;
 
-    /* add the timer in the sorted list */
-    pt = &timer_list->active_timers;
     for (;;) {
-        t = *pt;
-        if (!timer_expired_ns(t, expire_time)) {
+        int child = 2 * i + 1;
+
+        if (child >= n) {
+            break;
+        }
+        if (child + 1 < n && timer_before(heap[child + 1], heap[child])) {
+            child++;
+        }
+        if (!timer_before(heap[child], ts)) {
             break;
         }
-        pt = &t->next;
+        timer_heap_set(timer_list, i, heap[child]);
+        i = child;
     }
+    timer_heap_set(timer_list, i, ts);
+}
+
+/* Move heap element i after its key changed */
+static void timer_heap_update(QEMUTimerList *timer_list, int i)
+{
+    if (i > 0 && timer_before(timer_list->active_timers[i],
+                              timer_list->active_timers[(i - 1) / 2])) {
+        timer_heap_sift_up(timer_list, i);
+    } else {
+        timer_heap_sift_down(timer_list, i);
+    }
+}
+
+static bool timer_heap_contains(QEMUTimerList *timer_list, QEMUTimer *ts)
+{
+    int i = ts->heap_index;
+
+    return i >= 0 && i < timer_list->nr_active_timers &&
+           timer_list->active_timers[i] == ts;
+}
+
+static void timer_heap_remove(QEMUTimerList *timer_list, QEMUTimer *ts)
+{
+    int i = ts->heap_index;
+    int last = timer_list->nr_active_timers - 1;
+
+    atomic_set(&timer_list->nr_active_timers, last);
+    ts->heap_index = -1;
+    if (i != last) {
+        timer_heap_set(timer_list, i, timer_list->active_timers[last]);
+        timer_heap_update(timer_list, i);
+    }
+}
+
+static void timer_del_locked(QEMUTimerList *timer_list, QEMUTimer *ts)
+{
+    ts->expire_time = -1;
+    if (timer_heap_contains(timer_list, ts)) {
+        timer_heap_remove(timer_list, ts);
+    }
+}
+
+/* Returns true if ts is now the first timer to expire */
+static bool timer_mod_ns_locked(QEMUTimerList *timer_list,
+                                QEMUTimer *ts, int64_t expire_time)
+{
+    int n = timer_list->nr_active_timers;
+
     ts->expire_time = MAX(expire_time, 0);
-    ts->next = *pt;
-    atomic_set(pt, ts);
+    /* Timers with the same expire_time fire in the order they were set */
+    ts->heap_seq = timer_list->heap_seq++;
+
+    if (timer_heap_contains(timer_list, ts)) {
+        timer_heap_update(timer_list, ts->heap_index);
+    } else {
+        if (n == timer_list->active_timers_size) {
+            timer_list->active_timers_size = MAX(16, n * 2);
+            timer_list->active_timers =
+                g_renew(QEMUTimer *, timer_list->active_timers,
+                        timer_list->active_timers_size);
+        }
+        timer_heap_set(timer_list, n, ts);
+        atomic_set(&timer_list->nr_active_timers, n + 1);
+        timer_heap_sift_up(timer_list, n);
+    }
 
-    return pt == &timer_list->active_timers;
+    return ts->heap_index == 0;
 }
 
 static void timerlist_rearm(QEMUTimerList *timer_list)
@@ -424,7 +516,6 @@ void timer_mod_ns(QEMUTimer *ts, int64_t expire_time)
     bool rearm;
 
     qemu_mutex_lock(&timer_list->active_timers_lock);
-    timer_del_locked(timer_list, ts);
     rearm = timer_mod_ns_locked(timer_list, ts, expire_time);
     qemu_mutex_unlock(&timer_list->active_timers_lock);
 
@@ -443,9 +534,6 @@ void timer_mod_anticipate_ns(QEMUTimer *ts, int64_t expire_time)
 
     qemu_mutex_lock(&timer_list->active_timers_lock);
     if (ts->expire_time == -1 || ts->expire_time > expire_time) {
-        if (ts->expire_time != -1) {
-            timer_del_locked(timer_list, ts);
-        }
         rearm = timer_mod_ns_locked(timer_list, ts, expire_time);
     } else {
         rearm = false;
@@ -485,7 +573,7 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
     QEMUTimerCB *cb;
     void *opaque;
 
-    if (!atomic_read(&timer_list->active_timers)) {
+    if (!atomic_read(&timer_list->nr_active_timers)) {
         return false;
     }
 
@@ -518,15 +606,15 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
     current_time = qemu_clock_get_ns(timer_list->clock->type);
     for(;;) {
         qemu_mutex_lock(&timer_list->active_timers_lock);
-        ts = timer_list->active_timers;
+        ts = timer_list->nr_active_timers ? timer_list->active_timers[0]
+                                          : NULL;
         if (!timer_expired_ns(ts, current_time)) {
             qemu_mutex_unlock(&timer_list->active_timers_lock);
             break;
         }
 
         /* remove timer from the list before calling the callback */
-        timer_list->active_timers = ts->next;
-        ts->next = NULL;
+        timer_heap_remove(timer_list, ts);
         ts->expire_time = -1;
         cb = ts->cb;
         opaque = ts->opaque;
@@ -22,8 +22,8 @@
  * - Writes (i.e. insertions/removals) can be concurrent with writes to
  *   different buckets; writes to the same bucket are serialized through a lock.
  * - Optional auto-resizing: the hash table resizes up if the load surpasses
- *   a certain threshold. Resizing is done concurrently with readers; writes
- *   are serialized with the resize operation.
+ *   a certain threshold. Resizing is done concurrently with readers and
+ *   writers; see below.
  *
  * The key structure is the bucket, which is cacheline-sized. Buckets
  * contain a few hash values and pointers; the u32 hash values are stored in
@@ -43,14 +43,28 @@
  * just-removed entry. This makes lookups slightly faster, since the moment an
  * invalid entry is found, the (failed) lookup is over.
  *
- * Resizing is done by taking all bucket spinlocks (so that no other writers can
- * race with us) and then copying all entries into a new hash map. Then, the
- * ht->map pointer is set, and the old map is freed once no RCU readers can see
- * it anymore.
+ * Resizing is incremental. A resize links the old map and the new one through
+ * old->resize_to and new->resize_from, and sets ht->map to the new map. Head
+ * buckets of the old map are then migrated one at a time: under the old head
+ * bucket's lock, its entries are inserted into the new map and then cleared
+ * from the old bucket, and the bucket is marked as migrated in old->migrated.
+ * Once all buckets are migrated, new->resize_from is cleared and the old map
+ * is freed once no RCU readers can see it anymore.
  *
- * Writers check for concurrent resizes by comparing ht->map before and after
- * acquiring their bucket lock. If they don't match, a resize has occured
- * while the bucket spinlock was being acquired.
+ * Writers never write to a new map's bucket before the old bucket holding the
+ * same hashes has been migrated. Before writing, they migrate that bucket
+ * themselves, plus a few more to make sure the resize completes; the cost of
+ * a resize is thus spread over many insertions. Writers that get hold of a
+ * bucket that was migrated since they read ht->map follow map->resize_to.
+ *
+ * Lookups look in the old map's bucket first, and then in the new map's.
+ * Since entries are inserted into the new map before being removed from the
+ * old one, this cannot miss an entry that is being migrated. Lookups that
+ * read ht->map before a resize started also follow map->resize_to when they
+ * do not find an entry.
+ *
+ * Only one resize can be in progress at a time. Iterators and explicit
+ * resizes complete the migration before they proceed.
  *
  * Related Work:
  * - Idea of cacheline-sized buckets with full hashes taken from:
@@ -68,6 +82,7 @@
 #include "qemu/osdep.h"
 #include "qemu/qht.h"
 #include "qemu/atomic.h"
+#include "qemu/bitmap.h"
 #include "qemu/rcu.h"
 
 //#define QHT_DEBUG
@@ -146,6 +161,12 @@ QEMU_BUILD_BUG_ON(sizeof(struct qht_bucket) > QHT_BUCKET_ALIGN);
  * @n_added_buckets: number of added (i.e. "non-head") buckets
  * @n_added_buckets_threshold: threshold to trigger an upward resize once the
  *                             number of added buckets surpasses it.
+ * @resize_from: map whose entries are being migrated to this one, or NULL.
+ * @resize_to: map this one's entries are being migrated to, or NULL.
+ * @migrated: bitmap of the head buckets that have been migrated to
+ *            @resize_to. Allocated when the resize starts.
+ * @migrate_next: next head bucket to be migrated by a writer
+ * @n_migrated: number of head buckets migrated by writers
  *
  * Buckets are tracked in what we call a "map", i.e. this structure.
  */
@@ -155,14 +176,22 @@ struct qht_map {
     size_t n_buckets;
     size_t n_added_buckets;
     size_t n_added_buckets_threshold;
+    struct qht_map *resize_from;
+    struct qht_map *resize_to;
+    unsigned long *migrated;
+    size_t migrate_next;
+    size_t n_migrated;
 };
 
 /* trigger a resize when n_added_buckets > n_buckets / div */
 #define QHT_NR_ADDED_BUCKETS_THRESHOLD_DIV 8
 
-static void qht_do_resize_reset(struct qht *ht, struct qht_map *new,
-                                bool reset);
+/* number of head buckets a writer migrates, besides its own, during a resize */
+#define QHT_MIGRATE_BATCH 4
+
 static void qht_grow_maybe(struct qht *ht);
+static void qht_map_resize_begin__locked(struct qht *ht, struct qht_map *new);
+static void qht_map_resize_finish__locked(struct qht *ht);
 
 #ifdef QHT_DEBUG
 
@@ -252,76 +281,15 @@ static void qht_map_unlock_buckets(struct qht_map *map)
 }
 
 /*
- * Call with at least a bucket lock held.
- * @map should be the value read before acquiring the lock (or locks).
- */
-static inline bool qht_map_is_stale__locked(struct qht *ht, struct qht_map *map)
-{
-    return map != ht->map;
-}
-
-/*
- * Grab all bucket locks, and set @pmap after making sure the map isn't stale.
- *
- * Pairs with qht_map_unlock_buckets(), hence the pass-by-reference.
- *
- * Note: callers cannot have ht->lock held.
+ * Whether head bucket @idx of @map has been migrated to map->resize_to.
+ * Once set, this does not change; it is set with the bucket's lock held.
  */
-static inline
-void qht_map_lock_buckets__no_stale(struct qht *ht, struct qht_map **pmap)
+static inline bool qht_map_bucket_is_migrated(struct qht_map *map, size_t idx)
 {
-    struct qht_map *map;
+    unsigned long *migrated = atomic_rcu_read(&map->migrated);
 
-    map = atomic_rcu_read(&ht->map);
-    qht_map_lock_buckets(map);
-    if (likely(!qht_map_is_stale__locked(ht, map))) {
-        *pmap = map;
-        return;
-    }
-    qht_map_unlock_buckets(map);
-
-    /* we raced with a resize; acquire ht->lock to see the updated ht->map */
-    qht_lock(ht);
-    map = ht->map;
-    qht_map_lock_buckets(map);
-    qht_unlock(ht);
-    *pmap = map;
-    return;
-}
-
-/*
- * Get a head bucket and lock it, making sure its parent map is not stale.
- * @pmap is filled with a pointer to the bucket's parent map.
- *
- * Unlock with qemu_spin_unlock(&b->lock).
- *
- * Note: callers cannot have ht->lock held.
- */
-static inline
-struct qht_bucket *qht_bucket_lock__no_stale(struct qht *ht, uint32_t hash,
-                                             struct qht_map **pmap)
-{
-    struct qht_bucket *b;
-    struct qht_map *map;
-
-    map = atomic_rcu_read(&ht->map);
-    b = qht_map_to_bucket(map, hash);
-
-    qemu_spin_lock(&b->lock);
-    if (likely(!qht_map_is_stale__locked(ht, map))) {
-        *pmap = map;
-        return b;
-    }
-    qemu_spin_unlock(&b->lock);
-
-    /* we raced with a resize; acquire ht->lock to see the updated ht->map */
-    qht_lock(ht);
-    map = ht->map;
-    b = qht_map_to_bucket(map, hash);
-    qemu_spin_lock(&b->lock);
-    qht_unlock(ht);
-    *pmap = map;
-    return b;
+    return migrated &&
+           (atomic_read(&migrated[BIT_WORD(idx)]) & BIT_MASK(idx));
 }
 
 static inline bool qht_map_needs_resize(struct qht_map *map)
@@ -350,6 +318,7 @@ static void qht_map_destroy(struct qht_map *map)
         qht_chain_destroy(&map->buckets[i]);
     }
     qemu_vfree(map->buckets);
+    g_free(map->migrated);
     g_free(map);
 }
 
@@ -358,7 +327,7 @@ static struct qht_map *qht_map_create(size_t n_buckets)
     struct qht_map *map;
     size_t i;
 
-    map = g_malloc(sizeof(*map));
+    map = g_malloc0(sizeof(*map));
     map->n_buckets = n_buckets;
 
     map->n_added_buckets = 0;
@@ -395,6 +364,9 @@ void qht_init(struct qht *ht, qht_cmp_func_t cmp, size_t n_elems,
 /* call only when there are no readers/writers left */
 void qht_destroy(struct qht *ht)
 {
+    if (ht->map->resize_from) {
+        qht_map_destroy(ht->map->resize_from);
+    }
     qht_map_destroy(ht->map);
     memset(ht, 0, sizeof(*ht));
 }
@@ -434,19 +406,13 @@ void qht_reset(struct qht *ht)
 {
     struct qht_map *map;
 
-    qht_map_lock_buckets__no_stale(ht, &map);
+    qht_lock(ht);
+    qht_map_resize_finish__locked(ht);
+    map = ht->map;
+    qht_map_lock_buckets(map);
     qht_map_reset__all_locked(map);
     qht_map_unlock_buckets(map);
-}
-
-static inline void qht_do_resize(struct qht *ht, struct qht_map *new)
-{
-    qht_do_resize_reset(ht, new, false);
-}
-
-static inline void qht_do_resize_and_reset(struct qht *ht, struct qht_map *new)
-{
-    qht_do_resize_reset(ht, new, true);
+    qht_unlock(ht);
 }
 
 bool qht_reset_size(struct qht *ht, size_t n_elems)
@@ -458,11 +424,17 @@ bool qht_reset_size(struct qht *ht, size_t n_elems)
     n_buckets = qht_elems_to_buckets(n_elems);
 
     qht_lock(ht);
+    qht_map_resize_finish__locked(ht);
     map = ht->map;
+    qht_map_lock_buckets(map);
+    qht_map_reset__all_locked(map);
+    qht_map_unlock_buckets(map);
     if (n_buckets != map->n_buckets) {
+        /* the old map is empty, so there is little to migrate */
         new = qht_map_create(n_buckets);
+        qht_map_resize_begin__locked(ht, new);
+        qht_map_resize_finish__locked(ht);
     }
-    qht_do_resize_and_reset(ht, new);
     qht_unlock(ht);
 
     return !!new;
@@ -509,15 +481,14 @@ void *qht_lookup__slowpath(struct qht_bucket *b, qht_lookup_func_t func,
     return ret;
 }
 
-void *qht_lookup_custom(struct qht *ht, const void *userp, uint32_t hash,
-                        qht_lookup_func_t func)
+static inline
+void *qht_map_lookup(struct qht_map *map, const void *userp, uint32_t hash,
+                     qht_lookup_func_t func)
 {
     struct qht_bucket *b;
-    struct qht_map *map;
     unsigned int version;
     void *ret;
 
-    map = atomic_rcu_read(&ht->map);
     b = qht_map_to_bucket(map, hash);
 
     version = seqlock_read_begin(&b->sequence);
@@ -532,6 +503,39 @@ void *qht_lookup_custom(struct qht *ht, const void *userp, uint32_t hash,
     return qht_lookup__slowpath(b, func, userp, hash);
 }
 
+void *qht_lookup_custom(struct qht *ht, const void *userp, uint32_t hash,
+                        qht_lookup_func_t func)
+{
+    struct qht_map *map, *old;
+    void *ret;
+
+    map = atomic_rcu_read(&ht->map);
+    old = atomic_rcu_read(&map->resize_from);
+    if (unlikely(old)) {
+        /* look in the old map first: entries get there first while migrating */
+        ret = qht_map_lookup(old, userp, hash, func);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    for (;;) {
+        ret = qht_map_lookup(map, userp, hash, func);
+        if (likely(ret)) {
+            return ret;
+        }
+        /*
+         * The entry may have been migrated to a map that was created after
+         * we read ht->map.  Check resize_to after the bucket's contents.
+         */
+        smp_rmb();
+        map = atomic_rcu_read(&map->resize_to);
+        if (likely(!map)) {
+            return NULL;
+        }
+    }
+}
+
 void *qht_lookup(struct qht *ht, const void *userp, uint32_t hash)
 {
     return qht_lookup_custom(ht, userp, hash, ht->cmp);
@@ -584,6 +588,169 @@ static void *qht_insert__locked(struct qht *ht, struct qht_map *map,
     return NULL;
 }
 
+/*
+ * Move the entries of @old's head bucket @idx to old->resize_to.
+ * Returns true if the bucket was migrated by this call.
+ *
+ * Call without bucket locks held. Locks are taken in old-to-new order.
+ */
+static bool qht_map_migrate_bucket(struct qht *ht, struct qht_map *old,
+                                   size_t idx)
+{
+    struct qht_map *new = old->resize_to;
+    struct qht_bucket *head = &old->buckets[idx];
+    struct qht_bucket *b = head;
+    int i;
+
+    if (qht_map_bucket_is_migrated(old, idx)) {
+        return false;
+    }
+    qemu_spin_lock(&head->lock);
+    if (qht_map_bucket_is_migrated(old, idx)) {
+        qemu_spin_unlock(&head->lock);
+        return false;
+    }
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            struct qht_bucket *nb;
+
+            if (b->pointers[i] == NULL) {
+                goto done;
+            }
+            nb = qht_map_to_bucket(new, b->hashes[i]);
+            qemu_spin_lock(&nb->lock);
+            qht_insert__locked(ht, new, nb, b->pointers[i], b->hashes[i],
+                               NULL);
+            qht_bucket_debug__locked(nb);
+            qemu_spin_unlock(&nb->lock);
+        }
+        b = b->next;
+    } while (b);
+ done:
+    /* lookups find the entries in the new map before they leave this one */
+    qht_bucket_reset__locked(head);
+    set_bit_atomic(idx, old->migrated);
+    qemu_spin_unlock(&head->lock);
+    return true;
+}
+
+/*
+ * Start migrating the entries of ht->map to @new.
+ * Call with ht->lock held and no resize in progress.
+ */
+static void qht_map_resize_begin__locked(struct qht *ht, struct qht_map *new)
+{
+    struct qht_map *old = ht->map;
+
+    g_assert(!old->resize_from);
+    g_assert(new->n_buckets != old->n_buckets);
+
+    atomic_rcu_set(&old->migrated, bitmap_new(old->n_buckets));
+    new->resize_from = old;
+    atomic_rcu_set(&old->resize_to, new);
+    atomic_rcu_set(&ht->map, new);
+}
+
+/*
+ * Free @old if it is still the map being migrated from.
+ * Call with ht->lock held, once all of @old's buckets have been migrated.
+ */
+static void qht_map_resize_end__locked(struct qht *ht, struct qht_map *old)
+{
+    struct qht_map *map = ht->map;
+
+    if (map->resize_from != old) {
+        return;
+    }
+    atomic_set(&map->resize_from, NULL);
+    call_rcu(old, qht_map_destroy, rcu);
+}
+
+/*
+ * Migrate whatever is left of an ongoing resize, if any.
+ * Call with ht->lock held.
+ */
+static void qht_map_resize_finish__locked(struct qht *ht)
+{
+    struct qht_map *old = ht->map->resize_from;
+    size_t i;
+
+    if (old == NULL) {
+        return;
+    }
+    for (i = 0; i < old->n_buckets; i++) {
+        qht_map_migrate_bucket(ht, old, i);
+    }
+    qht_map_resize_end__locked(ht, old);
+}
+
+/*
+ * Migrate the bucket of @old that holds @hash, plus a few others, so that
+ * the resize completes after a bounded number of writes.
+ */
+static __attribute__((noinline))
+void qht_map_migrate_some(struct qht *ht, struct qht_map *old, uint32_t hash)
+{
+    size_t n = 0;
+    int i;
+
+    n += qht_map_migrate_bucket(ht, old, hash & (old->n_buckets - 1));
+    for (i = 0; i < QHT_MIGRATE_BATCH; i++) {
+        size_t idx = atomic_fetch_inc(&old->migrate_next);
+
+        if (idx >= old->n_buckets) {
+            break;
+        }
+        n += qht_map_migrate_bucket(ht, old, idx);
+    }
+
+    if (n && atomic_add_fetch(&old->n_migrated, n) == old->n_buckets) {
+        qht_lock(ht);
+        qht_map_resize_end__locked(ht, old);
+        qht_unlock(ht);
+    }
+}
+
+/*
+ * Get a head bucket and lock it, making sure that it is the bucket where
+ * entries of @hash live: its map must not have migrated it elsewhere, and
+ * any older map must have given its entries of @hash up.
+ * @pmap is filled with a pointer to the bucket's parent map.
+ *
+ * Unlock with qemu_spin_unlock(&b->lock).
+ *
+ * Note: callers cannot have ht->lock held, and must be in an RCU read-side
+ * critical section.
+ */
+static inline
+struct qht_bucket *qht_bucket_lock__no_stale(struct qht *ht, uint32_t hash,
+                                             struct qht_map **pmap)
+{
+    struct qht_bucket *b;
+    struct qht_map *map, *old;
+
+    map = atomic_rcu_read(&ht->map);
+    old = atomic_rcu_read(&map->resize_from);
+    if (unlikely(old)) {
+        qht_map_migrate_some(ht, old, hash);
+    }
+
+    for (;;) {
+        b = qht_map_to_bucket(map, hash);
+        qemu_spin_lock(&b->lock);
+        if (likely(!qht_map_bucket_is_migrated(map, hash &
+                                               (map->n_buckets - 1)))) {
+            *pmap = map;
+            return b;
+        }
+        qemu_spin_unlock(&b->lock);
+
+        /* a resize started after we read ht->map; follow the entries */
+        map = atomic_rcu_read(&map->resize_to);
+    }
+}
+
 static __attribute__((noinline)) void qht_grow_maybe(struct qht *ht)
 {
     struct qht_map *map;
@@ -596,11 +763,15 @@ static __attribute__((noinline)) void qht_grow_maybe(struct qht *ht)
         return;
     }
     map = ht->map;
-    /* another thread might have just performed the resize we were after */
-    if (qht_map_needs_resize(map)) {
+    /*
+     * Another thread might have just started the resize we were after.
+     * If the previous resize is still being migrated, let it complete
+     * first; writers will soon get us here again.
+     */
+    if (!map->resize_from && qht_map_needs_resize(map)) {
         struct qht_map *new = qht_map_create(map->n_buckets * 2);
 
-        qht_do_resize(ht, new);
+        qht_map_resize_begin__locked(ht, new);
     }
     qht_unlock(ht);
 }
@@ -615,10 +786,13 @@ bool qht_insert(struct qht *ht, void *p, uint32_t hash, void **existing)
     /* NULL pointers are not supported */
     qht_debug_assert(p);
 
+    /* keep the maps we look at alive, the caller might not do it for us */
+    rcu_read_lock();
     b = qht_bucket_lock__no_stale(ht, hash, &map);
     prev = qht_insert__locked(ht, map, b, p, hash, &needs_resize);
     qht_bucket_debug__locked(b);
     qemu_spin_unlock(&b->lock);
+    rcu_read_unlock();
 
     if (unlikely(needs_resize) && ht->mode & QHT_MODE_AUTO_RESIZE) {
         qht_grow_maybe(ht);
@@ -727,10 +901,12 @@ bool qht_remove(struct qht *ht, const void *p, uint32_t hash)
     /* NULL pointers are not supported */
     qht_debug_assert(p);
 
+    rcu_read_lock();
     b = qht_bucket_lock__no_stale(ht, hash, &map);
     ret = qht_remove__locked(map, b, p, hash);
     qht_bucket_debug__locked(b);
     qemu_spin_unlock(&b->lock);
+    rcu_read_unlock();
     return ret;
 }
 
@@ -765,49 +941,15 @@ void qht_iter(struct qht *ht, qht_iter_func_t func, void *userp)
 {
     struct qht_map *map;
 
-    map = atomic_rcu_read(&ht->map);
+    /* all entries must be in ht->map, and stay there while we iterate */
+    qht_lock(ht);
+    qht_map_resize_finish__locked(ht);
+    map = ht->map;
     qht_map_lock_buckets(map);
     /* Note: ht here is merely for carrying ht->mode; ht->map won't be read */
     qht_map_iter__all_locked(ht, map, func, userp);
     qht_map_unlock_buckets(map);
-}
-
-static void qht_map_copy(struct qht *ht, void *p, uint32_t hash, void *userp)
-{
-    struct qht_map *new = userp;
-    struct qht_bucket *b = qht_map_to_bucket(new, hash);
-
-    /* no need to acquire b->lock because no thread has seen this map yet */
-    qht_insert__locked(ht, new, b, p, hash, NULL);
-}
-
-/*
- * Atomically perform a resize and/or reset.
- * Call with ht->lock held.
- */
-static void qht_do_resize_reset(struct qht *ht, struct qht_map *new, bool reset)
-{
-    struct qht_map *old;
-
-    old = ht->map;
-    qht_map_lock_buckets(old);
-
-    if (reset) {
-        qht_map_reset__all_locked(old);
-    }
-
-    if (new == NULL) {
-        qht_map_unlock_buckets(old);
-        return;
-    }
-
-    g_assert(new->n_buckets != old->n_buckets);
-    qht_map_iter__all_locked(ht, old, qht_map_copy, new);
-    qht_map_debug__all_locked(new);
-
-    atomic_rcu_set(&ht->map, new);
-    qht_map_unlock_buckets(old);
-    call_rcu(old, qht_map_destroy, rcu);
+    qht_unlock(ht);
 }
 
 bool qht_resize(struct qht *ht, size_t n_elems)
@@ -816,11 +958,13 @@ bool qht_resize(struct qht *ht, size_t n_elems)
     size_t ret = false;
 
     qht_lock(ht);
+    qht_map_resize_finish__locked(ht);
     if (n_buckets != ht->map->n_buckets) {
         struct qht_map *new;
 
         new = qht_map_create(n_buckets);
-        qht_do_resize(ht, new);
+        qht_map_resize_begin__locked(ht, new);
+        qht_map_resize_finish__locked(ht);
         ret = true;
     }
     qht_unlock(ht);
@@ -828,12 +972,45 @@ bool qht_resize(struct qht *ht, size_t n_elems)
     return ret;
 }
 
+/* Count the entries in the chain of @head, and the buckets of the chain */
+static size_t qht_chain_entries(struct qht_bucket *head, size_t *n_buckets)
+{
+    struct qht_bucket *b;
+    unsigned int version;
+    size_t buckets;
+    size_t entries;
+    int j;
+
+    do {
+        version = seqlock_read_begin(&head->sequence);
+        buckets = 0;
+        entries = 0;
+        b = head;
+        do {
+            for (j = 0; j < QHT_BUCKET_ENTRIES; j++) {
+                if (atomic_read(&b->pointers[j]) == NULL) {
+                    break;
+                }
+                entries++;
+            }
+            buckets++;
+            b = atomic_rcu_read(&b->next);
+        } while (b);
+    } while (seqlock_read_retry(&head->sequence, version));
+
+    *n_buckets = buckets;
+    return entries;
+}
+
 /* pass @stats to qht_statistics_destroy() when done */
 void qht_statistics_init(struct qht *ht, struct qht_stats *stats)
 {
-    struct qht_map *map;
+    struct qht_map *map, *old;
+    size_t buckets;
     int i;
 
+    /* the old map of a resize may go away while we look at it */
+    rcu_read_lock();
     map = atomic_rcu_read(&ht->map);
 
     stats->used_head_buckets = 0;
@@ -843,34 +1020,13 @@ void qht_statistics_init(struct qht *ht, struct qht_stats *stats)
     /* bail out if the qht has not yet been initialized */
     if (unlikely(map == NULL)) {
         stats->head_buckets = 0;
+        rcu_read_unlock();
         return;
     }
     stats->head_buckets = map->n_buckets;
 
     for (i = 0; i < map->n_buckets; i++) {
-        struct qht_bucket *head = &map->buckets[i];
-        struct qht_bucket *b;
-        unsigned int version;
-        size_t buckets;
-        size_t entries;
-        int j;
-
-        do {
-            version = seqlock_read_begin(&head->sequence);
-            buckets = 0;
-            entries = 0;
-            b = head;
-            do {
-                for (j = 0; j < QHT_BUCKET_ENTRIES; j++) {
-                    if (atomic_read(&b->pointers[j]) == NULL) {
-                        break;
-                    }
-                    entries++;
-                }
-                buckets++;
-                b = atomic_rcu_read(&b->next);
-            } while (b);
-        } while (seqlock_read_retry(&head->sequence, version));
+        size_t entries = qht_chain_entries(&map->buckets[i], &buckets);
 
         if (entries) {
             qdist_inc(&stats->chain, buckets);
@@ -882,6 +1038,15 @@ void qht_statistics_init(struct qht *ht, struct qht_stats *stats)
             qdist_inc(&stats->occupancy, 0);
         }
     }
+
+    /* entries that a resize in progress has not migrated yet */
+    old = atomic_rcu_read(&map->resize_from);
+    if (old) {
+        for (i = 0; i < old->n_buckets; i++) {
+            stats->entries += qht_chain_entries(&old->buckets[i], &buckets);
+        }
+    }
+    rcu_read_unlock();
 }
 
 void qht_statistics_destroy(struct qht_stats *stats)
@@ -16,6 +16,12 @@
  * either due to blocking (e.g. cond_wait, mutex_lock) or cache line
  * contention (e.g. mutex_lock, mutex_trylock).
  *
+ * Coroutine locks (CoMutex, CoRwlock and CoQueue) are profiled as well. For
+ * those, the wait time is the time from the lock or wait call until the
+ * coroutine gets to run again with the lock held, which includes the time
+ * spent yielded. CoRwlock waits are attributed to the caller of rdlock,
+ * wrlock or upgrade, not to the CoMutex and CoQueue inside the rwlock.
+ *
  * QSP's design focuses on speed and scalability. This is achieved
  * by having threads do their profiling entirely on thread-local data.
  * The appropriate thread-local data is found via a QHT, i.e. a concurrent hash
@@ -26,7 +32,7 @@
  *
  * Reports are generated as a table where each row represents a call site. A
  * call site is the triplet formed by the __file__ and __LINE__ of the caller
- * as well as the address of the "object" (i.e. mutex, rec. mutex or condvar)
+ * as well as the address of the "object" (e.g. mutex, condvar or CoMutex)
  * being operated on. Optionally, call sites that operate on different objects
  * of the same type can be coalesced, which can be particularly useful when
  * profiling dynamically-allocated objects.
@@ -58,6 +64,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/thread.h"
+#include "qemu/coroutine.h"
 #include "qemu/timer.h"
 #include "qemu/qht.h"
 #include "qemu/rcu.h"
@@ -68,6 +75,9 @@ enum QSPType {
     QSP_BQL_MUTEX,
     QSP_REC_MUTEX,
     QSP_CONDVAR,
+    QSP_CO_MUTEX,
+    QSP_CO_RWLOCK,
+    QSP_CO_QUEUE,
 };
 
 struct QSPCallSite {
@@ -127,6 +137,9 @@ static const char * const qsp_typenames[] = {
     [QSP_BQL_MUTEX] = "BQL mutex",
     [QSP_REC_MUTEX] = "rec_mutex",
     [QSP_CONDVAR]   = "condvar",
+    [QSP_CO_MUTEX]  = "co_mutex",
+    [QSP_CO_RWLOCK] = "co_rwlock",
+    [QSP_CO_QUEUE]  = "co_queue",
 };
 
 QemuMutexLockFunc qemu_bql_mutex_lock_func = qemu_mutex_lock_impl;
@@ -136,6 +149,11 @@ QemuRecMutexLockFunc qemu_rec_mutex_lock_func = qemu_rec_mutex_lock_impl;
 QemuRecMutexTrylockFunc qemu_rec_mutex_trylock_func =
     qemu_rec_mutex_trylock_impl;
 QemuCondWaitFunc qemu_cond_wait_func = qemu_cond_wait_impl;
+QemuCoMutexLockFunc qemu_co_mutex_lock_func = qemu_co_mutex_lock_impl;
+QemuCoRwlockLockFunc qemu_co_rwlock_rdlock_func = qemu_co_rwlock_rdlock_impl;
+QemuCoRwlockLockFunc qemu_co_rwlock_upgrade_func = qemu_co_rwlock_upgrade_impl;
+QemuCoRwlockLockFunc qemu_co_rwlock_wrlock_func = qemu_co_rwlock_wrlock_impl;
+QemuCoQueueWaitFunc qemu_co_queue_wait_func = qemu_co_queue_wait_impl;
 
 /*
  * It pays off to _not_ hash callsite->file; hashing a string is slow, and
@@ -448,6 +466,56 @@ qsp_cond_wait(QemuCond *cond, QemuMutex *mutex, const char *file, int line)
     qsp_entry_record(e, t1 - t0);
 }
 
+/*
+ * A coroutine can be woken up in a different thread than the one it waited
+ * in. Look up the entry in a separate function, so that the compiler cannot
+ * reuse the address of qsp_thread that it computed before the wait.
+ */
+static __attribute__((noinline))
+void qsp_co_entry_record(const void *obj, const char *file, int line,
+                         enum QSPType type, int64_t delta)
+{
+    QSPEntry *e;
+
+    e = qsp_entry_get(obj, file, line, type);
+    qsp_entry_record(e, delta);
+}
+
+#define QSP_GEN_CO(type_, qsp_t_, func_, impl_)                         \
+    static void func_(type_ *obj, const char *file, int line)           \
+    {                                                                   \
+        int64_t t0, t1;                                                 \
+                                                                        \
+        t0 = get_clock();                                               \
+        impl_(obj, file, line);                                         \
+        t1 = get_clock();                                               \
+                                                                        \
+        qsp_co_entry_record(obj, file, line, qsp_t_, t1 - t0);          \
+    }
+
+QSP_GEN_CO(CoMutex, QSP_CO_MUTEX, qsp_co_mutex_lock, qemu_co_mutex_lock_impl)
+QSP_GEN_CO(CoRwlock, QSP_CO_RWLOCK, qsp_co_rwlock_rdlock,
+           qemu_co_rwlock_rdlock_impl)
+QSP_GEN_CO(CoRwlock, QSP_CO_RWLOCK, qsp_co_rwlock_upgrade,
+           qemu_co_rwlock_upgrade_impl)
+QSP_GEN_CO(CoRwlock, QSP_CO_RWLOCK, qsp_co_rwlock_wrlock,
+           qemu_co_rwlock_wrlock_impl)
+
+#undef QSP_GEN_CO
+
+static void coroutine_fn
+qsp_co_queue_wait(CoQueue *queue, QemuLockable *lock, const char *file,
+                  int line)
+{
+    int64_t t0, t1;
+
+    t0 = get_clock();
+    qemu_co_queue_wait_impl(queue, lock, file, line);
+    t1 = get_clock();
+
+    qsp_co_entry_record(queue, file, line, QSP_CO_QUEUE, t1 - t0);
+}
+
 bool qsp_is_enabled(void)
 {
     return atomic_read(&qemu_mutex_lock_func) == qsp_mutex_lock;
@@ -461,6 +529,11 @@ void qsp_enable(void)
     atomic_set(&qemu_rec_mutex_lock_func, qsp_rec_mutex_lock);
     atomic_set(&qemu_rec_mutex_trylock_func, qsp_rec_mutex_trylock);
     atomic_set(&qemu_cond_wait_func, qsp_cond_wait);
+    atomic_set(&qemu_co_mutex_lock_func, qsp_co_mutex_lock);
+    atomic_set(&qemu_co_rwlock_rdlock_func, qsp_co_rwlock_rdlock);
+    atomic_set(&qemu_co_rwlock_upgrade_func, qsp_co_rwlock_upgrade);
+    atomic_set(&qemu_co_rwlock_wrlock_func, qsp_co_rwlock_wrlock);
+    atomic_set(&qemu_co_queue_wait_func, qsp_co_queue_wait);
 }
 
 void qsp_disable(void)
@@ -471,6 +544,11 @@ void qsp_disable(void)
     atomic_set(&qemu_rec_mutex_lock_func, qemu_rec_mutex_lock_impl);
     atomic_set(&qemu_rec_mutex_trylock_func, qemu_rec_mutex_trylock_impl);
     atomic_set(&qemu_cond_wait_func, qemu_cond_wait_impl);
+    atomic_set(&qemu_co_mutex_lock_func, qemu_co_mutex_lock_impl);
+    atomic_set(&qemu_co_rwlock_rdlock_func, qemu_co_rwlock_rdlock_impl);
+    atomic_set(&qemu_co_rwlock_upgrade_func, qemu_co_rwlock_upgrade_impl);
+    atomic_set(&qemu_co_rwlock_wrlock_func, qemu_co_rwlock_wrlock_impl);
+    atomic_set(&qemu_co_queue_wait_func, qemu_co_queue_wait_impl);
 }
 
 static gint qsp_tree_cmp(gconstpointer ap, gconstpointer bp, gpointer up)
@@ -49,6 +49,10 @@ struct ThreadPoolElement {
     /* Access to this list is protected by lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
+    /* Lock-free lists, see ThreadPool.  */
+    QSLIST_ENTRY(ThreadPoolElement) submitted;
+    QSLIST_ENTRY(ThreadPoolElement) done;
+
     /* Access to this list is protected by the global mutex.  */
     QLIST_ENTRY(ThreadPoolElement) all;
 };
@@ -64,8 +68,22 @@ struct ThreadPool {
 
     /* The following variables are only accessed from one AioContext. */
     QLIST_HEAD(, ThreadPoolElement) head;
+    QSLIST_HEAD(, ThreadPoolElement) completing;
+
+    /* New requests are pushed here without taking lock, and moved to
+     * request_list by whoever takes lock next.
+     */
+    QSLIST_HEAD(, ThreadPoolElement) submitted;
+
+    /* Workers push finished requests here without taking lock, and
+     * the completion bottom half takes them all at once.
+     */
+    QSLIST_HEAD(, ThreadPoolElement) completed;
 
-    /* The following variables are protected by lock.  */
+    /* The following variables are protected by lock.  cur_threads and
+     * idle_threads are also read without it when submitting requests,
+     * and are therefore updated with atomic operations.
+     */
     QTAILQ_HEAD(, ThreadPoolElement) request_list;
     int cur_threads;
     int idle_threads;
@@ -74,6 +92,46 @@ struct ThreadPool {
     bool stopping;
 };
 
+/* Move submitted requests to request_list, oldest first.  Runs with
+ * lock taken.
+ */
+static void thread_pool_flush_submitted(ThreadPool *pool)
+{
+    QSLIST_HEAD(, ThreadPoolElement) batch, fifo = { NULL };
+    ThreadPoolElement *req;
+
+    QSLIST_MOVE_ATOMIC(&batch, &pool->submitted);
+    while ((req = QSLIST_FIRST(&batch))) {
+        QSLIST_REMOVE_HEAD(&batch, submitted);
+        QSLIST_INSERT_HEAD(&fifo, req, submitted);
+    }
+    while ((req = QSLIST_FIRST(&fifo))) {
+        QSLIST_REMOVE_HEAD(&fifo, submitted);
+        QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
+    }
+}
+
+static void thread_pool_push_completed(ThreadPool *pool,
+                                       ThreadPoolElement *req)
+{
+    ThreadPoolElement *old;
+
+    /* req may be freed as soon as it is visible on the list, so remember
+     * whether the list was empty before publishing it.
+     */
+    do {
+        old = atomic_read(&pool->completed.slh_first);
+        req->done.sle_next = old;
+    } while (atomic_cmpxchg(&pool->completed.slh_first, old, req) != old);
+
+    /* The bottom half takes the whole list, so only the request that
+     * made it non-empty needs to schedule it.
+     */
+    if (!old) {
+        qemu_bh_schedule(pool->completion_bh);
+    }
+}
+
 static void *worker_thread(void *opaque)
 {
     ThreadPool *pool = opaque;
@@ -87,16 +145,24 @@ static void *worker_thread(void *opaque)
         int ret;
 
         do {
-            pool->idle_threads++;
+            atomic_inc(&pool->idle_threads);
             qemu_mutex_unlock(&pool->lock);
             ret = qemu_sem_timedwait(&pool->sem, 10000);
             qemu_mutex_lock(&pool->lock);
-            pool->idle_threads--;
-        } while (ret == -1 && !QTAILQ_EMPTY(&pool->request_list));
+            atomic_dec(&pool->idle_threads);
+
+            /* Read submitted after idle_threads is decremented; pairs
+             * with the cmpxchg in thread_pool_submit_aio().
+             */
+            smp_mb();
+        } while (ret == -1 && (!QTAILQ_EMPTY(&pool->request_list) ||
+                               atomic_read(&pool->submitted.slh_first)));
         if (ret == -1 || pool->stopping) {
             break;
         }
 
+        thread_pool_flush_submitted(pool);
+
         req = QTAILQ_FIRST(&pool->request_list);
         QTAILQ_REMOVE(&pool->request_list, req, reqs);
         req->state = THREAD_ACTIVE;
@@ -109,12 +175,12 @@ static void *worker_thread(void *opaque)
         smp_wmb();
         req->state = THREAD_DONE;
 
-        qemu_mutex_lock(&pool->lock);
+        thread_pool_push_completed(pool, req);
 
-        qemu_bh_schedule(pool->completion_bh);
+        qemu_mutex_lock(&pool->lock);
     }
 
-    pool->cur_threads--;
+    atomic_dec(&pool->cur_threads);
     qemu_cond_signal(&pool->worker_stopped);
     qemu_mutex_unlock(&pool->lock);
     return NULL;
@@ -146,7 +212,7 @@ static void spawn_thread_bh_fn(void *opaque)
 
 static void spawn_thread(ThreadPool *pool)
 {
-    pool->cur_threads++;
+    atomic_inc(&pool->cur_threads);
     pool->new_threads++;
     /* If there are threads being created, they will spawn new workers, so
      * we don't spend time creating many threads in a loop holding a mutex or
@@ -163,15 +229,27 @@ static void spawn_thread(ThreadPool *pool)
 static void thread_pool_completion_bh(void *opaque)
 {
     ThreadPool *pool = opaque;
-    ThreadPoolElement *elem, *next;
+    ThreadPoolElement *elem;
 
     aio_context_acquire(pool->ctx);
-restart:
-    QLIST_FOREACH_SAFE(elem, &pool->head, all, next) {
-        if (elem->state != THREAD_DONE) {
-            continue;
+    for (;;) {
+        if (QSLIST_EMPTY(&pool->completing)) {
+            QSLIST_HEAD(, ThreadPoolElement) lifo;
+
+            /* Complete requests in the order they finished */
+            QSLIST_MOVE_ATOMIC(&lifo, &pool->completed);
+            if (QSLIST_EMPTY(&lifo)) {
+                break;
+            }
+            while ((elem = QSLIST_FIRST(&lifo))) {
+                QSLIST_REMOVE_HEAD(&lifo, done);
+                QSLIST_INSERT_HEAD(&pool->completing, elem, done);
+            }
         }
 
+        elem = QSLIST_FIRST(&pool->completing);
+        QSLIST_REMOVE_HEAD(&pool->completing, done);
+
         trace_thread_pool_complete(pool, elem, elem->common.opaque,
                                    elem->ret);
         QLIST_REMOVE(elem, all);
@@ -190,16 +268,12 @@ restart:
             aio_context_acquire(pool->ctx);
 
             /* We can safely cancel the completion_bh here regardless of someone
-             * else having scheduled it meanwhile because we reenter the
-             * completion function anyway (goto restart).
+             * else having scheduled it meanwhile because we loop and look at
+             * pool->completed again anyway.
              */
             qemu_bh_cancel(pool->completion_bh);
-
-            qemu_aio_unref(elem);
-            goto restart;
-        } else {
-            qemu_aio_unref(elem);
         }
+        qemu_aio_unref(elem);
     }
     aio_context_release(pool->ctx);
 }
@@ -212,6 +286,7 @@ static void thread_pool_cancel(BlockAIOCB *acb)
     trace_thread_pool_cancel(elem, elem->common.opaque);
 
     qemu_mutex_lock(&pool->lock);
+    thread_pool_flush_submitted(pool);
     if (elem->state == THREAD_QUEUED &&
         /* No thread has yet started working on elem. we can try to "steal"
          * the item from the worker if we can get a signal from the
@@ -220,10 +295,10 @@ static void thread_pool_cancel(BlockAIOCB *acb)
          */
         qemu_sem_timedwait(&pool->sem, 0) == 0) {
         QTAILQ_REMOVE(&pool->request_list, elem, reqs);
-        qemu_bh_schedule(pool->completion_bh);
 
         elem->state = THREAD_DONE;
         elem->ret = -ECANCELED;
+        thread_pool_push_completed(pool, elem);
     }
 
     qemu_mutex_unlock(&pool->lock);
@@ -258,12 +333,19 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
 
     trace_thread_pool_submit(pool, req, arg);
 
-    qemu_mutex_lock(&pool->lock);
-    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
-        spawn_thread(pool);
+    /* The cmpxchg orders the push before reading idle_threads, so that
+     * a worker that is timing out either sees the request or is not
+     * counted as idle anymore.
+     */
+    QSLIST_INSERT_HEAD_ATOMIC(&pool->submitted, req, submitted);
+    if (atomic_read(&pool->idle_threads) == 0 &&
+        atomic_read(&pool->cur_threads) < pool->max_threads) {
+        qemu_mutex_lock(&pool->lock);
+        if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
+            spawn_thread(pool);
+        }
+        qemu_mutex_unlock(&pool->lock);
     }
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
-    qemu_mutex_unlock(&pool->lock);
     qemu_sem_post(&pool->sem);
     return &req->common;
 }
@@ -312,6 +394,9 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
     QLIST_INIT(&pool->head);
+    QSLIST_INIT(&pool->completing);
+    QSLIST_INIT(&pool->submitted);
+    QSLIST_INIT(&pool->completed);
     QTAILQ_INIT(&pool->request_list);
 }
 
@@ -334,7 +419,7 @@ void thread_pool_free(ThreadPool *pool)
 
     /* Stop new threads from spawning */
     qemu_bh_delete(pool->new_thread_bh);
-    pool->cur_threads -= pool->new_threads;
+    atomic_sub(&pool->cur_threads, pool->new_threads);
     pool->new_threads = 0;
 
     /* Wait for worker threads to terminate */